@@ -156,6 +156,9 @@ public:
   std::shared_ptr<ExprTerm> first = nullptr;
   std::optional<Token> op = std::nullopt;
   std::shared_ptr<Expr> rest = nullptr;
+  // type of both operands of op (set by the semantic checker when the
+  // operands have the same, non-null type)
+  std::optional<DataType> op_type = std::nullopt;
   void accept(Visitor& v) { v.visit(*this); }  
   Token first_token() {return first->first_token();}
 };
@@ -5,8 +5,12 @@
 // DESC: Code Generator using Visitor Pattern
 //----------------------------------------------------------------------
 
+#include <functional>
 #include <iostream> // for debugging
 #include "code_generator.h"
+#include "path_cse.h"
+#include "peephole.h"
+#include "ssa_passes.h"
 
 using namespace std;
 
@@ -20,14 +24,48 @@ void replace_all(string &s, const string &old_str, const string &new_str)
 CodeGenerator::CodeGenerator(VM &vm)
     : vm(vm)
 {
+  // remove the jump scaffolding (so the SSA passes see fewer blocks),
+  // propagate constants, remove the stores that made dead, clean up
+  // the branches folded, and then reuse repeated values and path loads
+  passes.add("peephole", [](VMFrameInfo &frame, const ArgCounts &) {
+    return peephole(frame);
+  });
+  passes.add("sccp", propagate_constants);
+  passes.add("dse", eliminate_dead_stores);
+  passes.add("peephole", [](VMFrameInfo &frame, const ArgCounts &) {
+    return peephole(frame);
+  });
+  passes.add("gvn", number_values);
+  passes.add("path-cse", [](VMFrameInfo &frame, const ArgCounts &) {
+    return reuse_path_loads(frame);
+  });
+}
+
+const PassManager &CodeGenerator::pass_manager() const
+{
+  return passes;
 }
 
 void CodeGenerator::visit(Program &p)
 {
+  p.accept(escape_analyzer);
   for (auto &struct_def : p.struct_defs)
     struct_def.accept(*this);
   for (auto &fun_def : p.fun_defs)
     fun_def.accept(*this);
+  // inline small functions, optimize, and add the frames to the VM
+  inline_calls();
+  ArgCounts arg_counts;
+  for (const auto &frame : frames)
+    arg_counts[frame.function_name] = frame.arg_count;
+  for (auto &frame : frames)
+  {
+    passes.run(frame, arg_counts);
+    vm.add(frame);
+  }
+  frames.clear();
+  // resolve calls now that every function has been generated
+  vm.link();
 }
 
 void CodeGenerator::visit(FunDef &f)
@@ -37,6 +75,8 @@ void CodeGenerator::visit(FunDef &f)
   new_frame.function_name = f.fun_name.lexeme();
   new_frame.arg_count = f.params.size();
   curr_frame = new_frame;
+  scalar_vars = escape_analyzer.scalar_vars(f.fun_name.lexeme());
+  region_vars = escape_analyzer.region_vars(f.fun_name.lexeme());
 
   // - Push a new variable environment (via var_table)
   var_table.push_environment();
@@ -45,10 +85,9 @@ void CodeGenerator::visit(FunDef &f)
   for (auto &arg : f.params)
   {
     // save var to var_table
-    var_table.add(arg.var_name.lexeme());
+    int index = add_var(arg.var_name.lexeme(), arg.data_type.type_name);
 
     // add STORE instruction
-    int index = var_table.get(arg.var_name.lexeme());
     VMInstr instr = VMInstr::STORE(index);
     curr_frame.instructions.push_back(instr);
   }
@@ -62,7 +101,8 @@ void CodeGenerator::visit(FunDef &f)
   // - Add a return if last statement WASN'T a return
   if (curr_frame.instructions.size() > 0)
   {
-    if (curr_frame.instructions[curr_frame.instructions.size() - 1].opcode() != OpCode::RET)
+    OpCode last = curr_frame.instructions.back().opcode();
+    if (last != OpCode::RET and last != OpCode::TAILCALL)
     {
       curr_frame.instructions.push_back(VMInstr::PUSH("null"));
       curr_frame.instructions.push_back(VMInstr::RET());
@@ -77,33 +117,65 @@ void CodeGenerator::visit(FunDef &f)
   // - Pop the variable environment
   var_table.pop_environment();
 
-  // - Add the frame to the VM
-  vm.add(curr_frame);
+  // - Save the frame (for the VM, once every frame is generated)
+  frames.push_back(curr_frame);
 }
 
 void CodeGenerator::visit(StructDef &s)
 {
   // remember the struct def for later
   struct_defs[s.struct_name.lexeme()] = s;
+
+  // and give the vm the struct's layout (for ALLOCS)
+  vector<string> fields;
+  for (auto &field : s.fields)
+    fields.push_back(field.var_name.lexeme());
+  vm.add_struct(s.struct_name.lexeme(), fields);
 }
 
 void CodeGenerator::visit(ReturnStmt &s)
 {
   s.expr.accept(*this);
-  curr_frame.instructions.push_back(VMInstr::RET());
+
+  // a call whose result is returned replaces the frame instead, unless
+  // the frame has region objects (that the arguments may refer to)
+  VMInstr &last = curr_frame.instructions.back();
+  if (last.opcode() == OpCode::CALL and region_vars.empty())
+    last = VMInstr::TAILCALL(get<string>(last.operand().value()));
+  else
+    curr_frame.instructions.push_back(VMInstr::RET());
 }
 
 void CodeGenerator::visit(WhileStmt &s)
 {
+  // an environment for the locals holding the loop's invariants
+  var_table.push_environment();
+  LoopAnalyzer analyzer = loop_analyzer();
+  vector<LoopAnalyzer::Invariant> invariants = analyzer.invariants(s);
+  vector<int> jmpfs;
+
+  // with invariants, the condition is first tested on its own, and the
+  // invariants computed once it holds (the loop then tests at the end)
+  if (!invariants.empty())
+  {
+    s.condition.accept(*this);
+    curr_frame.instructions.push_back(VMInstr::JMPF(-1));
+    jmpfs.push_back(curr_frame.instructions.size() - 1);
+  }
+  vector<string> keys = hoist(invariants);
+
   // grab starting index of first instruction (to jump back to
   int start = curr_frame.instructions.size();
 
-  // call the while condition visitor
-  s.condition.accept(*this);
+  if (invariants.empty())
+  {
+    // call the while condition visitor
+    s.condition.accept(*this);
 
-  // add a JMPF instruction with a temp operand of -1
-  curr_frame.instructions.push_back(VMInstr::JMPF(-1));
-  int jmpf = curr_frame.instructions.size() - 1;
+    // add a JMPF instruction with a temp operand of -1
+    curr_frame.instructions.push_back(VMInstr::JMPF(-1));
+    jmpfs.push_back(curr_frame.instructions.size() - 1);
+  }
 
   // push an environment in var table
   var_table.push_environment();
@@ -115,6 +187,13 @@ void CodeGenerator::visit(WhileStmt &s)
   // pop the environment
   var_table.pop_environment();
 
+  if (!invariants.empty())
+  {
+    s.condition.accept(*this);
+    curr_frame.instructions.push_back(VMInstr::JMPF(-1));
+    jmpfs.push_back(curr_frame.instructions.size() - 1);
+  }
+
   // add a JMP to the starting index
   curr_frame.instructions.push_back(VMInstr::JMP(start));
 
@@ -122,8 +201,13 @@ void CodeGenerator::visit(WhileStmt &s)
   curr_frame.instructions.push_back(VMInstr::NOP());
   int nop = curr_frame.instructions.size() - 1;
 
-  // update previous JMPF instr to refer to NOP
-  curr_frame.instructions.at(jmpf).set_operand(nop);
+  // update previous JMPF instrs to refer to NOP
+  for (int jmpf : jmpfs)
+    curr_frame.instructions.at(jmpf).set_operand(nop);
+
+  for (const string &key : keys)
+    hoisted.erase(key);
+  var_table.pop_environment();
 }
 
 void CodeGenerator::visit(ForStmt &s)
@@ -133,13 +217,27 @@ void CodeGenerator::visit(ForStmt &s)
 
   s.var_decl.accept(*this);
 
-  int start = curr_frame.instructions.size();
-
-  s.condition.accept(*this);
+  // as for while, with invariants the condition is tested once before
+  // they are computed, and then at the end of each iteration
+  LoopAnalyzer analyzer = loop_analyzer();
+  vector<LoopAnalyzer::Invariant> invariants = analyzer.invariants(s);
+  vector<int> jmpf_indexes;
+  if (!invariants.empty())
+  {
+    s.condition.accept(*this);
+    curr_frame.instructions.push_back(VMInstr::JMPF(10000));
+    jmpf_indexes.push_back(curr_frame.instructions.size() - 1);
+  }
+  vector<string> keys = hoist(invariants);
 
-  curr_frame.instructions.push_back(VMInstr::JMPF(10000));
+  int start = curr_frame.instructions.size();
 
-  int jmpf_index = curr_frame.instructions.size() - 1;
+  if (invariants.empty())
+  {
+    s.condition.accept(*this);
+    curr_frame.instructions.push_back(VMInstr::JMPF(10000));
+    jmpf_indexes.push_back(curr_frame.instructions.size() - 1);
+  }
 
   // "rest similar as while (within another pushed and popped env)"
   var_table.push_environment();
@@ -153,15 +251,25 @@ void CodeGenerator::visit(ForStmt &s)
 
   s.assign_stmt.accept(*this);
 
+  if (!invariants.empty())
+  {
+    s.condition.accept(*this);
+    curr_frame.instructions.push_back(VMInstr::JMPF(10000));
+    jmpf_indexes.push_back(curr_frame.instructions.size() - 1);
+  }
+
   // add the JMP, NOP
   curr_frame.instructions.push_back(VMInstr::JMP(start));
   curr_frame.instructions.push_back(VMInstr::NOP());
 
   int nop = curr_frame.instructions.size() - 1;
 
-  // update the JMPF
-  VMInstr jmpf = VMInstr::JMPF(curr_frame.instructions.size() - 1);
-  curr_frame.instructions[jmpf_index] = jmpf; // overwrites the jmpf(10000)
+  // update the JMPFs
+  for (int jmpf_index : jmpf_indexes)
+    curr_frame.instructions[jmpf_index] = VMInstr::JMPF(nop); // overwrites the jmpf(10000)
+
+  for (const string &key : keys)
+    hoisted.erase(key);
 
   // pop the environment for vardecl
   var_table.pop_environment();
@@ -213,45 +321,63 @@ void CodeGenerator::visit(IfStmt &s)
 
 void CodeGenerator::visit(VarDeclStmt &s)
 {
+  string name = s.var_def.var_name.lexeme();
+  string type = s.var_def.data_type.type_name;
+  if (scalar_vars.contains(name))
+  {
+    // the object never leaves the function, so its fields are locals
+    for (auto &field : struct_defs[type].fields)
+    {
+      curr_frame.instructions.push_back(VMInstr::PUSH(nullptr));
+      string field_name = name + "." + field.var_name.lexeme();
+      VMInstr instr = VMInstr::STORE(add_var(field_name, field.data_type.type_name));
+      instr.set_comment(field_name);
+      curr_frame.instructions.push_back(instr);
+    }
+    return;
+  }
+  region_alloc = region_vars.contains(name);
   s.expr.accept(*this);
-  var_table.add(s.var_def.var_name.lexeme());
-  VMInstr instr = VMInstr::STORE(var_table.get(s.var_def.var_name.lexeme()));
+  region_alloc = false;
+  VMInstr instr = VMInstr::STORE(add_var(name, type));
   curr_frame.instructions.push_back(instr);
 }
 
 void CodeGenerator::visit(AssignStmt &s)
 {
-  if (s.lvalue.size() > 1)
+  vector<VarRef> lvalue = local_path(s.lvalue);
+  if (lvalue.size() > 1)
   {
-    int main_oid = var_table.get(s.lvalue.at(0).var_name.lexeme());
+    int main_oid = var_table.get(lvalue.at(0).var_name.lexeme());
+    string type = var_types[main_oid];
     VMInstr instr = VMInstr::LOAD(main_oid);
     curr_frame.instructions.push_back(instr);
 
-    if (s.lvalue.at(0).array_expr.has_value())
+    if (lvalue.at(0).array_expr.has_value())
     {
-      s.lvalue.at(0).array_expr.value().accept(*this);
+      lvalue.at(0).array_expr.value().accept(*this);
       curr_frame.instructions.push_back(VMInstr::GETI());
     }
 
-    for (int i = 1; i < s.lvalue.size() - 1; i++)
+    for (int i = 1; i < lvalue.size() - 1; i++)
     {
-      string path = s.lvalue.at(i).var_name.lexeme();
-      instr = VMInstr::GETF(path);
+      string path = lvalue.at(i).var_name.lexeme();
+      instr = field_instr(type, path, false);
       curr_frame.instructions.push_back(instr);
-      if (s.lvalue.at(i).array_expr.has_value())
+      if (lvalue.at(i).array_expr.has_value())
       {
-        s.lvalue.at(i).array_expr.value().accept(*this);
+        lvalue.at(i).array_expr.value().accept(*this);
         curr_frame.instructions.push_back(VMInstr::GETI());
       }
     }
 
-    string path = s.lvalue.at(s.lvalue.size() - 1).var_name.lexeme();
+    string path = lvalue.at(lvalue.size() - 1).var_name.lexeme();
 
-    if (s.lvalue.at(s.lvalue.size() - 1).array_expr.has_value())
+    if (lvalue.at(lvalue.size() - 1).array_expr.has_value())
     {
-      instr = VMInstr::GETF(path);
+      instr = field_instr(type, path, false);
       curr_frame.instructions.push_back(instr);
-      s.lvalue.at(s.lvalue.size() - 1).array_expr.value().accept(*this);
+      lvalue.at(lvalue.size() - 1).array_expr.value().accept(*this);
       
       // pushes the val that the path will be set to
       s.expr.accept(*this); 
@@ -263,19 +389,19 @@ void CodeGenerator::visit(AssignStmt &s)
       // pushes the val needed for the path
       s.expr.accept(*this);
 
-      instr = VMInstr::SETF(path);
+      instr = field_instr(type, path, true);
       curr_frame.instructions.push_back(instr);
     }
   }
-  else if (s.lvalue.at(0).array_expr.has_value())
+  else if (lvalue.at(0).array_expr.has_value())
   {
     // get the array
-    int oid = var_table.get(s.lvalue.at(0).var_name.lexeme());
+    int oid = var_table.get(lvalue.at(0).var_name.lexeme());
     VMInstr instr = VMInstr::LOAD(oid);
     curr_frame.instructions.push_back(instr);
 
     // push the index that will be modified
-    s.lvalue.at(0).array_expr.value().accept(*this);
+    lvalue.at(0).array_expr.value().accept(*this);
 
     // push the rhs
     s.expr.accept(*this);
@@ -283,7 +409,7 @@ void CodeGenerator::visit(AssignStmt &s)
   }
   else // s.lavlue.size() <= 1, and doesn't have an array expr value
   {
-    int oid = var_table.get(s.lvalue.at(0).var_name.lexeme());
+    int oid = var_table.get(lvalue.at(0).var_name.lexeme());
     s.expr.accept(*this);
     VMInstr instr = VMInstr::STORE(oid);
     curr_frame.instructions.push_back(VMInstr::STORE(oid));
@@ -292,6 +418,17 @@ void CodeGenerator::visit(AssignStmt &s)
 
 void CodeGenerator::visit(CallExpr &e)
 {
+  // a hoisted loop invariant is already in a local
+  if (!hoisted.empty())
+  {
+    optional<string> key = LoopAnalyzer::key(e);
+    if (key.has_value() and hoisted.contains(key.value()))
+    {
+      curr_frame.instructions.push_back(VMInstr::LOAD(hoisted[key.value()]));
+      return;
+    }
+  }
+
   string name = e.fun_name.lexeme();
 
   for (auto arg : e.args)
@@ -352,57 +489,25 @@ void CodeGenerator::visit(Expr &e)
 
   if (e.op.has_value())
   {
-    e.rest->accept(*this);
     string op = e.op.value().lexeme();
-
-    if (op == "+")
-    {
-      curr_frame.instructions.push_back(VMInstr::ADD());
-    }
-    else if (op == "-")
-    {
-      curr_frame.instructions.push_back(VMInstr::SUB());
-    }
-    else if (op == "*")
-    {
-      curr_frame.instructions.push_back(VMInstr::MUL());
-    }
-    else if (op == "/")
-    {
-      curr_frame.instructions.push_back(VMInstr::DIV());
-    }
-    else if (op == "and")
-    {
-      curr_frame.instructions.push_back(VMInstr::AND());
-    }
-    else if (op == "or")
-    {
-      curr_frame.instructions.push_back(VMInstr::OR());
-    }
-    else if (op == "<")
-    {
-      curr_frame.instructions.push_back(VMInstr::CMPLT());
-    }
-    else if (op == "<=")
-    {
-      curr_frame.instructions.push_back(VMInstr::CMPLE());
-    }
-    else if (op == ">")
+    if (op == "and" or op == "or")
     {
-      curr_frame.instructions.push_back(VMInstr::CMPGT());
-    }
-    else if (op == ">=")
-    {
-      curr_frame.instructions.push_back(VMInstr::CMPGE());
-    }
-    else if (op == "==")
-    {
-      curr_frame.instructions.push_back(VMInstr::CMPEQ());
-    }
-    else if (op == "!=")
-    {
-      curr_frame.instructions.push_back(VMInstr::CMPNE());
+      // short circuit: a false (and) or true (or) first operand is the
+      // result, otherwise it is popped and the rest is the result
+      curr_frame.instructions.push_back(VMInstr::DUP());
+      if (op == "or")
+        curr_frame.instructions.push_back(VMInstr::NOT());
+      curr_frame.instructions.push_back(VMInstr::JMPF(-1));
+      int jmpf = curr_frame.instructions.size() - 1;
+      curr_frame.instructions.push_back(VMInstr::POP());
+      e.rest->accept(*this);
+      curr_frame.instructions.push_back(VMInstr::NOP());
+      int nop = curr_frame.instructions.size() - 1;
+      curr_frame.instructions.at(jmpf).set_operand(nop);
+      return;
     }
+    e.rest->accept(*this);
+    curr_frame.instructions.push_back(op_instr(op, e.op_type));
   }
 }
 
@@ -478,39 +583,421 @@ void CodeGenerator::visit(NewRValue &v)
 
     curr_frame.instructions.push_back(VMInstr::PUSH(nullptr));
 
-    curr_frame.instructions.push_back(VMInstr::ALLOCA());
+    // int, double, and bool arrays are stored unboxed
+    string type = v.type.lexeme();
+    if (type == "int" or type == "double" or type == "bool")
+      curr_frame.instructions.push_back(VMInstr::ALLOCA(type));
+    else
+      curr_frame.instructions.push_back(VMInstr::ALLOCA());
   }
   else if (struct_defs.contains(v.type.lexeme()))
   {
-    curr_frame.instructions.push_back(VMInstr::ALLOCS());
-
-    StructDef sd = struct_defs[v.first_token().lexeme()];
-
-    for (auto &field : sd.fields)
-    {
-      curr_frame.instructions.push_back(VMInstr::DUP());
-      curr_frame.instructions.push_back(VMInstr::ADDF(field.var_name.lexeme()));
-      curr_frame.instructions.push_back(VMInstr::DUP());
-      curr_frame.instructions.push_back(VMInstr::PUSH(nullptr));
-      curr_frame.instructions.push_back(VMInstr::SETF(field.var_name.lexeme()));
-    }
+    // a single instruction creates the object with all of its fields
+    // (null), in definition order, so a field's slot is its position in
+    // the struct definition
+    string type = v.type.lexeme();
+    if (region_alloc)
+      curr_frame.instructions.push_back(VMInstr::ALLOCR(type));
+    else
+      curr_frame.instructions.push_back(VMInstr::ALLOCS(type));
   }
 }
 
 void CodeGenerator::visit(VarRValue &v)
 {
-  for (int i = 0; i < v.path.size(); i++)
+  // a hoisted loop invariant (the path or a prefix of it) is already in
+  // a local, so only the rest of the path is loaded
+  for (int length = v.path.size(); length > 0 and !hoisted.empty(); --length)
+  {
+    for (bool index : {true, false})
+    {
+      optional<string> key = LoopAnalyzer::key(v, length, index);
+      if (!key.has_value() or !hoisted.contains(key.value()))
+        continue;
+      int local = hoisted[key.value()];
+      string type = var_types[local];
+      curr_frame.instructions.push_back(VMInstr::LOAD(local));
+      if (!index and v.path[length - 1].array_expr.has_value())
+      {
+        v.path[length - 1].array_expr->accept(*this);
+        curr_frame.instructions.push_back(VMInstr::GETI());
+      }
+      for (int i = length; i < v.path.size(); i++)
+      {
+        curr_frame.instructions.push_back(field_instr(type, v.path[i].var_name.lexeme(), false));
+        if (v.path[i].array_expr.has_value())
+        {
+          v.path[i].array_expr->accept(*this);
+          curr_frame.instructions.push_back(VMInstr::GETI());
+        }
+      }
+      return;
+    }
+  }
+
+  vector<VarRef> path = local_path(v.path);
+  string type;
+  for (int i = 0; i < path.size(); i++)
   {
     if (i > 0)
-      curr_frame.instructions.push_back(VMInstr::GETF(v.path[i].var_name.lexeme()));
+      curr_frame.instructions.push_back(field_instr(type, path[i].var_name.lexeme(), false));
     else
-      curr_frame.instructions.push_back(VMInstr::LOAD(var_table.get(v.path[i].var_name.lexeme())));
+    {
+      int index = var_table.get(path[i].var_name.lexeme());
+      type = var_types[index];
+      curr_frame.instructions.push_back(VMInstr::LOAD(index));
+    }
 
     // check if array
-    if (v.path[i].array_expr.has_value())
+    if (path[i].array_expr.has_value())
     {
-      v.path[i].array_expr->accept(*this);
+      path[i].array_expr->accept(*this);
       curr_frame.instructions.push_back(VMInstr::GETI());
     }
   }
-}
\ No newline at end of file
+}
+
+
+LoopAnalyzer CodeGenerator::loop_analyzer()
+{
+  return LoopAnalyzer(struct_defs, scalar_vars, [this](const string& name) {
+    int index = var_table.get(name);
+    return var_types.contains(index) ? var_types[index] : string("");
+  });
+}
+
+vector<string> CodeGenerator::hoist(const vector<LoopAnalyzer::Invariant>& invariants)
+{
+  vector<string> keys;
+  for (auto &invariant : invariants)
+  {
+    // (already hoisted by an enclosing loop)
+    if (hoisted.contains(invariant.key))
+      continue;
+    invariant.rvalue->accept(*this);
+    int index = add_var("$" + invariant.key, invariant.type);
+    VMInstr instr = VMInstr::STORE(index);
+    instr.set_comment(invariant.key);
+    curr_frame.instructions.push_back(instr);
+    hoisted[invariant.key] = index;
+    keys.push_back(invariant.key);
+  }
+  return keys;
+}
+
+int CodeGenerator::add_var(const string& name, const string& type)
+{
+  var_table.add(name);
+  int index = var_table.get(name);
+  var_types[index] = type;
+  return index;
+}
+
+vector<VarRef> CodeGenerator::local_path(const vector<VarRef>& path) const
+{
+  if (path.size() < 2 or !scalar_vars.contains(path[0].var_name.lexeme()))
+    return path;
+  vector<VarRef> new_path(path.begin() + 1, path.end());
+  Token field = path[1].var_name;
+  new_path[0].var_name = Token(field.type(), path[0].var_name.lexeme() + "." +
+                               field.lexeme(), field.line(), field.column());
+  return new_path;
+}
+
+VMInstr CodeGenerator::field_instr(string& type, const string& field, bool set)
+{
+  if (struct_defs.contains(type))
+  {
+    const StructDef& sd = struct_defs[type];
+    for (int slot = 0; slot < sd.fields.size(); ++slot)
+    {
+      if (sd.fields[slot].var_name.lexeme() != field)
+        continue;
+      type = sd.fields[slot].data_type.type_name;
+      VMInstr instr = set ? VMInstr::SETF(slot) : VMInstr::GETF(slot);
+      instr.set_comment(field);
+      return instr;
+    }
+  }
+  // unknown struct type, so look the field up by name at run time
+  type = "";
+  return set ? VMInstr::SETF(field) : VMInstr::GETF(field);
+}
+
+VMInstr CodeGenerator::op_instr(const string& op, const optional<DataType>& type)
+{
+  // typed instructions when the semantic checker found the operand type
+  string t = type.has_value() ? type->type_name : "";
+  bool is_array = type.has_value() and type->is_array;
+  bool is_int = t == "int" and !is_array;
+  bool is_double = t == "double" and !is_array;
+  bool is_string = (t == "string" or t == "char") and !is_array;
+  bool is_word = t != "" and !is_double and !is_string;
+
+  if (op == "+")
+    return is_int ? VMInstr::ADDI() : is_double ? VMInstr::ADDD() : VMInstr::ADD();
+  else if (op == "-")
+    return is_int ? VMInstr::SUBI() : is_double ? VMInstr::SUBD() : VMInstr::SUB();
+  else if (op == "*")
+    return is_int ? VMInstr::MULI() : is_double ? VMInstr::MULD() : VMInstr::MUL();
+  else if (op == "/")
+    return is_int ? VMInstr::DIVI() : is_double ? VMInstr::DIVD() : VMInstr::DIV();
+  else if (op == "and")
+    return VMInstr::AND();
+  else if (op == "or")
+    return VMInstr::OR();
+  else if (op == "<")
+    return is_int ? VMInstr::CMPLTI() : is_double ? VMInstr::CMPLTD() :
+      is_string ? VMInstr::CMPLTS() : VMInstr::CMPLT();
+  else if (op == "<=")
+    return is_int ? VMInstr::CMPLEI() : is_double ? VMInstr::CMPLED() :
+      is_string ? VMInstr::CMPLES() : VMInstr::CMPLE();
+  else if (op == ">")
+    return is_int ? VMInstr::CMPGTI() : is_double ? VMInstr::CMPGTD() :
+      is_string ? VMInstr::CMPGTS() : VMInstr::CMPGT();
+  else if (op == ">=")
+    return is_int ? VMInstr::CMPGEI() : is_double ? VMInstr::CMPGED() :
+      is_string ? VMInstr::CMPGES() : VMInstr::CMPGE();
+  else if (op == "==")
+    return is_word ? VMInstr::CMPEQI() : is_string ? VMInstr::CMPEQS() : VMInstr::CMPEQ();
+  else
+    return is_word ? VMInstr::CMPNEI() : is_string ? VMInstr::CMPNES() : VMInstr::CMPNE();
+}
+
+
+void CodeGenerator::set_inline_threshold(int max_instructions)
+{
+  inline_threshold = max_instructions;
+}
+
+
+namespace {
+
+  // the change in the number of operands made by the instruction (for
+  // functions with the given parameter counts), or nullopt for RET and
+  // calls to unknown functions
+  optional<int> stack_effect(const VMInstr& instr,
+                             const unordered_map<string,int>& arg_counts)
+  {
+    switch (instr.opcode())
+    {
+    case OpCode::PUSH: case OpCode::LOAD: case OpCode::READ:
+    case OpCode::ALLOCS: case OpCode::ALLOCR: case OpCode::DUP:
+      return 1;
+    case OpCode::NOT: case OpCode::JMP: case OpCode::SLEN:
+    case OpCode::ALEN: case OpCode::TOINT: case OpCode::TODBL:
+    case OpCode::TOSTR: case OpCode::GETF: case OpCode::NOP:
+      return 0;
+    case OpCode::SETF:
+      return -2;
+    case OpCode::SETI:
+      return -3;
+    case OpCode::CALL:
+    {
+      string name = get<string>(instr.operand().value());
+      if (!arg_counts.contains(name))
+        return nullopt;
+      return 1 - arg_counts.at(name);
+    }
+    case OpCode::RET:
+    case OpCode::TAILCALL:
+      return nullopt;
+    default:
+      // (the rest pop one more operand than they push)
+      return -1;
+    }
+  }
+
+  // true if the function stores its arguments with the standard
+  // prologue (STORE 0, ..., STORE n-1), nothing jumps back into it, and
+  // every RET returns the only operand on the stack (so the function's
+  // code can replace a call to it)
+  bool inlinable_code(const VMFrameInfo& frame,
+                      const unordered_map<string,int>& arg_counts)
+  {
+    const vector<VMInstr>& code = frame.instructions;
+    int n = code.size();
+    int k = frame.arg_count;
+    if (n <= k)
+      return false;
+    for (int i = 0; i < k; ++i)
+      if (code[i].opcode() != OpCode::STORE or
+          get<int>(code[i].operand().value()) != i)
+        return false;
+
+    // the operands on the stack before each instruction (-1 if unknown)
+    vector<int> depth(n, -1);
+    depth[k] = 0;
+    vector<int> todo {k};
+    while (!todo.empty())
+    {
+      int i = todo.back();
+      todo.pop_back();
+      if (code[i].opcode() == OpCode::RET)
+      {
+        if (depth[i] != 1)
+          return false;
+        continue;
+      }
+      optional<int> effect = stack_effect(code[i], arg_counts);
+      if (!effect.has_value() or depth[i] + *effect < 0)
+        return false;
+      vector<int> next;
+      OpCode op = code[i].opcode();
+      if (op == OpCode::JMP or op == OpCode::JMPF)
+        next.push_back(get<int>(code[i].operand().value()));
+      if (op != OpCode::JMP)
+        next.push_back(i + 1);
+      for (int j : next)
+      {
+        if (j < k or j >= n)
+          return false;
+        if (depth[j] == -1)
+        {
+          depth[j] = depth[i] + *effect;
+          todo.push_back(j);
+        }
+        else if (depth[j] != depth[i] + *effect)
+          return false;
+      }
+    }
+    return true;
+  }
+
+}
+
+
+void CodeGenerator::inline_calls()
+{
+  if (inline_threshold <= 0)
+    return;
+  int n = frames.size();
+  unordered_map<string,int> index;
+  unordered_map<string,int> arg_counts;
+  for (int f = 0; f < n; ++f)
+  {
+    index[frames[f].function_name] = f;
+    arg_counts[frames[f].function_name] = frames[f].arg_count;
+  }
+
+  // the functions each function calls
+  vector<vector<int>> callees(n);
+  for (int f = 0; f < n; ++f)
+    for (const VMInstr &instr : frames[f].instructions)
+      if (instr.opcode() == OpCode::CALL or instr.opcode() == OpCode::TAILCALL)
+      {
+        string name = get<string>(instr.operand().value());
+        if (index.contains(name))
+          callees[f].push_back(index[name]);
+      }
+
+  // the functions that can (directly or indirectly) call themselves
+  vector<bool> recursive(n, false);
+  for (int f = 0; f < n; ++f)
+  {
+    vector<bool> seen(n, false);
+    vector<int> todo = callees[f];
+    while (!todo.empty() and !recursive[f])
+    {
+      int g = todo.back();
+      todo.pop_back();
+      recursive[f] = g == f;
+      if (seen[g])
+        continue;
+      seen[g] = true;
+      todo.insert(todo.end(), callees[g].begin(), callees[g].end());
+    }
+  }
+
+  // inline into callees before their callers (so inlined code already
+  // has its own calls inlined)
+  vector<bool> inlinable(n, false);
+  vector<bool> done(n, false);
+  function<void(int)> inline_into = [&](int f) {
+    done[f] = true;
+    for (int g : callees[f])
+      if (!done[g])
+        inline_into(g);
+
+    VMFrameInfo &frame = frames[f];
+    const vector<VMInstr> &old_code = frame.instructions;
+    int old_n = old_code.size();
+
+    // inlined functions' variables go after the caller's
+    int base = frame.arg_count;
+    for (const VMInstr &instr : old_code)
+      if (instr.opcode() == OpCode::LOAD or instr.opcode() == OpCode::STORE)
+        base = max(base, get<int>(instr.operand().value()) + 1);
+
+    vector<VMInstr> code;
+    vector<int> new_index(old_n + 1, 0);
+    vector<int> jumps;
+    for (int i = 0; i < old_n; ++i)
+    {
+      new_index[i] = code.size();
+      const VMInstr &instr = old_code[i];
+      OpCode op = instr.opcode();
+      int g = -1;
+      bool tail = op == OpCode::TAILCALL;
+      if (op == OpCode::CALL or tail)
+        g = index.contains(get<string>(instr.operand().value())) ?
+          index[get<string>(instr.operand().value())] : -1;
+      if (g == -1 or !inlinable[g])
+      {
+        if (op == OpCode::JMP or op == OpCode::JMPF)
+          jumps.push_back(code.size());
+        code.push_back(instr);
+        continue;
+      }
+
+      // the arguments (first argument deepest) replace the prologue,
+      // so callee instruction j is at start + j (and for tail calls,
+      // the callee's returns return from the caller)
+      const VMFrameInfo &callee = frames[g];
+      int k = callee.arg_count;
+      int start = code.size();
+      int end = start + callee.instructions.size();
+      for (int a = k - 1; a >= 0; --a)
+        code.push_back(VMInstr::STORE(base + a));
+      for (int j = k; j < callee.instructions.size(); ++j)
+      {
+        VMInstr body = callee.instructions[j];
+        switch (body.opcode())
+        {
+        case OpCode::LOAD:
+        case OpCode::STORE:
+          body.set_operand(get<int>(body.operand().value()) + base);
+          break;
+        case OpCode::JMP:
+        case OpCode::JMPF:
+          body.set_operand(start + get<int>(body.operand().value()));
+          break;
+        case OpCode::RET:
+          if (!tail)
+            body = VMInstr::JMP(end);
+          break;
+        case OpCode::ALLOCR:
+          // (the caller's frame doesn't free it, so it is collected)
+          body = body.operand().has_value() ?
+            VMInstr::ALLOCS(get<string>(body.operand().value())) :
+            VMInstr::ALLOCS();
+          break;
+        default:
+          break;
+        }
+        code.push_back(body);
+      }
+    }
+    new_index[old_n] = code.size();
+    for (int j : jumps)
+      code[j].set_operand(new_index[get<int>(code[j].operand().value())]);
+    frame.instructions = code;
+
+    inlinable[f] = !recursive[f] and frame.function_name != "main" and
+      frame.instructions.size() <= inline_threshold and
+      inlinable_code(frame, arg_counts);
+  };
+  for (int f = 0; f < n; ++f)
+    if (!done[f])
+      inline_into(f);
+}
@@ -13,6 +13,9 @@
 #include <unordered_map>
 #include "ast.h"
 #include "var_table.h"
+#include "escape_analyzer.h"
+#include "loop_analyzer.h"
+#include "pass_manager.h"
 #include "vm.h"
 
 
@@ -36,6 +39,14 @@ public:
   void visit(NewRValue& v);
   void visit(VarRValue& v);    
 
+  // calls to non-recursive functions of at most the given number of
+  // instructions are replaced by the function's instructions (0 to not
+  // inline calls)
+  void set_inline_threshold(int max_instructions);
+
+  // the optimization passes run over each generated frame
+  const PassManager& pass_manager() const;
+
 private:
 
   VM& vm;
@@ -43,6 +54,58 @@ private:
   int next_var_index = 0;
   VarTable var_table;
   std::unordered_map<std::string,StructDef> struct_defs;
+
+  // declared type name of each variable (by var table index)
+  std::unordered_map<int,std::string> var_types;
+
+  // which struct variables' objects don't escape their function
+  EscapeAnalyzer escape_analyzer;
+
+  // the current function's struct variables that don't escape (whose
+  // fields are locals), and that only escape to callees (whose objects
+  // are freed on return)
+  std::unordered_set<std::string> scalar_vars;
+  std::unordered_set<std::string> region_vars;
+
+  // true while generating the "new T" of a region variable
+  bool region_alloc = false;
+
+  // the local holding each hoisted loop invariant (by key)
+  std::unordered_map<std::string,int> hoisted;
+
+  // the generated frames (added to the VM after inlining)
+  std::vector<VMFrameInfo> frames;
+
+  int inline_threshold = 16;
+
+  // the optimizer (see the constructor for its passes)
+  PassManager passes;
+
+  // replace calls to small, non-recursive functions by their code
+  void inline_calls();
+
+  // a loop analyzer for the current function and scope
+  LoopAnalyzer loop_analyzer();
+
+  // compute the loop invariants into new locals (that the invariants'
+  // occurrences then load), returning the keys of those hoisted
+  std::vector<std::string> hoist(const std::vector<LoopAnalyzer::Invariant>& invariants);
+
+  // add the variable to the var table, recording its type
+  int add_var(const std::string& name, const std::string& type);
+
+  // the instruction for the binary operator, typed if the operand type
+  // is known
+  VMInstr op_instr(const std::string& op, const std::optional<DataType>& type);
+
+  // the path with a leading field of a scalar replaced variable (v.f)
+  // replaced by the local holding the field (named "v.f")
+  std::vector<VarRef> local_path(const std::vector<VarRef>& path) const;
+
+  // the field access (GETF or SETF) for the field of a struct of the
+  // given type, by slot when the struct type is known, and updates the
+  // type to the field's type (or the empty string if unknown)
+  VMInstr field_instr(std::string& type, const std::string& field, bool set);
 };
 
 #endif
@@ -0,0 +1,510 @@
+//----------------------------------------------------------------------
+// FILE: constant_folder.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Constant folding and propagation over a checked AST
+//----------------------------------------------------------------------
+
+#include <cfloat>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include "constant_folder.h"
+
+using namespace std;
+
+
+namespace {
+
+  // the value of a string or char literal (as the code generator
+  // translates its escape sequences)
+  string unescape(string s)
+  {
+    const vector<pair<string,string>> escapes = {
+      {"\\n", "\n"}, {"\\t", "\t"}, {"\\r", "\r"}, {"\\\\", "\\"}};
+    for (const auto& [old_str, new_str] : escapes)
+      while (s.find(old_str) != string::npos)
+        s.replace(s.find(old_str), old_str.size(), new_str);
+    return s;
+  }
+
+  optional<int> int_value(const Token& t)
+  {
+    try {
+      return stoi(t.lexeme());
+    } catch (...) {
+      return nullopt;
+    }
+  }
+
+  optional<double> double_value(const Token& t)
+  {
+    try {
+      return stod(t.lexeme());
+    } catch (...) {
+      return nullopt;
+    }
+  }
+
+  Token make_token(TokenType type, const string& lexeme, const Token& at)
+  {
+    return Token(type, lexeme, at.line(), at.column());
+  }
+
+  Token bool_token(bool value, const Token& at)
+  {
+    return make_token(TokenType::BOOL_VAL, value ? "true" : "false", at);
+  }
+
+  // a comparison result (c is negative, zero, or positive)
+  optional<bool> compare(const string& op, int c)
+  {
+    if (op == "<")
+      return c < 0;
+    else if (op == "<=")
+      return c <= 0;
+    else if (op == ">")
+      return c > 0;
+    else if (op == ">=")
+      return c >= 0;
+    else if (op == "==")
+      return c == 0;
+    else if (op == "!=")
+      return c != 0;
+    return nullopt;
+  }
+
+  bool is_primitive(const DataType& type)
+  {
+    const string& t = type.type_name;
+    return !type.is_array and (t == "int" or t == "double" or t == "bool" or
+                               t == "string" or t == "char");
+  }
+
+  bool declares_vars(const vector<shared_ptr<Stmt>>& stmts)
+  {
+    for (const auto& stmt : stmts)
+      if (dynamic_cast<VarDeclStmt*>(stmt.get()))
+        return true;
+    return false;
+  }
+
+}
+
+
+optional<Token> ConstantFolder::literal(const Expr& e)
+{
+  if (e.negated or e.op.has_value())
+    return nullopt;
+  SimpleTerm* term = dynamic_cast<SimpleTerm*>(e.first.get());
+  if (term == nullptr)
+    return nullopt;
+  SimpleRValue* rvalue = dynamic_cast<SimpleRValue*>(term->rvalue.get());
+  if (rvalue == nullptr)
+    return nullopt;
+  return rvalue->value;
+}
+
+
+void ConstantFolder::set_literal(Expr& e, const Token& value)
+{
+  shared_ptr<SimpleRValue> rvalue = make_shared<SimpleRValue>();
+  rvalue->value = value;
+  shared_ptr<SimpleTerm> term = make_shared<SimpleTerm>();
+  term->rvalue = rvalue;
+  e.negated = false;
+  e.first = term;
+  e.op = nullopt;
+  e.rest = nullptr;
+  e.op_type = nullopt;
+}
+
+
+optional<Token> ConstantFolder::evaluate(const Token& x, const Token& op,
+                                         const Token& y)
+{
+  string o = op.lexeme();
+  TokenType type = x.type();
+
+  // (only null equality is defined on null operands)
+  if (type == TokenType::NULL_VAL or y.type() == TokenType::NULL_VAL)
+  {
+    if (o != "==" and o != "!=")
+      return nullopt;
+    bool equal = type == y.type();
+    return bool_token(o == "==" ? equal : !equal, x);
+  }
+  if (type != y.type())
+    return nullopt;
+
+  if (type == TokenType::INT_VAL)
+  {
+    optional<int> a = int_value(x);
+    optional<int> b = int_value(y);
+    if (!a.has_value() or !b.has_value())
+      return nullopt;
+    // (ints wrap around as in the VM)
+    int64_t r;
+    if (o == "+")
+      r = int64_t(*a) + *b;
+    else if (o == "-")
+      r = int64_t(*a) - *b;
+    else if (o == "*")
+      r = int64_t(*a) * *b;
+    else if (o == "/")
+    {
+      if (*b == 0 or (*a == INT_MIN and *b == -1))
+        return nullopt;
+      r = *a / *b;
+    }
+    else
+    {
+      optional<bool> c = compare(o, (*a > *b) - (*a < *b));
+      return c.has_value() ? optional<Token>(bool_token(*c, x)) : nullopt;
+    }
+    return make_token(TokenType::INT_VAL, to_string(int32_t(uint32_t(r))), x);
+  }
+
+  if (type == TokenType::DOUBLE_VAL)
+  {
+    optional<double> a = double_value(x);
+    optional<double> b = double_value(y);
+    if (!a.has_value() or !b.has_value())
+      return nullopt;
+    double r;
+    if (o == "+")
+      r = *a + *b;
+    else if (o == "-")
+      r = *a - *b;
+    else if (o == "*")
+      r = *a * *b;
+    else if (o == "/")
+      r = *a / *b;
+    else
+    {
+      optional<bool> c = compare(o, (*a > *b) - (*a < *b));
+      return c.has_value() ? optional<Token>(bool_token(*c, x)) : nullopt;
+    }
+    // (the result must read back as the same double)
+    if (!isfinite(r) or (r != 0 and fabs(r) < DBL_MIN))
+      return nullopt;
+    char buffer[32];
+    auto [end, error] = to_chars(buffer, buffer + sizeof(buffer), r);
+    string lexeme(buffer, end);
+    if (lexeme.find_first_of(".e") == string::npos)
+      lexeme += ".0";
+    return make_token(TokenType::DOUBLE_VAL, lexeme, x);
+  }
+
+  if (type == TokenType::STRING_VAL or type == TokenType::CHAR_VAL)
+  {
+    int c = unescape(x.lexeme()).compare(unescape(y.lexeme()));
+    optional<bool> result = compare(o, (c > 0) - (c < 0));
+    return result.has_value() ? optional<Token>(bool_token(*result, x)) : nullopt;
+  }
+
+  if (type == TokenType::BOOL_VAL and (o == "==" or o == "!="))
+  {
+    bool equal = x.lexeme() == y.lexeme();
+    return bool_token(o == "==" ? equal : !equal, x);
+  }
+
+  return nullopt;
+}
+
+
+optional<Token> ConstantFolder::lookup(const string& var_name) const
+{
+  for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope)
+    if (scope->contains(var_name))
+      return scope->at(var_name);
+  return nullopt;
+}
+
+
+void ConstantFolder::find_assigned(const vector<shared_ptr<Stmt>>& stmts)
+{
+  for (const auto& stmt : stmts)
+  {
+    if (AssignStmt* s = dynamic_cast<AssignStmt*>(stmt.get()))
+      assigned.insert(s->lvalue[0].var_name.lexeme());
+    else if (WhileStmt* s = dynamic_cast<WhileStmt*>(stmt.get()))
+      find_assigned(s->stmts);
+    else if (ForStmt* s = dynamic_cast<ForStmt*>(stmt.get()))
+    {
+      assigned.insert(s->assign_stmt.lvalue[0].var_name.lexeme());
+      find_assigned(s->stmts);
+    }
+    else if (IfStmt* s = dynamic_cast<IfStmt*>(stmt.get()))
+    {
+      find_assigned(s->if_part.stmts);
+      for (auto& else_if : s->else_ifs)
+        find_assigned(else_if.stmts);
+      find_assigned(s->else_stmts);
+    }
+  }
+}
+
+
+void ConstantFolder::fold(vector<shared_ptr<Stmt>>& stmts)
+{
+  vector<shared_ptr<Stmt>> folded;
+  for (auto& stmt : stmts)
+  {
+    stmt->accept(*this);
+
+    if (WhileStmt* s = dynamic_cast<WhileStmt*>(stmt.get()))
+    {
+      optional<Token> value = literal(s->condition);
+      if (value.has_value() and value->lexeme() == "false")
+        continue;
+    }
+    else if (IfStmt* s = dynamic_cast<IfStmt*>(stmt.get()))
+    {
+      // the branches that may run, and the statements to run if none do
+      vector<BasicIf> branches;
+      vector<shared_ptr<Stmt>> otherwise = s->else_stmts;
+      vector<BasicIf> parts = {s->if_part};
+      parts.insert(parts.end(), s->else_ifs.begin(), s->else_ifs.end());
+      for (auto& part : parts)
+      {
+        optional<Token> value = literal(part.condition);
+        if (value.has_value() and value->lexeme() == "false")
+          continue;
+        if (value.has_value() and value->lexeme() == "true")
+        {
+          otherwise = part.stmts;
+          break;
+        }
+        branches.push_back(part);
+      }
+      if (branches.empty() and !declares_vars(otherwise))
+      {
+        folded.insert(folded.end(), otherwise.begin(), otherwise.end());
+        continue;
+      }
+      if (branches.empty())
+      {
+        // (keeps the statements' scope, with an always true condition)
+        BasicIf part;
+        set_literal(part.condition, bool_token(true, s->if_part.condition.first_token()));
+        part.stmts = otherwise;
+        branches.push_back(part);
+        otherwise.clear();
+      }
+      s->if_part = branches[0];
+      s->else_ifs.assign(branches.begin() + 1, branches.end());
+      s->else_stmts = otherwise;
+    }
+    folded.push_back(stmt);
+  }
+  stmts = folded;
+}
+
+
+void ConstantFolder::visit(Program& p)
+{
+  for (auto& fun_def : p.fun_defs)
+    fun_def.accept(*this);
+}
+
+
+void ConstantFolder::visit(FunDef& f)
+{
+  assigned.clear();
+  find_assigned(f.stmts);
+  scopes.push_back({});
+  for (auto& param : f.params)
+    scopes.back()[param.var_name.lexeme()] = nullopt;
+  fold(f.stmts);
+  scopes.pop_back();
+}
+
+
+void ConstantFolder::visit(StructDef&)
+{
+}
+
+
+void ConstantFolder::visit(ReturnStmt& s)
+{
+  s.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(WhileStmt& s)
+{
+  s.condition.accept(*this);
+  scopes.push_back({});
+  fold(s.stmts);
+  scopes.pop_back();
+}
+
+
+void ConstantFolder::visit(ForStmt& s)
+{
+  scopes.push_back({});
+  s.var_decl.accept(*this);
+  s.condition.accept(*this);
+  scopes.push_back({});
+  fold(s.stmts);
+  scopes.pop_back();
+  s.assign_stmt.accept(*this);
+  scopes.pop_back();
+}
+
+
+void ConstantFolder::visit(IfStmt& s)
+{
+  s.if_part.condition.accept(*this);
+  scopes.push_back({});
+  fold(s.if_part.stmts);
+  scopes.pop_back();
+  for (auto& else_if : s.else_ifs)
+  {
+    else_if.condition.accept(*this);
+    scopes.push_back({});
+    fold(else_if.stmts);
+    scopes.pop_back();
+  }
+  scopes.push_back({});
+  fold(s.else_stmts);
+  scopes.pop_back();
+}
+
+
+void ConstantFolder::visit(VarDeclStmt& s)
+{
+  s.expr.accept(*this);
+  string name = s.var_def.var_name.lexeme();
+  optional<Token> value = literal(s.expr);
+  if (is_primitive(s.var_def.data_type) and !assigned.contains(name))
+    scopes.back()[name] = value;
+  else
+    scopes.back()[name] = nullopt;
+}
+
+
+void ConstantFolder::visit(AssignStmt& s)
+{
+  for (auto& ref : s.lvalue)
+    if (ref.array_expr.has_value())
+      ref.array_expr->accept(*this);
+  s.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(CallExpr& e)
+{
+  for (auto& arg : e.args)
+    arg.accept(*this);
+}
+
+
+void ConstantFolder::visit(Expr& e)
+{
+  e.first->accept(*this);
+
+  // a parenthesized literal, or a constant variable, is a literal term
+  if (ComplexTerm* term = dynamic_cast<ComplexTerm*>(e.first.get()))
+  {
+    if (literal(term->expr).has_value())
+      e.first = term->expr.first;
+  }
+  else if (SimpleTerm* term = dynamic_cast<SimpleTerm*>(e.first.get()))
+  {
+    VarRValue* rvalue = dynamic_cast<VarRValue*>(term->rvalue.get());
+    if (rvalue and rvalue->path.size() == 1 and
+        !rvalue->path[0].array_expr.has_value())
+    {
+      optional<Token> value = lookup(rvalue->path[0].var_name.lexeme());
+      if (value.has_value())
+      {
+        shared_ptr<SimpleRValue> constant = make_shared<SimpleRValue>();
+        constant->value = *value;
+        shared_ptr<SimpleTerm> constant_term = make_shared<SimpleTerm>();
+        constant_term->rvalue = constant;
+        e.first = constant_term;
+      }
+    }
+  }
+
+  if (e.rest)
+    e.rest->accept(*this);
+
+  // the value of the first operand (after any negation)
+  Expr first;
+  first.first = e.first;
+  optional<Token> x = literal(first);
+  if (x.has_value() and e.negated)
+  {
+    if (x->type() != TokenType::BOOL_VAL)
+      x = nullopt;
+    else
+      x = bool_token(x->lexeme() == "false", *x);
+  }
+  if (!x.has_value())
+    return;
+
+  if (!e.op.has_value())
+  {
+    set_literal(e, *x);
+    return;
+  }
+
+  // a literal first operand of and/or either decides the result, or
+  // the result is the rest (which is only evaluated in that case)
+  string op = e.op->lexeme();
+  if ((op == "and" or op == "or") and x->type() == TokenType::BOOL_VAL)
+  {
+    bool value = x->lexeme() == "true";
+    if ((op == "and" and !value) or (op == "or" and value))
+      set_literal(e, *x);
+    else
+    {
+      Expr rest = *e.rest;
+      e = rest;
+    }
+    return;
+  }
+
+  optional<Token> y = literal(*e.rest);
+  if (!y.has_value())
+    return;
+  optional<Token> result = evaluate(*x, *e.op, *y);
+  if (result.has_value())
+    set_literal(e, *result);
+}
+
+
+void ConstantFolder::visit(SimpleTerm& t)
+{
+  t.rvalue->accept(*this);
+}
+
+
+void ConstantFolder::visit(ComplexTerm& t)
+{
+  t.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(SimpleRValue&)
+{
+}
+
+
+void ConstantFolder::visit(NewRValue& v)
+{
+  if (v.array_expr.has_value())
+    v.array_expr->accept(*this);
+}
+
+
+void ConstantFolder::visit(VarRValue& v)
+{
+  for (auto& ref : v.path)
+    if (ref.array_expr.has_value())
+      ref.array_expr->accept(*this);
+}
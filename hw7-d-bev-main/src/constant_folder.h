@@ -0,0 +1,78 @@
+//----------------------------------------------------------------------
+// FILE: constant_folder.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Constant folding and propagation over a checked AST
+//----------------------------------------------------------------------
+
+#ifndef CONSTANT_FOLDER_H
+#define CONSTANT_FOLDER_H
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "ast.h"
+
+
+// Rewrites a (semantically checked) program in place, before code
+// generation. Operators whose operands are literals are replaced by
+// their result, computed exactly as the VM would (operations the VM
+// would fail on, such as division by zero or null operands, are left
+// for it to report). Variables of primitive types that are declared
+// with a literal value and never assigned are replaced by the value.
+// If and while statements drop the branches whose conditions are
+// false, and an if statement with a true condition is replaced by its
+// statements (when they declare no variables).
+class ConstantFolder : public Visitor {
+public:
+  void visit(Program& p);
+  void visit(FunDef& f);
+  void visit(StructDef& s);
+  void visit(ReturnStmt& s);
+  void visit(WhileStmt& s);
+  void visit(ForStmt& s);
+  void visit(IfStmt& s);
+  void visit(VarDeclStmt& s);
+  void visit(AssignStmt& s);
+  void visit(CallExpr& e);
+  void visit(Expr& e);
+  void visit(SimpleTerm& t);
+  void visit(ComplexTerm& t);
+  void visit(SimpleRValue& v);
+  void visit(NewRValue& v);
+  void visit(VarRValue& v);
+
+private:
+
+  // the literal value of each variable in scope (innermost scope last),
+  // or nullopt for variables that aren't constant
+  std::vector<std::unordered_map<std::string, std::optional<Token>>> scopes;
+
+  // the variables assigned to in the current function (by name)
+  std::unordered_set<std::string> assigned;
+
+  // add the variables assigned to in the statements
+  void find_assigned(const std::vector<std::shared_ptr<Stmt>>& stmts);
+
+  // fold each statement, removing and replacing folded branches
+  void fold(std::vector<std::shared_ptr<Stmt>>& stmts);
+
+  // the literal value of the variable (if it is constant)
+  std::optional<Token> lookup(const std::string& var_name) const;
+
+  // the literal if the expression is only a literal
+  static std::optional<Token> literal(const Expr& e);
+
+  // the result of the binary operator, if it can be folded
+  static std::optional<Token> evaluate(const Token& x, const Token& op,
+                                       const Token& y);
+
+  // replace the expression by the literal
+  static void set_literal(Expr& e, const Token& value);
+
+};
+
+#endif
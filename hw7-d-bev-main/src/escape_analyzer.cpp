@@ -0,0 +1,247 @@
+//----------------------------------------------------------------------
+// FILE: escape_analyzer.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Escape analysis of struct objects for the code generator
+//----------------------------------------------------------------------
+
+#include "escape_analyzer.h"
+
+using namespace std;
+
+
+unordered_set<string> EscapeAnalyzer::scalar_vars(const string& fun_name) const
+{
+  unordered_set<string> names;
+  if (!vars.contains(fun_name))
+    return names;
+  for (const auto& [name, info] : vars.at(fun_name))
+    if (info.is_new_struct and contained(info) and info.passed_to.empty())
+      names.insert(name);
+  return names;
+}
+
+
+unordered_set<string> EscapeAnalyzer::region_vars(const string& fun_name) const
+{
+  unordered_set<string> names;
+  if (!vars.contains(fun_name))
+    return names;
+  for (const auto& [name, info] : vars.at(fun_name))
+    if (info.is_new_struct and contained(info) and !info.passed_to.empty() and
+        !info.in_loop)
+      names.insert(name);
+  return names;
+}
+
+
+bool EscapeAnalyzer::contained(const VarInfo& info) const
+{
+  if (info.decls != 1 or info.escapes)
+    return false;
+  for (const auto& param : info.passed_to)
+    if (captured.contains(param))
+      return false;
+  return true;
+}
+
+
+string EscapeAnalyzer::bare_var(const Expr& e)
+{
+  if (e.negated or e.op.has_value())
+    return "";
+  SimpleTerm* term = dynamic_cast<SimpleTerm*>(e.first.get());
+  if (term == nullptr)
+    return "";
+  VarRValue* rvalue = dynamic_cast<VarRValue*>(term->rvalue.get());
+  if (rvalue == nullptr or rvalue->path.size() != 1 or
+      rvalue->path[0].array_expr.has_value())
+    return "";
+  return rvalue->path[0].var_name.lexeme();
+}
+
+
+void EscapeAnalyzer::visit(Program& p)
+{
+  for (auto& struct_def : p.struct_defs)
+    struct_def.accept(*this);
+  for (auto& fun_def : p.fun_defs)
+    fun_def.accept(*this);
+
+  // parameters that escape their function, or are passed to built-in
+  // functions, capture their argument
+  for (auto& [fun_name, names] : params)
+    for (int i = 0; i < names.size(); ++i)
+    {
+      const VarInfo& info = vars[fun_name][names[i]];
+      bool capturing = info.decls != 1 or info.escapes;
+      for (const auto& [callee, param] : info.passed_to)
+        capturing = capturing or !params.contains(callee);
+      if (capturing)
+        captured.insert({fun_name, i});
+    }
+
+  // as do parameters passed on to capturing parameters
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (auto& [fun_name, names] : params)
+      for (int i = 0; i < names.size(); ++i)
+        if (!captured.contains({fun_name, i}) and
+            !contained(vars[fun_name][names[i]]))
+        {
+          captured.insert({fun_name, i});
+          changed = true;
+        }
+  }
+}
+
+
+void EscapeAnalyzer::visit(FunDef& f)
+{
+  curr_fun = f.fun_name.lexeme();
+  for (auto& param : f.params)
+  {
+    VarInfo& info = vars[curr_fun][param.var_name.lexeme()];
+    ++info.decls;
+    info.is_param = true;
+    params[curr_fun].push_back(param.var_name.lexeme());
+  }
+  for (auto& stmt : f.stmts)
+    stmt->accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(StructDef& s)
+{
+  struct_names.insert(s.struct_name.lexeme());
+}
+
+
+void EscapeAnalyzer::visit(ReturnStmt& s)
+{
+  s.expr.accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(WhileStmt& s)
+{
+  s.condition.accept(*this);
+  ++loop_depth;
+  for (auto& stmt : s.stmts)
+    stmt->accept(*this);
+  --loop_depth;
+}
+
+
+void EscapeAnalyzer::visit(ForStmt& s)
+{
+  s.var_decl.accept(*this);
+  s.condition.accept(*this);
+  s.assign_stmt.accept(*this);
+  ++loop_depth;
+  for (auto& stmt : s.stmts)
+    stmt->accept(*this);
+  --loop_depth;
+}
+
+
+void EscapeAnalyzer::visit(IfStmt& s)
+{
+  s.if_part.condition.accept(*this);
+  for (auto& stmt : s.if_part.stmts)
+    stmt->accept(*this);
+  for (auto& else_if : s.else_ifs)
+  {
+    else_if.condition.accept(*this);
+    for (auto& stmt : else_if.stmts)
+      stmt->accept(*this);
+  }
+  for (auto& stmt : s.else_stmts)
+    stmt->accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(VarDeclStmt& s)
+{
+  VarInfo& info = vars[curr_fun][s.var_def.var_name.lexeme()];
+  ++info.decls;
+  info.in_loop = info.in_loop or loop_depth > 0;
+  // check for exactly "new T" for a struct type T
+  if (!s.expr.negated and !s.expr.op.has_value())
+    if (SimpleTerm* term = dynamic_cast<SimpleTerm*>(s.expr.first.get()))
+      if (NewRValue* rvalue = dynamic_cast<NewRValue*>(term->rvalue.get()))
+        info.is_new_struct = !rvalue->array_expr.has_value() and
+          struct_names.contains(rvalue->type.lexeme());
+  s.expr.accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(AssignStmt& s)
+{
+  // only assigning to a field leaves the variable's object in place
+  if (s.lvalue.size() < 2 or s.lvalue[0].array_expr.has_value())
+    vars[curr_fun][s.lvalue[0].var_name.lexeme()].escapes = true;
+  for (auto& var_ref : s.lvalue)
+    if (var_ref.array_expr.has_value())
+      var_ref.array_expr->accept(*this);
+  s.expr.accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(CallExpr& e)
+{
+  string fun_name = e.fun_name.lexeme();
+  for (int i = 0; i < e.args.size(); ++i)
+  {
+    string name = bare_var(e.args[i]);
+    if (name != "")
+      vars[curr_fun][name].passed_to.push_back({fun_name, i});
+    else
+      e.args[i].accept(*this);
+  }
+}
+
+
+void EscapeAnalyzer::visit(Expr& e)
+{
+  e.first->accept(*this);
+  if (e.rest)
+    e.rest->accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(SimpleTerm& t)
+{
+  t.rvalue->accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(ComplexTerm& t)
+{
+  t.expr.accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(SimpleRValue&)
+{
+}
+
+
+void EscapeAnalyzer::visit(NewRValue& v)
+{
+  if (v.array_expr.has_value())
+    v.array_expr->accept(*this);
+}
+
+
+void EscapeAnalyzer::visit(VarRValue& v)
+{
+  // only reading a field leaves the variable's object in place
+  if (v.path.size() < 2 or v.path[0].array_expr.has_value())
+    vars[curr_fun][v.path[0].var_name.lexeme()].escapes = true;
+  for (auto& var_ref : v.path)
+    if (var_ref.array_expr.has_value())
+      var_ref.array_expr->accept(*this);
+}
@@ -0,0 +1,92 @@
+//----------------------------------------------------------------------
+// FILE: escape_analyzer.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Escape analysis of struct objects for the code generator
+//----------------------------------------------------------------------
+
+#ifndef ESCAPE_ANALYZER_H
+#define ESCAPE_ANALYZER_H
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "ast.h"
+
+
+// Finds the struct variables (declared with "new T") whose objects
+// never escape their function. A variable's object escapes if the
+// variable is used other than to access its fields, unless it is only
+// passed to parameters that themselves never capture their argument.
+// Variables that are declared more than once in a function (shadowed)
+// or reassigned are assumed to escape. Objects passed to parameters are
+// freed when the function returns, so those of variables declared in a
+// loop are left to the garbage collector (rather than piling up until
+// the return).
+class EscapeAnalyzer : public Visitor {
+public:
+  void visit(Program& p);
+  void visit(FunDef& f);
+  void visit(StructDef& s);
+  void visit(ReturnStmt& s);
+  void visit(WhileStmt& s);
+  void visit(ForStmt& s);
+  void visit(IfStmt& s);
+  void visit(VarDeclStmt& s);
+  void visit(AssignStmt& s);
+  void visit(CallExpr& e);
+  void visit(Expr& e);
+  void visit(SimpleTerm& t); 
+  void visit(ComplexTerm& t);
+  void visit(SimpleRValue& v);
+  void visit(NewRValue& v);
+  void visit(VarRValue& v);    
+
+  // the function's struct variables whose objects never leave the
+  // function (so their fields can be replaced by frame locals)
+  std::unordered_set<std::string> scalar_vars(const std::string& fun_name) const;
+
+  // the function's struct variables whose objects are only passed to
+  // non-capturing parameters (so they can be freed on return)
+  std::unordered_set<std::string> region_vars(const std::string& fun_name) const;
+
+private:
+
+  // how a variable is used within its function
+  class VarInfo
+  {
+  public:
+    int decls = 0;
+    bool is_param = false;
+    bool is_new_struct = false;   // declared as "new T" for a struct T
+    bool escapes = false;         // used other than by its fields
+    bool in_loop = false;         // declared in a loop body
+    std::vector<std::pair<std::string,int>> passed_to;  // (fun, param)
+  };
+
+  // variables by function name and then variable name
+  std::unordered_map<std::string, std::unordered_map<std::string, VarInfo>> vars;
+
+  // parameter names by function name
+  std::unordered_map<std::string, std::vector<std::string>> params;
+
+  // the (fun, param) parameters that capture their argument
+  std::set<std::pair<std::string,int>> captured;
+
+  std::unordered_set<std::string> struct_names;
+  std::string curr_fun;
+  int loop_depth = 0;
+
+  // the variable if the expression is only a variable (otherwise "")
+  static std::string bare_var(const Expr& e);
+
+  // true if the variable's object only escapes to non-capturing
+  // parameters (if at all)
+  bool contained(const VarInfo& info) const;
+
+};
+
+#endif
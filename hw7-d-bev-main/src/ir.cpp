@@ -0,0 +1,506 @@
+//----------------------------------------------------------------------
+// FILE: ir.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: SSA form of generated VM instructions (for the optimizer)
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include <climits>
+#include <unordered_set>
+#include "ir.h"
+
+using namespace std;
+
+
+namespace {
+
+  bool is_jump(const VMInstr& instr)
+  {
+    return instr.opcode() == OpCode::JMP or instr.opcode() == OpCode::JMPF;
+  }
+
+  bool ends_block(const VMInstr& instr)
+  {
+    OpCode op = instr.opcode();
+    return is_jump(instr) or op == OpCode::RET or op == OpCode::TAILCALL;
+  }
+
+  bool has_int_operand(const VMInstr& instr)
+  {
+    optional<VMValue> operand = instr.operand();
+    return operand.has_value() and holds_alternative<int>(operand.value());
+  }
+
+  int int_operand(const VMInstr& instr)
+  {
+    return get<int>(instr.operand().value());
+  }
+
+  IRType type_of(const VMValue& value)
+  {
+    if (holds_alternative<int>(value))
+      return IRType::INT;
+    if (holds_alternative<double>(value))
+      return IRType::DOUBLE;
+    if (holds_alternative<bool>(value))
+      return IRType::BOOL;
+    if (holds_alternative<string>(value))
+      return IRType::STRING;
+    return IRType::NONE;
+  }
+
+  // the type of the value the instruction pushes (the semantic checker
+  // chose the typed instructions, so e.g. an ADDI's value is an int)
+  IRType type_of(const VMInstr& instr)
+  {
+    switch (instr.opcode()) {
+    case OpCode::PUSH:
+      return type_of(instr.operand().value());
+    case OpCode::ADDI: case OpCode::SUBI: case OpCode::MULI: case OpCode::DIVI:
+    case OpCode::SLEN: case OpCode::ALEN: case OpCode::TOINT:
+      return IRType::INT;
+    case OpCode::ADDD: case OpCode::SUBD: case OpCode::MULD: case OpCode::DIVD:
+    case OpCode::TODBL:
+      return IRType::DOUBLE;
+    case OpCode::AND: case OpCode::OR: case OpCode::NOT:
+    case OpCode::CMPLT: case OpCode::CMPLE: case OpCode::CMPGT: case OpCode::CMPGE:
+    case OpCode::CMPEQ: case OpCode::CMPNE:
+    case OpCode::CMPLTI: case OpCode::CMPLEI: case OpCode::CMPGTI: case OpCode::CMPGEI:
+    case OpCode::CMPLTD: case OpCode::CMPLED: case OpCode::CMPGTD: case OpCode::CMPGED:
+    case OpCode::CMPLTS: case OpCode::CMPLES: case OpCode::CMPGTS: case OpCode::CMPGES:
+    case OpCode::CMPEQI: case OpCode::CMPNEI: case OpCode::CMPEQS: case OpCode::CMPNES:
+      return IRType::BOOL;
+    case OpCode::GETC: case OpCode::TOSTR: case OpCode::CONCAT:
+      return IRType::STRING;
+    default:
+      return IRType::UNKNOWN;
+    }
+  }
+
+}
+
+
+int pop_count(const VMInstr& instr, const ArgCounts& arg_counts)
+{
+  switch (instr.opcode()) {
+  case OpCode::PUSH: case OpCode::LOAD: case OpCode::JMP: case OpCode::READ:
+  case OpCode::ALLOCS: case OpCode::ALLOCR: case OpCode::NOP:
+    return 0;
+  case OpCode::POP: case OpCode::STORE: case OpCode::NOT: case OpCode::JMPF:
+  case OpCode::RET: case OpCode::WRITE: case OpCode::SLEN: case OpCode::ALEN:
+  case OpCode::TOINT: case OpCode::TODBL: case OpCode::TOSTR: case OpCode::ADDF:
+  case OpCode::GETF: case OpCode::DUP:
+    return 1;
+  case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+  case OpCode::AND: case OpCode::OR:
+  case OpCode::CMPLT: case OpCode::CMPLE: case OpCode::CMPGT: case OpCode::CMPGE:
+  case OpCode::CMPEQ: case OpCode::CMPNE:
+  case OpCode::ADDI: case OpCode::SUBI: case OpCode::MULI: case OpCode::DIVI:
+  case OpCode::ADDD: case OpCode::SUBD: case OpCode::MULD: case OpCode::DIVD:
+  case OpCode::CMPLTI: case OpCode::CMPLEI: case OpCode::CMPGTI: case OpCode::CMPGEI:
+  case OpCode::CMPLTD: case OpCode::CMPLED: case OpCode::CMPGTD: case OpCode::CMPGED:
+  case OpCode::CMPLTS: case OpCode::CMPLES: case OpCode::CMPGTS: case OpCode::CMPGES:
+  case OpCode::CMPEQI: case OpCode::CMPNEI: case OpCode::CMPEQS: case OpCode::CMPNES:
+  case OpCode::GETC: case OpCode::CONCAT: case OpCode::ALLOCA: case OpCode::SETF:
+  case OpCode::GETI:
+    return 2;
+  case OpCode::SETI:
+    return 3;
+  case OpCode::CALL: case OpCode::TAILCALL:
+  {
+    auto entry = arg_counts.find(get<string>(instr.operand().value()));
+    return entry == arg_counts.end() ? -1 : entry->second;
+  }
+  default:
+    return -1;
+  }
+}
+
+int push_count(const VMInstr& instr)
+{
+  switch (instr.opcode()) {
+  case OpCode::POP: case OpCode::STORE: case OpCode::JMP: case OpCode::JMPF:
+  case OpCode::RET: case OpCode::TAILCALL: case OpCode::WRITE: case OpCode::ADDF:
+  case OpCode::SETF: case OpCode::SETI: case OpCode::NOP:
+    return 0;
+  case OpCode::DUP:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+
+optional<IRFunction> IRFunction::build(const VMFrameInfo& frame,
+                                       const ArgCounts& arg_counts)
+{
+  const vector<VMInstr>& code = frame.instructions;
+  int n = code.size();
+  IRFunction ir;
+
+  // each instruction's stack effect, and the basic blocks' first
+  // instructions (an empty block at the end is where falling off, or
+  // jumping past, the last instruction goes)
+  vector<int> pops(n);
+  ir.push_counts.resize(n);
+  ir.local_count = frame.arg_count;
+  vector<bool> leader(n + 1, false);
+  leader[0] = true;
+  leader[n] = true;
+  for (int i = 0; i < n; ++i)
+  {
+    const VMInstr& instr = code[i];
+    pops[i] = pop_count(instr, arg_counts);
+    ir.push_counts[i] = push_count(instr);
+    if (pops[i] < 0)
+      return nullopt;
+    OpCode op = instr.opcode();
+    if (is_jump(instr) or op == OpCode::LOAD or op == OpCode::STORE)
+      if (!has_int_operand(instr))
+        return nullopt;
+    if (is_jump(instr))
+    {
+      int t = int_operand(instr);
+      if (t < 0 or t > n)
+        return nullopt;
+      leader[t] = true;
+    }
+    if (op == OpCode::LOAD or op == OpCode::STORE)
+      ir.local_count = max(ir.local_count, int_operand(instr) + 1);
+    if (ends_block(instr))
+      leader[i + 1] = true;
+  }
+  vector<int> block_at(n + 1, -1);
+  for (int i = 0; i <= n; ++i)
+  {
+    if (!leader[i])
+      continue;
+    if (!ir.blocks.empty())
+      ir.blocks.back().end = i;
+    block_at[i] = ir.blocks.size();
+    IRBlock block;
+    block.start = i;
+    block.end = n;
+    ir.blocks.push_back(block);
+  }
+  int block_count = ir.blocks.size();
+  for (IRBlock& block : ir.blocks)
+  {
+    if (block.start == block.end)
+      continue;
+    const VMInstr& last = code[block.end - 1];
+    OpCode op = last.opcode();
+    if (op != OpCode::JMP and op != OpCode::RET and op != OpCode::TAILCALL)
+      block.succs.push_back(block_at[block.end]);
+    if (is_jump(last))
+      block.succs.push_back(block_at[int_operand(last)]);
+  }
+
+  // the reachable blocks in reverse postorder, and their predecessors
+  vector<int> postorder;
+  vector<bool> seen(block_count, false);
+  vector<pair<int,int>> todo {{0, 0}};
+  seen[0] = true;
+  while (!todo.empty())
+  {
+    auto& [b, next] = todo.back();
+    if (next < ir.blocks[b].succs.size())
+    {
+      int s = ir.blocks[b].succs[next++];
+      if (!seen[s])
+      {
+        seen[s] = true;
+        todo.push_back({s, 0});
+      }
+    }
+    else
+    {
+      postorder.push_back(b);
+      todo.pop_back();
+    }
+  }
+  ir.order.assign(postorder.rbegin(), postorder.rend());
+  vector<int> rpo_index(block_count, -1);
+  for (int k = 0; k < ir.order.size(); ++k)
+    rpo_index[ir.order[k]] = k;
+  for (int b : ir.order)
+    for (int s : ir.blocks[b].succs)
+      ir.blocks[s].preds.push_back(b);
+  ir.block_of.assign(n, -1);
+  for (int b : ir.order)
+    for (int i = ir.blocks[b].start; i < ir.blocks[b].end; ++i)
+      ir.block_of[i] = b;
+
+  // the dominator tree (Cooper, Harvey, and Kennedy's iteration over
+  // the reverse postorder)
+  vector<int> idom(block_count, -1);
+  idom[0] = 0;
+  auto intersect = [&](int a, int b) {
+    while (a != b)
+    {
+      while (rpo_index[a] > rpo_index[b])
+        a = idom[a];
+      while (rpo_index[b] > rpo_index[a])
+        b = idom[b];
+    }
+    return a;
+  };
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (int b : ir.order)
+    {
+      if (b == 0)
+        continue;
+      int new_idom = -1;
+      for (int p : ir.blocks[b].preds)
+        if (idom[p] >= 0)
+          new_idom = new_idom < 0 ? p : intersect(p, new_idom);
+      if (new_idom != idom[b])
+      {
+        idom[b] = new_idom;
+        changed = true;
+      }
+    }
+  }
+  for (int b : ir.order)
+  {
+    if (b == 0)
+      continue;
+    ir.blocks[b].idom = idom[b];
+    ir.blocks[idom[b]].children.push_back(b);
+  }
+
+  // the stack depth at the start of each block: the fewest values any
+  // path to it leaves (extra values are left by call statements)
+  vector<int> depth(block_count, INT_MAX);
+  depth[0] = frame.arg_count;
+  changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (int b : ir.order)
+    {
+      if (depth[b] == INT_MAX)
+        continue;
+      int d = depth[b];
+      for (int i = ir.blocks[b].start; i < ir.blocks[b].end; ++i)
+      {
+        if (d < pops[i])
+          return nullopt;
+        d += ir.push_counts[i] - pops[i];
+      }
+      for (int s : ir.blocks[b].succs)
+        if (d < depth[s])
+        {
+          depth[s] = d;
+          changed = true;
+        }
+    }
+  }
+
+  // the SSA values, block by block (a block with one predecessor comes
+  // after it in the reverse postorder, and merges get phis for every
+  // stack slot and local, with their values filled in afterwards)
+  auto new_value = [&](IRValue::Kind kind, int def, IRType type) {
+    ir.values.push_back({kind, def, {}, type});
+    return int(ir.values.size()) - 1;
+  };
+  vector<int> entry_stack;
+  for (int k = 0; k < frame.arg_count; ++k)
+    entry_stack.push_back(new_value(IRValue::Kind::ENTRY, -1, IRType::UNKNOWN));
+  vector<int> entry_locals;
+  for (int k = 0; k < ir.local_count; ++k)
+  {
+    IRType type = k < frame.arg_count ? IRType::UNKNOWN : IRType::NONE;
+    entry_locals.push_back(new_value(IRValue::Kind::ENTRY, -1, type));
+  }
+  ir.operands.resize(n);
+  ir.results.assign(n, -1);
+  vector<vector<int>> exit_stack(block_count);
+  vector<vector<int>> exit_locals(block_count);
+  vector<vector<int>> entry_phis(block_count);
+  for (int b : ir.order)
+  {
+    IRBlock& block = ir.blocks[b];
+    vector<int> stack;
+    vector<int> locals;
+    bool merge = block.preds.size() + (b == 0 ? 1 : 0) > 1;
+    if (merge)
+    {
+      for (int k = 0; k < depth[b] + ir.local_count; ++k)
+        block.phis.push_back(new_value(IRValue::Kind::PHI, b, IRType::UNKNOWN));
+      entry_phis[b] = block.phis;
+      stack.assign(block.phis.begin(), block.phis.begin() + depth[b]);
+      locals.assign(block.phis.begin() + depth[b], block.phis.end());
+    }
+    else if (b == 0)
+    {
+      stack = entry_stack;
+      locals = entry_locals;
+    }
+    else
+    {
+      const vector<int>& from = exit_stack[block.preds[0]];
+      stack.assign(from.end() - depth[b], from.end());
+      locals = exit_locals[block.preds[0]];
+    }
+    for (int i = block.start; i < block.end; ++i)
+    {
+      const VMInstr& instr = code[i];
+      ir.operands[i].assign(stack.end() - pops[i], stack.end());
+      stack.resize(stack.size() - pops[i]);
+      OpCode op = instr.opcode();
+      if (op == OpCode::LOAD)
+        ir.results[i] = locals[int_operand(instr)];
+      else if (op == OpCode::STORE)
+        locals[int_operand(instr)] = ir.operands[i][0];
+      else if (op == OpCode::DUP)
+      {
+        ir.results[i] = ir.operands[i][0];
+        stack.push_back(ir.results[i]);
+      }
+      else if (ir.push_counts[i] == 1)
+        ir.results[i] = new_value(IRValue::Kind::INSTR, i, type_of(instr));
+      if (ir.results[i] >= 0)
+        stack.push_back(ir.results[i]);
+    }
+    exit_stack[b] = stack;
+    exit_locals[b] = locals;
+  }
+  for (int b : ir.order)
+  {
+    const vector<int>& phis = entry_phis[b];
+    if (phis.empty())
+      continue;
+    // (slots are matched from the top of each predecessor's stack)
+    auto add_args = [&](const vector<int>& stack, const vector<int>& locals) {
+      for (int k = 0; k < depth[b]; ++k)
+        ir.values[phis[k]].args.push_back(stack[stack.size() - depth[b] + k]);
+      for (int k = 0; k < ir.local_count; ++k)
+        ir.values[phis[depth[b] + k]].args.push_back(locals[k]);
+    };
+    for (int p : ir.blocks[b].preds)
+      add_args(exit_stack[p], exit_locals[p]);
+    if (b == 0)
+      add_args(entry_stack, entry_locals);
+  }
+
+  // replace each phi whose values are all the same (or itself) by that
+  // value, and give the rest a type if their values all have it
+  vector<int> same(ir.values.size());
+  for (int v = 0; v < same.size(); ++v)
+    same[v] = v;
+  auto find = [&](int v) {
+    while (same[v] != v)
+      v = same[v];
+    return v;
+  };
+  changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (int b : ir.order)
+      for (int phi : ir.blocks[b].phis)
+      {
+        if (same[phi] != phi)
+          continue;
+        unordered_set<int> args;
+        for (int arg : ir.values[phi].args)
+          if (find(arg) != phi)
+            args.insert(find(arg));
+        if (args.size() == 1)
+        {
+          same[phi] = *args.begin();
+          changed = true;
+        }
+      }
+  }
+  for (int b : ir.order)
+  {
+    vector<int>& phis = ir.blocks[b].phis;
+    erase_if(phis, [&](int phi) { return same[phi] != phi; });
+    for (int phi : phis)
+      for (int& arg : ir.values[phi].args)
+        arg = find(arg);
+  }
+  for (int i = 0; i < n; ++i)
+  {
+    for (int& operand : ir.operands[i])
+      operand = find(operand);
+    if (ir.results[i] >= 0)
+      ir.results[i] = find(ir.results[i]);
+  }
+  changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (int b : ir.order)
+      for (int phi : ir.blocks[b].phis)
+      {
+        IRValue& value = ir.values[phi];
+        IRType type = ir.values[value.args[0]].type;
+        for (int arg : value.args)
+          if (ir.values[arg].type != type)
+            type = IRType::UNKNOWN;
+        if (type != value.type)
+        {
+          value.type = type;
+          changed = true;
+        }
+      }
+  }
+  return ir;
+}
+
+
+bool IRFunction::dominates(int a, int b) const
+{
+  while (b >= 0 and b != a)
+    b = blocks[b].idom;
+  return b == a;
+}
+
+
+int IRFunction::expression_start(int instr) const
+{
+  int b = block_of[instr];
+  if (b < 0)
+    return -1;
+  int need = operands[instr].size();
+  int start = instr;
+  while (need > 0)
+  {
+    --start;
+    // (a value pushed before the block, or also used after instr)
+    if (start < blocks[b].start or push_counts[start] > need)
+      return -1;
+    need += operands[start].size() - push_counts[start];
+  }
+  return start;
+}
+
+
+void rewrite(VMFrameInfo& frame, const map<int,vector<VMInstr>>& edits)
+{
+  vector<VMInstr>& code = frame.instructions;
+  int n = code.size();
+  vector<int> index(n + 1, 0);
+  vector<VMInstr> rewritten;
+  for (int i = 0; i < n; ++i)
+  {
+    index[i] = rewritten.size();
+    auto edit = edits.find(i);
+    if (edit == edits.end())
+      rewritten.push_back(code[i]);
+    else
+      rewritten.insert(rewritten.end(), edit->second.begin(), edit->second.end());
+  }
+  index[n] = rewritten.size();
+  for (VMInstr& instr : rewritten)
+    if (is_jump(instr))
+      instr.set_operand(index[int_operand(instr)]);
+  code = rewritten;
+}
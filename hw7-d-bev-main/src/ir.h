@@ -0,0 +1,116 @@
+//----------------------------------------------------------------------
+// FILE: ir.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: SSA form of generated VM instructions (for the optimizer)
+//----------------------------------------------------------------------
+
+#ifndef IR_H
+#define IR_H
+
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "vm_frame.h"
+
+
+// the number of arguments of each function (by name), which is how
+// many values its calls pop
+using ArgCounts = std::unordered_map<std::string,int>;
+
+
+// the type of a value, as given by the (typed) instruction computing it
+enum class IRType {UNKNOWN, INT, DOUBLE, BOOL, STRING, NONE};
+
+
+// A value computed once: pushed by an instruction, merged from the
+// values of a block's predecessors (a phi), or on the stack or in a
+// local when the function starts (an argument, or a null local).
+class IRValue
+{
+public:
+  enum class Kind {ENTRY, INSTR, PHI};
+  Kind kind;
+  int def;                  // the instruction or block (-1 if ENTRY)
+  std::vector<int> args;    // a phi's value from each predecessor
+  IRType type = IRType::UNKNOWN;
+};
+
+
+// A basic block: instructions [start, end) that run straight through.
+class IRBlock
+{
+public:
+  int start;
+  int end;
+  std::vector<int> preds;        // reachable predecessors
+  std::vector<int> succs;        // (a JMPF's next block, then its target)
+  int idom = -1;                 // immediate dominator (-1 for the entry)
+  std::vector<int> children;     // blocks it immediately dominates
+  std::vector<int> phis;
+};
+
+
+// The control flow graph and SSA values of a frame's instructions.
+// Every value pushed on the operand stack and stored in a local is an
+// SSA value (a LOAD, STORE, and DUP just move values around), with phis
+// for the stack slots and locals where control flow merges (the entry
+// block also merges with the function's start when jumped to). Stack
+// slots are matched from the top at merges, since a value that a call
+// statement leaves on the stack isn't used again. The IR only describes
+// the instructions: passes use it to decide how to change them (see
+// rewrite), and then build it again.
+class IRFunction
+{
+public:
+
+  // nullopt if the instructions have non-int jumps, call an unknown
+  // function, or use stack values from before a merge that aren't on
+  // the stack along every path to it
+  static std::optional<IRFunction> build(const VMFrameInfo& frame,
+                                         const ArgCounts& arg_counts);
+
+  std::vector<IRBlock> blocks;
+  std::vector<IRValue> values;
+
+  // the reachable blocks in reverse postorder (the entry block first)
+  std::vector<int> order;
+
+  // for each instruction: its block (-1 if unreachable), the values it
+  // pops (deepest first), the value it pushes (-1 if none; a DUP
+  // pushes its operand twice), and how many values it pushes
+  std::vector<int> block_of;
+  std::vector<std::vector<int>> operands;
+  std::vector<int> results;
+  std::vector<int> push_counts;
+
+  int local_count = 0;
+
+  // true if block a dominates block b
+  bool dominates(int a, int b) const;
+
+  // the first instruction of the expression ending with the given one:
+  // the instructions [start, instr] of its block compute the values it
+  // pops (used by nothing else), so they can be replaced as a whole (-1
+  // if the values come from elsewhere)
+  int expression_start(int instr) const;
+
+};
+
+
+// The instruction's stack effect (-1 pops if it calls an unknown
+// function).
+int pop_count(const VMInstr& instr, const ArgCounts& arg_counts);
+int push_count(const VMInstr& instr);
+
+
+// Replaces each edited instruction by its new instructions (removing it
+// if there are none), and renumbers the jumps (given as old indexes,
+// including those in the edits). A jump to a removed instruction goes
+// to the next one kept.
+void rewrite(VMFrameInfo& frame, const std::map<int,std::vector<VMInstr>>& edits);
+
+
+#endif
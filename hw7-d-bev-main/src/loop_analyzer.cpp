@@ -0,0 +1,540 @@
+//----------------------------------------------------------------------
+// FILE: loop_analyzer.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Loop-invariant expressions for the code generator
+//----------------------------------------------------------------------
+
+#include "loop_analyzer.h"
+
+using namespace std;
+
+
+namespace {
+
+  // the built-in functions (that don't write to fields or elements)
+  const unordered_set<string> builtins = {
+    "print", "input", "to_string", "to_int", "to_double", "length",
+    "length@array", "get", "concat"
+  };
+
+  // the path if the expression is only a variable or path
+  const VarRValue* bare_path(const Expr& e)
+  {
+    if (e.negated or e.op.has_value())
+      return nullptr;
+    SimpleTerm* term = dynamic_cast<SimpleTerm*>(e.first.get());
+    if (term == nullptr)
+      return nullptr;
+    return dynamic_cast<VarRValue*>(term->rvalue.get());
+  }
+
+  // the int literal if the expression is only an int literal
+  const SimpleRValue* int_literal(const Expr& e)
+  {
+    if (e.negated or e.op.has_value())
+      return nullptr;
+    SimpleTerm* term = dynamic_cast<SimpleTerm*>(e.first.get());
+    if (term == nullptr)
+      return nullptr;
+    SimpleRValue* rvalue = dynamic_cast<SimpleRValue*>(term->rvalue.get());
+    if (rvalue == nullptr or rvalue->value.type() != TokenType::INT_VAL)
+      return nullptr;
+    return rvalue;
+  }
+
+}
+
+
+LoopAnalyzer::LoopAnalyzer(const unordered_map<string,StructDef>& struct_defs,
+                           const unordered_set<string>& scalar_vars,
+                           TypeLookup var_type)
+  : struct_defs(struct_defs), scalar_vars(scalar_vars), var_type(var_type)
+{
+}
+
+
+vector<LoopAnalyzer::Invariant> LoopAnalyzer::invariants(WhileStmt& s)
+{
+  clear();
+  return invariants(s.condition, s.stmts);
+}
+
+
+vector<LoopAnalyzer::Invariant> LoopAnalyzer::invariants(ForStmt& s)
+{
+  // the variable is declared before the loop, but updated in it
+  clear();
+  s.assign_stmt.accept(*this);
+  return invariants(s.condition, s.stmts);
+}
+
+
+vector<LoopAnalyzer::Invariant>
+LoopAnalyzer::invariants(Expr& condition, vector<shared_ptr<Stmt>>& stmts)
+{
+  // what the loop writes
+  condition.accept(*this);
+  for (auto& stmt : stmts)
+    stmt->accept(*this);
+
+  // what the first iteration evaluates
+  found.clear();
+  certain = true;
+  in_condition = true;
+  anticipate(condition);
+  in_condition = false;
+  anticipate(stmts);
+  return found;
+}
+
+
+void LoopAnalyzer::clear()
+{
+  assigned.clear();
+  field_writes.clear();
+  element_writes.clear();
+  decl_types.clear();
+  calls = false;
+}
+
+
+optional<string> LoopAnalyzer::key(const VarRValue& v)
+{
+  return key(v, v.path.size(), true);
+}
+
+
+optional<string> LoopAnalyzer::key(const VarRValue& v, int length, bool index)
+{
+  string str;
+  for (int i = 0; i < length; ++i)
+  {
+    const VarRef& ref = v.path[i];
+    if (!str.empty())
+      str += ".";
+    str += ref.var_name.lexeme();
+    if (!ref.array_expr.has_value() or (i == length - 1 and !index))
+      continue;
+    const Expr& index = ref.array_expr.value();
+    const VarRValue* var = bare_path(index);
+    if (const SimpleRValue* literal = int_literal(index))
+      str += "[" + literal->value.lexeme() + "]";
+    else if (var and var->path.size() == 1 and !var->path[0].array_expr.has_value())
+      str += "[" + var->path[0].var_name.lexeme() + "]";
+    else
+      return nullopt;
+  }
+  return str;
+}
+
+
+optional<string> LoopAnalyzer::key(const CallExpr& e)
+{
+  string name = e.fun_name.lexeme();
+  if ((name != "length" and name != "length@array") or e.args.size() != 1)
+    return nullopt;
+  const VarRValue* arg = bare_path(e.args[0]);
+  if (arg == nullptr)
+    return nullopt;
+  optional<string> arg_key = key(*arg);
+  if (!arg_key.has_value())
+    return nullopt;
+  return name + "(" + arg_key.value() + ")";
+}
+
+
+vector<VarRef> LoopAnalyzer::local_path(const vector<VarRef>& path) const
+{
+  if (path.size() < 2 or !scalar_vars.contains(path[0].var_name.lexeme()))
+    return path;
+  vector<VarRef> new_path(path.begin() + 1, path.end());
+  Token field = path[1].var_name;
+  new_path[0].var_name = Token(field.type(), path[0].var_name.lexeme() + "." +
+                               field.lexeme(), field.line(), field.column());
+  return new_path;
+}
+
+
+string LoopAnalyzer::type_of(const string& var_name) const
+{
+  if (decl_types.contains(var_name))
+    return decl_types.at(var_name);
+  return var_type(var_name);
+}
+
+
+string LoopAnalyzer::type_of(const string& struct_type, const string& field) const
+{
+  if (struct_defs.contains(struct_type))
+    for (const VarDef& def : struct_defs.at(struct_type).fields)
+      if (def.var_name.lexeme() == field)
+        return def.data_type.type_name;
+  return "";
+}
+
+
+string LoopAnalyzer::type_of(const VarRValue& v) const
+{
+  vector<VarRef> path = local_path(v.path);
+  string type = type_of(path[0].var_name.lexeme());
+  for (int i = 1; i < path.size(); ++i)
+    type = type_of(type, path[i].var_name.lexeme());
+  return type;
+}
+
+
+bool LoopAnalyzer::invariant_index(const Expr& e) const
+{
+  if (int_literal(e))
+    return true;
+  const VarRValue* var = bare_path(e);
+  return var and var->path.size() == 1 and !var->path[0].array_expr.has_value()
+    and !assigned.contains(var->path[0].var_name.lexeme());
+}
+
+
+bool LoopAnalyzer::invariant(const VarRValue& v) const
+{
+  vector<VarRef> path = local_path(v.path);
+  string root = path[0].var_name.lexeme();
+  if (assigned.contains(root) or assigned.contains(v.path[0].var_name.lexeme()))
+    return false;
+  // a local on its own is already as cheap as it gets
+  if (path.size() == 1 and !path[0].array_expr.has_value())
+    return false;
+  if (calls or !key(v).has_value())
+    return false;
+  string type = type_of(root);
+  for (int i = 0; i < path.size(); ++i)
+  {
+    if (i > 0)
+    {
+      // a GETF of the field, which a SETF of the same field may change
+      string field = path[i].var_name.lexeme();
+      for (const auto& [write_type, write_field] : field_writes)
+        if (write_field == field and (write_type == "" or type == "" or write_type == type))
+          return false;
+      type = type_of(type, field);
+    }
+    if (path[i].array_expr.has_value())
+    {
+      // a GETI of an element, which a SETI of the same array type may change
+      if (!invariant_index(path[i].array_expr.value()))
+        return false;
+      if (element_writes.contains(type) or element_writes.contains("") or
+          (type == "" and !element_writes.empty()))
+        return false;
+    }
+  }
+  return true;
+}
+
+
+bool LoopAnalyzer::invariant(const CallExpr& e) const
+{
+  if (!key(e).has_value())
+    return false;
+  // strings are immutable and arrays can't be resized, so only the
+  // variable (or path) matters
+  const VarRValue& arg = *bare_path(e.args[0]);
+  vector<VarRef> path = local_path(arg.path);
+  if (path.size() > 1 or path[0].array_expr.has_value())
+    return invariant(arg);
+  return !assigned.contains(path[0].var_name.lexeme()) and
+    !assigned.contains(arg.path[0].var_name.lexeme());
+}
+
+
+void LoopAnalyzer::add_invariant(const string& key, RValue* v, const string& type)
+{
+  if (!certain)
+    return;
+  for (const Invariant& invariant : found)
+    if (invariant.key == key)
+      return;
+  found.push_back({key, v, type});
+}
+
+
+void LoopAnalyzer::may_fail()
+{
+  // the whole condition is evaluated before the invariants are
+  if (!in_condition)
+    certain = false;
+}
+
+
+void LoopAnalyzer::anticipate(Expr& e)
+{
+  anticipate(*e.first);
+  if (e.negated)
+    may_fail();
+  if (!e.op.has_value())
+    return;
+  string op = e.op.value().lexeme();
+  if (op == "and" or op == "or")
+  {
+    // the right operand may not be evaluated
+    may_fail();
+    return;
+  }
+  anticipate(*e.rest);
+  if (op != "==" and op != "!=")
+    may_fail();
+}
+
+
+void LoopAnalyzer::anticipate(ExprTerm& t)
+{
+  if (ComplexTerm* term = dynamic_cast<ComplexTerm*>(&t))
+    anticipate(term->expr);
+  else if (SimpleTerm* term = dynamic_cast<SimpleTerm*>(&t))
+    anticipate(*term->rvalue);
+}
+
+
+void LoopAnalyzer::anticipate(RValue& v)
+{
+  if (VarRValue* rvalue = dynamic_cast<VarRValue*>(&v))
+  {
+    if (invariant(*rvalue))
+      add_invariant(key(*rvalue).value(), rvalue, type_of(*rvalue));
+    else if (rvalue->path.size() > 1 or rvalue->path[0].array_expr.has_value())
+    {
+      // the longest invariant prefix (evaluated before the rest)
+      bool found_prefix = false;
+      for (int length = rvalue->path.size(); length > 0 and !found_prefix; --length)
+      {
+        for (bool index : {true, false})
+        {
+          if (index and (length == rvalue->path.size() or
+                         !rvalue->path[length - 1].array_expr.has_value()))
+            continue;
+          auto prefix = make_shared<VarRValue>();
+          prefix->path.assign(rvalue->path.begin(), rvalue->path.begin() + length);
+          if (!index)
+            prefix->path.back().array_expr = nullopt;
+          if (!invariant(*prefix))
+            continue;
+          prefixes.push_back(prefix);
+          add_invariant(key(*prefix).value(), prefix.get(), type_of(*prefix));
+          found_prefix = true;
+          break;
+        }
+      }
+      may_fail();
+    }
+  }
+  else if (CallExpr* rvalue = dynamic_cast<CallExpr*>(&v))
+  {
+    if (invariant(*rvalue))
+      add_invariant(key(*rvalue).value(), rvalue, "int");
+    else
+    {
+      for (Expr& arg : rvalue->args)
+        anticipate(arg);
+      may_fail();
+    }
+  }
+  else if (NewRValue* rvalue = dynamic_cast<NewRValue*>(&v))
+  {
+    if (rvalue->array_expr.has_value())
+    {
+      anticipate(rvalue->array_expr.value());
+      may_fail();
+    }
+  }
+}
+
+
+void LoopAnalyzer::anticipate(vector<shared_ptr<Stmt>>& stmts)
+{
+  for (auto& stmt : stmts)
+  {
+    if (!certain)
+      return;
+    if (VarDeclStmt* s = dynamic_cast<VarDeclStmt*>(stmt.get()))
+    {
+      // (a scalar replaced variable's "new T" isn't evaluated)
+      if (!scalar_vars.contains(s->var_def.var_name.lexeme()))
+        anticipate(s->expr);
+    }
+    else if (AssignStmt* s = dynamic_cast<AssignStmt*>(stmt.get()))
+    {
+      vector<VarRef> lvalue = local_path(s->lvalue);
+      if (lvalue.size() == 1 and !lvalue[0].array_expr.has_value())
+        anticipate(s->expr);
+      else
+        may_fail();
+    }
+    else if (IfStmt* s = dynamic_cast<IfStmt*>(stmt.get()))
+    {
+      anticipate(s->if_part.condition);
+      may_fail();
+    }
+    else if (WhileStmt* s = dynamic_cast<WhileStmt*>(stmt.get()))
+    {
+      anticipate(s->condition);
+      may_fail();
+    }
+    else if (CallExpr* s = dynamic_cast<CallExpr*>(stmt.get()))
+      anticipate(static_cast<RValue&>(*s));
+    else
+      may_fail();
+  }
+}
+
+
+void LoopAnalyzer::visit(Program&)
+{
+}
+
+
+void LoopAnalyzer::visit(FunDef&)
+{
+}
+
+
+void LoopAnalyzer::visit(StructDef&)
+{
+}
+
+
+void LoopAnalyzer::visit(ReturnStmt& s)
+{
+  s.expr.accept(*this);
+}
+
+
+void LoopAnalyzer::visit(WhileStmt& s)
+{
+  s.condition.accept(*this);
+  for (auto& stmt : s.stmts)
+    stmt->accept(*this);
+}
+
+
+void LoopAnalyzer::visit(ForStmt& s)
+{
+  s.var_decl.accept(*this);
+  s.condition.accept(*this);
+  s.assign_stmt.accept(*this);
+  for (auto& stmt : s.stmts)
+    stmt->accept(*this);
+}
+
+
+void LoopAnalyzer::visit(IfStmt& s)
+{
+  s.if_part.condition.accept(*this);
+  for (auto& stmt : s.if_part.stmts)
+    stmt->accept(*this);
+  for (auto& else_if : s.else_ifs)
+  {
+    else_if.condition.accept(*this);
+    for (auto& stmt : else_if.stmts)
+      stmt->accept(*this);
+  }
+  for (auto& stmt : s.else_stmts)
+    stmt->accept(*this);
+}
+
+
+void LoopAnalyzer::visit(VarDeclStmt& s)
+{
+  string name = s.var_def.var_name.lexeme();
+  string type = s.var_def.data_type.type_name;
+  assigned.insert(name);
+  if (decl_types.contains(name) and decl_types[name] != type)
+    decl_types[name] = "";
+  else
+    decl_types[name] = type;
+  // the fields of a scalar replaced variable are locals
+  if (scalar_vars.contains(name) and struct_defs.contains(type))
+    for (const VarDef& field : struct_defs.at(type).fields)
+      assigned.insert(name + "." + field.var_name.lexeme());
+  s.expr.accept(*this);
+}
+
+
+void LoopAnalyzer::visit(AssignStmt& s)
+{
+  vector<VarRef> lvalue = local_path(s.lvalue);
+  if (lvalue.size() == 1 and !lvalue[0].array_expr.has_value())
+    assigned.insert(lvalue[0].var_name.lexeme());
+  else
+  {
+    // the last step of the path is a SETF or SETI
+    string type = type_of(lvalue[0].var_name.lexeme());
+    for (int i = 0; i < lvalue.size(); ++i)
+    {
+      bool last = i == lvalue.size() - 1;
+      if (i > 0)
+      {
+        string field = lvalue[i].var_name.lexeme();
+        if (last and !lvalue[i].array_expr.has_value())
+        {
+          field_writes.insert({type, field});
+          break;
+        }
+        type = type_of(type, field);
+      }
+      if (last and lvalue[i].array_expr.has_value())
+        element_writes.insert(type);
+    }
+  }
+  for (VarRef& ref : s.lvalue)
+    if (ref.array_expr.has_value())
+      ref.array_expr->accept(*this);
+  s.expr.accept(*this);
+}
+
+
+void LoopAnalyzer::visit(CallExpr& e)
+{
+  if (!builtins.contains(e.fun_name.lexeme()))
+    calls = true;
+  for (Expr& arg : e.args)
+    arg.accept(*this);
+}
+
+
+void LoopAnalyzer::visit(Expr& e)
+{
+  e.first->accept(*this);
+  if (e.rest)
+    e.rest->accept(*this);
+}
+
+
+void LoopAnalyzer::visit(SimpleTerm& t)
+{
+  t.rvalue->accept(*this);
+}
+
+
+void LoopAnalyzer::visit(ComplexTerm& t)
+{
+  t.expr.accept(*this);
+}
+
+
+void LoopAnalyzer::visit(SimpleRValue&)
+{
+}
+
+
+void LoopAnalyzer::visit(NewRValue& v)
+{
+  if (v.array_expr.has_value())
+    v.array_expr->accept(*this);
+}
+
+
+void LoopAnalyzer::visit(VarRValue& v)
+{
+  for (VarRef& ref : v.path)
+    if (ref.array_expr.has_value())
+      ref.array_expr->accept(*this);
+}
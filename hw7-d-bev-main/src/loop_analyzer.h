@@ -0,0 +1,155 @@
+//----------------------------------------------------------------------
+// FILE: loop_analyzer.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Loop-invariant expressions for the code generator
+//----------------------------------------------------------------------
+
+#ifndef LOOP_ANALYZER_H
+#define LOOP_ANALYZER_H
+
+#include <functional>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "ast.h"
+
+
+// Finds the expressions of a while or for loop that can be computed
+// once, before the loop's first iteration, instead of on every
+// iteration. These are path loads (v.f.g, v.f[i]) and lengths of
+// strings and arrays (of variables or path loads) whose variables
+// aren't assigned in the loop, and whose fields and elements aren't
+// written by the loop. Writes (SETF and SETI) are assumed to alias any
+// field of the same name in a struct of the same type, and any element
+// of an array of the same type, and a loop that calls a function
+// writes everything.
+//
+// An expression is only hoisted if the first iteration is certain to
+// evaluate it: the loop condition outside of the right operands of
+// and/or, followed by the statements at the start of the body until
+// the first that could fail or have an effect (other than setting a
+// local variable). The invariants are then computed just after the
+// condition first holds, in the same order, so a failure still happens
+// at the same point. When a path load isn't invariant, its longest
+// invariant prefix may be (e.g., the v.f of v.f[i].g).
+class LoopAnalyzer : public Visitor {
+public:
+
+  // an expression to compute once, before the loop
+  class Invariant
+  {
+  public:
+    std::string key;        // see key()
+    RValue* rvalue;         // (valid as long as the analyzer is)
+    std::string type;       // declared type of the value ("" if unknown)
+  };
+
+  // the declared type of each variable in scope before the loop
+  using TypeLookup = std::function<std::string(const std::string&)>;
+
+  LoopAnalyzer(const std::unordered_map<std::string,StructDef>& struct_defs,
+               const std::unordered_set<std::string>& scalar_vars,
+               TypeLookup var_type);
+
+  // the loop's invariants, in the order they are to be computed
+  std::vector<Invariant> invariants(WhileStmt& s);
+  std::vector<Invariant> invariants(ForStmt& s);
+
+  // a string identifying the path load (of the path's first length
+  // steps, without the last one's index unless index is true) or length
+  // call (nullopt for other rvalues), equal for rvalues computing the
+  // same value when their variables are the same
+  static std::optional<std::string> key(const VarRValue& v, int length, bool index);
+  static std::optional<std::string> key(const VarRValue& v);
+  static std::optional<std::string> key(const CallExpr& e);
+
+  void visit(Program& p);
+  void visit(FunDef& f);
+  void visit(StructDef& s);
+  void visit(ReturnStmt& s);
+  void visit(WhileStmt& s);
+  void visit(ForStmt& s);
+  void visit(IfStmt& s);
+  void visit(VarDeclStmt& s);
+  void visit(AssignStmt& s);
+  void visit(CallExpr& e);
+  void visit(Expr& e);
+  void visit(SimpleTerm& t);
+  void visit(ComplexTerm& t);
+  void visit(SimpleRValue& v);
+  void visit(NewRValue& v);
+  void visit(VarRValue& v);
+
+private:
+
+  const std::unordered_map<std::string,StructDef>& struct_defs;
+  const std::unordered_set<std::string>& scalar_vars;
+  TypeLookup var_type;
+
+  // what the loop writes: local variables (assigned or declared), the
+  // (struct type, field) of each SETF, and the array type of each SETI
+  // (an empty type if unknown)
+  std::unordered_set<std::string> assigned;
+  std::set<std::pair<std::string,std::string>> field_writes;
+  std::unordered_set<std::string> element_writes;
+  bool calls = false;
+
+  // the types of the variables declared in the loop ("" if declared
+  // more than once with different types)
+  std::unordered_map<std::string,std::string> decl_types;
+
+  // the invariants found so far, and whether the first iteration is
+  // still certain to get to the expression being scanned
+  std::vector<Invariant> found;
+  bool certain = true;
+  bool in_condition = false;
+
+  // forget the previous loop's writes
+  void clear();
+
+  // the invariant path prefixes (that aren't in the AST)
+  std::vector<std::shared_ptr<VarRValue>> prefixes;
+
+  // find the loop's writes and then its invariants
+  std::vector<Invariant> invariants(Expr& condition,
+                                    std::vector<std::shared_ptr<Stmt>>& stmts);
+
+  // the path with a leading field of a scalar replaced variable (v.f)
+  // as the local "v.f" (as the code generator does)
+  std::vector<VarRef> local_path(const std::vector<VarRef>& path) const;
+
+  // the declared type of the variable, of the struct's field, and of
+  // the path's value ("" if unknown)
+  std::string type_of(const std::string& var_name) const;
+  std::string type_of(const std::string& struct_type, const std::string& field) const;
+  std::string type_of(const VarRValue& v) const;
+
+  // true if the path load or length call has the same value in every
+  // iteration (and isn't just a local variable)
+  bool invariant(const VarRValue& v) const;
+  bool invariant(const CallExpr& e) const;
+
+  // true if the index expression is a literal or an unassigned local
+  bool invariant_index(const Expr& e) const;
+
+  // add the invariants the first iteration is certain to evaluate (in
+  // evaluation order), and stop at anything that may fail
+  void anticipate(Expr& e);
+  void anticipate(ExprTerm& t);
+  void anticipate(RValue& v);
+  void anticipate(std::vector<std::shared_ptr<Stmt>>& stmts);
+
+  // add the invariant if it isn't already found
+  void add_invariant(const std::string& key, RValue* v, const std::string& type);
+
+  // nothing after the current expression is certain to be evaluated
+  void may_fail();
+
+};
+
+#endif
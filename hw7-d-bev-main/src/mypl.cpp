@@ -18,6 +18,7 @@
 #include "ast_parser.h"
 #include "ast.h"
 #include "semantic_checker.h"
+#include "constant_folder.h"
 #include "code_generator.h"
 
 using namespace std;
@@ -31,6 +32,8 @@ void print(string filename);
 void check(string filename);
 void ir(string filename);
 void normal(string filename);
+void profile(string filename);
+void passes(string filename);
 
 int main(int argc, char *argv[])
 {
@@ -90,6 +93,18 @@ int main(int argc, char *argv[])
           cout << "Case 2: ir" << endl;
         ir(filename);
       }
+      else if (option.compare("--profile") == 0)
+      {
+        if (debug)
+          cout << "Case 2: profile" << endl;
+        profile(filename);
+      }
+      else if (option.compare("--passes") == 0)
+      {
+        if (debug)
+          cout << "Case 2: passes" << endl;
+        passes(filename);
+      }
       else
       {
         // if here, argv[1] isn't a valid option: should be a filename
@@ -143,6 +158,18 @@ int main(int argc, char *argv[])
           cout << "Case 3: ir" << endl;
         ir(filename);
       }
+      else if (option.compare("--profile") == 0)
+      {
+        if (debug)
+          cout << "Case 3: profile" << endl;
+        profile(filename);
+      }
+      else if (option.compare("--passes") == 0)
+      {
+        if (debug)
+          cout << "Case 3: passes" << endl;
+        passes(filename);
+      }
       else
       {
         //  detected "./mypl [option] [file]", but the option was invalid
@@ -186,6 +213,8 @@ void usage()
   cout << "  --print\tpretty prints program" << endl;
   cout << "  --check\tstatically checks program" << endl;
   cout << "  --ir   \tprint intermediate (code) representation" << endl;
+  cout << "  --profile\truns program, then prints superinstruction report" << endl;
+  cout << "  --passes\tprints what each optimization pass did (without running)" << endl;
 }
 
 void lex(string filename)
@@ -364,6 +393,8 @@ void ir(string filename)
     Program p = parser.parse();
     SemanticChecker t;
     p.accept(t);
+    ConstantFolder f;
+    p.accept(f);
     VM vm;
     CodeGenerator g(vm);
     p.accept(g);
@@ -403,13 +434,97 @@ void normal(string filename)
     Program p = parser.parse();
     SemanticChecker t;
     p.accept(t);
+    ConstantFolder f;
+    p.accept(f);
+    VM vm;
+    CodeGenerator g(vm);
+    p.accept(g);
+    vm.run();
+  }
+  catch (MyPLException &ex)
+  {
+    cerr << ex.what() << endl;
+  }
+}
+
+void profile(string filename)
+{
+  istream *input = &cin;
+
+  // checks if filename isn't empty
+  if (filename.compare(""))
+  {
+    input = swapInput(filename);
+
+    if (input->fail())
+    {
+      cout << "Input Error: Could not find file '" << filename << "'" << endl;
+      return;
+    }
+  }
+
+  Lexer lexer(*input);
+
+  try
+  {
+    ASTParser parser(lexer);
+    Program p = parser.parse();
+    SemanticChecker t;
+    p.accept(t);
+    ConstantFolder f;
+    p.accept(f);
     VM vm;
     CodeGenerator g(vm);
     p.accept(g);
+    vm.set_profiling(true);
     vm.run();
+    cout << endl << fusion_report(vm);
   }
   catch (MyPLException &ex)
   {
     cerr << ex.what() << endl;
   }
-}
\ No newline at end of file
+
+  if (input->eof())
+    delete input;
+}
+
+void passes(string filename)
+{
+  istream *input = &cin;
+
+  // checks if filename isn't empty
+  if (filename.compare(""))
+  {
+    input = swapInput(filename);
+
+    if (input->fail())
+    {
+      cout << "Input Error: Could not find file '" << filename << "'" << endl;
+      return;
+    }
+  }
+
+  Lexer lexer(*input);
+
+  try
+  {
+    ASTParser parser(lexer);
+    Program p = parser.parse();
+    SemanticChecker t;
+    p.accept(t);
+    ConstantFolder f;
+    p.accept(f);
+    VM vm;
+    CodeGenerator g(vm);
+    p.accept(g);
+    cout << pass_report(g.pass_manager());
+  }
+  catch (MyPLException &ex)
+  {
+    cerr << ex.what() << endl;
+  }
+
+  if (input->eof())
+    delete input;
+}
@@ -8,7 +8,10 @@
 #ifndef OP_CODE_H
 #define OP_CODE_H
 
-enum class OpCode {
+#include <cstdint>
+
+// opcodes are stored in a single byte in the encoded (VMCode) format
+enum class OpCode : std::uint8_t {
 
   // consts/vars
   PUSH,         // [operand] push v onto stack
@@ -35,6 +38,17 @@ enum class OpCode {
   CMPEQ,        // pop x and y off stack, push (y == x)  
   CMPNE,        // pop x and y off stack, push (y != x)
 
+  // typed arithmetic ops and comparators: same as above, for operands
+  // known (by the semantic checker) to be ints (I), doubles (D), or
+  // strings (S), where the EQ/NE "ints" are any one-word values (ints,
+  // bools, and object references)
+  ADDI, SUBI, MULI, DIVI,
+  ADDD, SUBD, MULD, DIVD,
+  CMPLTI, CMPLEI, CMPGTI, CMPGEI,
+  CMPLTD, CMPLED, CMPGTD, CMPGED,
+  CMPLTS, CMPLES, CMPGTS, CMPGES,
+  CMPEQI, CMPNEI, CMPEQS, CMPNES,
+
   // jump
   JMP,          // [operand] jump to given instruction v
   JMPF,         // [operand] pop x, if x is false jump to instruction v
@@ -42,6 +56,8 @@ enum class OpCode {
   // functions
   CALL,         // [operand] call function v (pop and push args)
   RET,          // return from current function
+  TAILCALL,     // [operand] call function v in place of the current frame
+                // (as CALL then RET, but reusing the frame)
 
   // built-ins
   WRITE,        // pop x, write to stdout
@@ -55,17 +71,38 @@ enum class OpCode {
   CONCAT,       // pop x, pop y, push x + y (string concat)
     
   // heap
-  ALLOCS,       // allocate struct obj, push oid x
-  ALLOCA,       // pop x, pop y, allocate array obj with y x values, push oid
+  ALLOCS,       // [operand] allocate struct obj, push oid x (if struct type v
+                // is given, the obj has each of its fields, set to null)
+  ALLOCR,       // [operand] same as ALLOCS, but the obj is freed when the
+                // frame returns
+  ALLOCA,       // [operand] pop x, pop y, allocate array obj with y x values,
+                // push oid (v an optional int, double, or bool element type)
   ADDF,         // [operand] pop x, add field named v to obj(x)
-  SETF,         // [operand] pop x and y, set obj(y).v = x
-  GETF,         // [operand] pop x, push value of obj(x).v 
+  SETF,         // [operand] pop x and y, set obj(y).v = x (v a name or slot)
+  GETF,         // [operand] pop x, push value of obj(x).v (v a name or slot)
   SETI,         // pop x, y, and z, set array obj(z)[y] = x
   GETI,         // pop x and y, push array obj(y)[x] value
     
   // special
   DUP,          // pop x, push x, push x
-  NOP           // has no effect (for jumping over code segments)
+  NOP,          // has no effect (for jumping over code segments)
+
+  // encoded-only forms (selected by the VM when encoding instructions)
+  SETF_SLOT,    // SETF whose operand is a field slot index
+  GETF_SLOT,    // GETF whose operand is a field slot index
+
+  // superinstructions (fused by the VM when encoding instructions): each
+  // replaces the first instruction of its sequence, reads the operands
+  // of the rest from the instructions that follow it (which are kept,
+  // so jumping into the middle of a sequence still works), and then
+  // skips past the sequence
+  LOAD_LOAD,    // LOAD a, LOAD b
+  LOAD_PUSH,    // LOAD a, PUSH v
+  PUSH_WRITE,   // PUSH v, WRITE
+  DUP_STORE,    // DUP, STORE a (store without popping)
+  LOAD_PUSH_ADDI_STORE,   // LOAD a, PUSH v, ADDI, STORE b (e.g., i = i + 1)
+  CMPLTI_JMPF, CMPLEI_JMPF, CMPGTI_JMPF,  // CMPxxI, JMPF v
+  CMPGEI_JMPF, CMPEQI_JMPF, CMPNEI_JMPF
 
 };
 
@@ -0,0 +1,54 @@
+//----------------------------------------------------------------------
+// FILE: pass_manager.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Runs the optimization passes over generated VM frames
+//----------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdio>
+#include "pass_manager.h"
+
+using namespace std;
+
+
+void PassManager::add(const string& name, Pass pass)
+{
+  passes.push_back({name, pass});
+}
+
+
+void PassManager::run(VMFrameInfo& frame, const ArgCounts& arg_counts)
+{
+  ++frames;
+  for (Entry& entry : passes)
+  {
+    entry.before += frame.instructions.size();
+    auto start = chrono::steady_clock::now();
+    entry.changes += entry.pass(frame, arg_counts);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    entry.seconds += elapsed.count();
+    entry.after += frame.instructions.size();
+  }
+}
+
+
+string pass_report(const PassManager& manager)
+{
+  string s = "pass              time (ms)    changes   instructions\n";
+  double seconds = 0;
+  int changes = 0;
+  for (const PassManager::Entry& entry : manager.passes)
+  {
+    char line[100];
+    snprintf(line, sizeof(line), "%-16s %10.3f %10d %7d -> %d\n", entry.name.c_str(),
+             entry.seconds * 1000, entry.changes, entry.before, entry.after);
+    s += line;
+    seconds += entry.seconds;
+    changes += entry.changes;
+  }
+  char line[100];
+  snprintf(line, sizeof(line), "%d frames, %.3f ms, %d changes\n", manager.frames,
+           seconds * 1000, changes);
+  return s + line;
+}
@@ -0,0 +1,56 @@
+//----------------------------------------------------------------------
+// FILE: pass_manager.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Runs the optimization passes over generated VM frames
+//----------------------------------------------------------------------
+
+#ifndef PASS_MANAGER_H
+#define PASS_MANAGER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "ir.h"
+
+
+// Runs a sequence of passes over each frame (in the order added), and
+// keeps track of how long each pass took and how much it changed the
+// instructions (see pass_report).
+class PassManager
+{
+public:
+
+  // a pass changes the frame's instructions, returning the number of
+  // changes it made
+  using Pass = std::function<int(VMFrameInfo&, const ArgCounts&)>;
+
+  void add(const std::string& name, Pass pass);
+
+  // run every pass over the frame (given the argument counts of the
+  // functions it may call)
+  void run(VMFrameInfo& frame, const ArgCounts& arg_counts);
+
+  // each pass's total time, changes, and instruction counts before and
+  // after it, over every frame run
+  friend std::string pass_report(const PassManager& manager);
+
+private:
+
+  class Entry
+  {
+  public:
+    std::string name;
+    Pass pass;
+    double seconds = 0;
+    int changes = 0;
+    int before = 0;
+    int after = 0;
+  };
+
+  std::vector<Entry> passes;
+  int frames = 0;
+
+};
+
+#endif
@@ -0,0 +1,243 @@
+//----------------------------------------------------------------------
+// FILE: path_cse.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Reuse of repeated struct path loads in generated VM instructions
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include <unordered_map>
+#include "path_cse.h"
+
+using namespace std;
+
+
+namespace {
+
+  bool is_jump(const VMInstr& instr)
+  {
+    return instr.opcode() == OpCode::JMP or instr.opcode() == OpCode::JMPF;
+  }
+
+  bool ends_block(const VMInstr& instr)
+  {
+    OpCode op = instr.opcode();
+    return is_jump(instr) or op == OpCode::RET or op == OpCode::TAILCALL;
+  }
+
+  int int_operand(const VMInstr& instr)
+  {
+    return get<int>(instr.operand().value());
+  }
+
+  // the field of a GETF or SETF (its slot, or its name)
+  string field_of(const VMInstr& instr)
+  {
+    VMValue operand = instr.operand().value();
+    if (holds_alternative<int>(operand))
+      return to_string(get<int>(operand));
+    return get<string>(operand);
+  }
+
+  bool is_slot(const string& field)
+  {
+    return !field.empty() and isdigit(field[0]);
+  }
+
+  // true if setting the first field may change the second (different
+  // slots never alias, but a name may be any slot)
+  bool may_alias(const string& set_field, const string& get_field)
+  {
+    return set_field == get_field or is_slot(set_field) != is_slot(get_field);
+  }
+
+  // a path load whose value is available (in the occurrence's local,
+  // once it is saved)
+  class Available
+  {
+  public:
+    int local;
+    vector<string> fields;
+    int occurrence;
+  };
+
+  // where a path (of the chain's first length fields) was loaded
+  class Occurrence
+  {
+  public:
+    int chain;
+    int length;
+    int temp = -1;     // the local it is saved in (-1 if never reused)
+  };
+
+  using State = unordered_map<string, Available>;
+
+  string path_key(int local, const vector<string>& fields, int length)
+  {
+    string key = to_string(local);
+    for (int i = 0; i < length; ++i)
+      key += "." + fields[i];
+    return key;
+  }
+
+}
+
+
+int reuse_path_loads(VMFrameInfo& frame)
+{
+  vector<VMInstr>& code = frame.instructions;
+  int n = code.size();
+
+  // the basic blocks (and the first free local)
+  vector<bool> leader(n + 1, false);
+  leader[0] = true;
+  int next_local = frame.arg_count;
+  for (int i = 0; i < n; ++i)
+  {
+    const VMInstr& instr = code[i];
+    if (is_jump(instr))
+    {
+      optional<VMValue> operand = instr.operand();
+      if (!operand.has_value() or !holds_alternative<int>(operand.value()))
+        return 0;
+      int t = get<int>(operand.value());
+      if (t < 0 or t > n)
+        return 0;
+      leader[t] = true;
+    }
+    if (ends_block(instr))
+      leader[i + 1] = true;
+    OpCode op = instr.opcode();
+    if ((op == OpCode::LOAD or op == OpCode::STORE) and instr.operand().has_value() and
+        holds_alternative<int>(instr.operand().value()))
+      next_local = max(next_local, int_operand(instr) + 1);
+  }
+
+  // each block's predecessors (by first instruction)
+  vector<int> block_start(n + 1, 0);
+  for (int i = 1; i <= n; ++i)
+    block_start[i] = leader[i] ? i : block_start[i - 1];
+  unordered_map<int, vector<int>> preds;
+  for (int i = 0; i < n; ++i)
+  {
+    if (is_jump(code[i]))
+      preds[int_operand(code[i])].push_back(block_start[i]);
+    if (leader[i + 1] and (!ends_block(code[i]) or code[i].opcode() == OpCode::JMPF))
+      preds[i + 1].push_back(block_start[i]);
+  }
+
+  // find the repeated loads: the paths available at the end of each
+  // block, where each path was loaded, and which loads reuse them
+  unordered_map<int, State> block_end;
+  vector<Occurrence> occurrences;
+  unordered_map<int, pair<int,int>> reuses;   // chain -> (length, occurrence)
+  State state;
+  for (int i = 0; i < n; ++i)
+  {
+    if (leader[i])
+    {
+      // the paths every (earlier) predecessor ends with loaded by the
+      // same load (with no loops back to the block)
+      state.clear();
+      const vector<int>& from = preds[i];
+      bool forward = !from.empty() and all_of(from.begin(), from.end(),
+                                              [i](int pred) { return pred < i; });
+      if (forward)
+      {
+        state = block_end[from[0]];
+        for (int pred : from)
+          erase_if(state, [&](const auto& entry) {
+            const State& end = block_end[pred];
+            auto other = end.find(entry.first);
+            return other == end.end() or
+              other->second.occurrence != entry.second.occurrence;
+          });
+      }
+    }
+    const VMInstr& instr = code[i];
+    OpCode op = instr.opcode();
+    if (op == OpCode::LOAD and holds_alternative<int>(instr.operand().value()))
+    {
+      // the chain of GETFs (within the block) loading a path
+      int local = int_operand(instr);
+      vector<string> fields;
+      while (i + 1 + fields.size() < n and !leader[i + 1 + fields.size()] and
+             code[i + 1 + fields.size()].opcode() == OpCode::GETF)
+        fields.push_back(field_of(code[i + 1 + fields.size()]));
+      int k = fields.size();
+      int reused = 0;
+      for (int j = k; j > 0 and reused == 0; --j)
+      {
+        string key = path_key(local, fields, j);
+        if (!state.contains(key))
+          continue;
+        reused = j;
+        int occurrence = state[key].occurrence;
+        if (occurrences[occurrence].temp < 0)
+          occurrences[occurrence].temp = next_local++;
+        reuses[i] = {j, occurrence};
+      }
+      for (int j = reused + 1; j <= k; ++j)
+      {
+        occurrences.push_back({i, j});
+        vector<string> path(fields.begin(), fields.begin() + j);
+        state[path_key(local, fields, j)] = {local, path, int(occurrences.size()) - 1};
+      }
+      i += k;
+    }
+    else if (op == OpCode::STORE)
+    {
+      int local = int_operand(instr);
+      erase_if(state, [&](const auto& entry) { return entry.second.local == local; });
+    }
+    else if (op == OpCode::SETF)
+    {
+      string field = field_of(instr);
+      erase_if(state, [&](const auto& entry) {
+        for (const string& get_field : entry.second.fields)
+          if (may_alias(field, get_field))
+            return true;
+        return false;
+      });
+    }
+    else if (op == OpCode::CALL or op == OpCode::TAILCALL)
+      state.clear();
+    if (i + 1 >= n or leader[i + 1])
+      block_end[block_start[i]] = state;
+  }
+  if (reuses.empty())
+    return 0;
+
+  // rewrite the loads, saving each reused path after its first load
+  unordered_map<int, vector<int>> saves;   // instruction -> temps
+  for (const Occurrence& occurrence : occurrences)
+    if (occurrence.temp >= 0)
+      saves[occurrence.chain + occurrence.length].push_back(occurrence.temp);
+  vector<int> index(n + 1, 0);
+  vector<VMInstr> rewritten;
+  for (int i = 0; i < n; ++i)
+  {
+    index[i] = rewritten.size();
+    if (reuses.contains(i))
+    {
+      auto [length, occurrence] = reuses[i];
+      rewritten.push_back(VMInstr::LOAD(occurrences[occurrence].temp));
+      for (int j = 1; j <= length; ++j)
+        index[i + j] = rewritten.size();
+      i += length;
+    }
+    else
+      rewritten.push_back(code[i]);
+    for (int temp : saves[i])
+    {
+      rewritten.push_back(VMInstr::DUP());
+      rewritten.push_back(VMInstr::STORE(temp));
+    }
+  }
+  index[n] = rewritten.size();
+  for (VMInstr& instr : rewritten)
+    if (is_jump(instr))
+      instr.set_operand(index[int_operand(instr)]);
+  code = rewritten;
+  return reuses.size();
+}
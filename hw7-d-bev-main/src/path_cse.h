@@ -0,0 +1,26 @@
+//----------------------------------------------------------------------
+// FILE: path_cse.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Reuse of repeated struct path loads in generated VM instructions
+//----------------------------------------------------------------------
+
+#ifndef PATH_CSE_H
+#define PATH_CSE_H
+
+#include "vm_frame.h"
+
+
+// Common subexpression elimination of path loads (a LOAD followed by
+// GETFs, e.g., root.left.value). A path (or its longest prefix) that
+// was already loaded, earlier in the basic block or by the same load
+// on every path to the block (not counting loops), is taken from a new
+// local that the first load also stored its value in (with DUP, STORE),
+// as long as nothing in between could have changed it: a STORE of the
+// path's variable, a SETF of one of its fields (the same slot or name,
+// or any field when either is given by name), or a CALL. Returns the
+// number of loads reused (frames with non-int jump operands are left
+// unchanged).
+int reuse_path_loads(VMFrameInfo& frame);
+
+#endif
@@ -0,0 +1,226 @@
+//----------------------------------------------------------------------
+// FILE: peephole.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Peephole clean up of generated VM instructions
+//----------------------------------------------------------------------
+
+#include "peephole.h"
+
+using namespace std;
+
+
+namespace {
+
+  bool is_jump(const VMInstr& instr)
+  {
+    return instr.opcode() == OpCode::JMP or instr.opcode() == OpCode::JMPF;
+  }
+
+  int target(const VMInstr& instr)
+  {
+    return get<int>(instr.operand().value());
+  }
+
+  // retarget each jump past NOPs and through JMPs, returning the number
+  // of instructions changed
+  int thread_jumps(vector<VMInstr>& code)
+  {
+    int n = code.size();
+    int changes = 0;
+    for (VMInstr& instr : code)
+    {
+      if (!is_jump(instr))
+        continue;
+      int t = target(instr);
+      // (bounded, in case of a jump cycle)
+      for (int steps = 0; t < n and steps < n; ++steps)
+      {
+        if (code[t].opcode() == OpCode::NOP)
+          ++t;
+        else if (code[t].opcode() == OpCode::JMP)
+          t = target(code[t]);
+        else
+          break;
+      }
+      if (t != target(instr))
+      {
+        instr.set_operand(t);
+        ++changes;
+      }
+      if (instr.opcode() == OpCode::JMP and t < n and
+          code[t].opcode() == OpCode::RET)
+      {
+        instr = code[t];
+        ++changes;
+      }
+    }
+    return changes;
+  }
+
+  // a short circuit test (DUP, [NOT], JMPF, POP) whose result, when it
+  // jumps, is only tested by another JMPF jumps straight to where that
+  // JMPF goes (with its DUP and POP becoming NOPs), returning the
+  // number of tests changed
+  int thread_conditions(vector<VMInstr>& code)
+  {
+    int n = code.size();
+    vector<bool> is_target(n + 1, false);
+    for (const VMInstr& instr : code)
+      if (is_jump(instr))
+        is_target[target(instr)] = true;
+    int changes = 0;
+    for (int i = 0; i < n; ++i)
+    {
+      if (code[i].opcode() != OpCode::DUP)
+        continue;
+      bool negated = i + 1 < n and code[i + 1].opcode() == OpCode::NOT;
+      int j = i + 1 + (negated ? 1 : 0);
+      if (j + 1 >= n or code[j].opcode() != OpCode::JMPF or
+          code[j + 1].opcode() != OpCode::POP)
+        continue;
+      if (is_target[i + 1] or is_target[j] or is_target[j + 1])
+        continue;
+      int t = target(code[j]);
+      if (t >= n or code[t].opcode() != OpCode::JMPF or t == j)
+        continue;
+      // (a negated test jumps when true, and so passes the JMPF)
+      code[j].set_operand(negated ? t + 1 : target(code[t]));
+      code[i] = VMInstr::NOP();
+      code[j + 1] = VMInstr::NOP();
+      ++changes;
+    }
+    return changes;
+  }
+
+  // a JMPF of a pushed bool constant either always jumps (becoming a
+  // JMP) or never does (and both are removed), returning the number of
+  // branches changed
+  int fold_branches(vector<VMInstr>& code)
+  {
+    int n = code.size();
+    vector<bool> is_target(n + 1, false);
+    for (const VMInstr& instr : code)
+      if (is_jump(instr))
+        is_target[target(instr)] = true;
+    int changes = 0;
+    for (int i = 0; i + 1 < n; ++i)
+    {
+      if (code[i].opcode() != OpCode::PUSH or
+          code[i + 1].opcode() != OpCode::JMPF or is_target[i + 1])
+        continue;
+      optional<VMValue> value = code[i].operand();
+      if (!value.has_value() or !holds_alternative<bool>(value.value()))
+        continue;
+      if (get<bool>(value.value()))
+        code[i + 1] = VMInstr::NOP();
+      else
+        code[i + 1] = VMInstr::JMP(target(code[i + 1]));
+      code[i] = VMInstr::NOP();
+      ++changes;
+    }
+    return changes;
+  }
+
+  // the instructions reachable from the first one
+  vector<bool> reachable(const vector<VMInstr>& code)
+  {
+    int n = code.size();
+    vector<bool> seen(n, false);
+    vector<int> todo {0};
+    while (!todo.empty())
+    {
+      int i = todo.back();
+      todo.pop_back();
+      if (i >= n or seen[i])
+        continue;
+      seen[i] = true;
+      OpCode op = code[i].opcode();
+      if (is_jump(code[i]))
+        todo.push_back(target(code[i]));
+      if (op != OpCode::JMP and op != OpCode::RET and op != OpCode::TAILCALL)
+        todo.push_back(i + 1);
+    }
+    return seen;
+  }
+
+  // remove unreachable instructions, NOPs, and jumps to the next kept
+  // instruction (a JMPF becomes a POP), returning the number of
+  // instructions removed or changed
+  int remove_dead(vector<VMInstr>& code)
+  {
+    int n = code.size();
+    int changes = 0;
+    vector<bool> keep = reachable(code);
+    for (int i = 0; i < n; ++i)
+      if (code[i].opcode() == OpCode::NOP)
+        keep[i] = false;
+    // (from the back, so a removed jump can make an earlier one redundant)
+    for (int i = n - 1; i >= 0; --i)
+    {
+      if (!keep[i] or !is_jump(code[i]) or target(code[i]) <= i)
+        continue;
+      int next = i + 1;
+      while (next < n and !keep[next])
+        ++next;
+      if (target(code[i]) > next)
+        continue;
+      if (code[i].opcode() == OpCode::JMP)
+        keep[i] = false;
+      else
+      {
+        code[i] = VMInstr::POP();
+        ++changes;
+      }
+    }
+
+    // the new index of each instruction (or of the next kept one)
+    vector<int> index(n + 1, 0);
+    for (int i = 0; i < n; ++i)
+      index[i + 1] = index[i] + (keep[i] ? 1 : 0);
+    if (index[n] == n)
+      return changes;
+    vector<VMInstr> kept;
+    kept.reserve(index[n]);
+    for (int i = 0; i < n; ++i)
+    {
+      if (!keep[i])
+        continue;
+      if (is_jump(code[i]))
+        code[i].set_operand(index[target(code[i])]);
+      kept.push_back(code[i]);
+    }
+    changes += n - index[n];
+    code = kept;
+    return changes;
+  }
+
+}
+
+
+int peephole(VMFrameInfo& frame)
+{
+  vector<VMInstr>& code = frame.instructions;
+  for (const VMInstr& instr : code)
+  {
+    if (!is_jump(instr))
+      continue;
+    optional<VMValue> operand = instr.operand();
+    if (!operand.has_value() or !holds_alternative<int>(operand.value()))
+      return 0;
+    int t = get<int>(operand.value());
+    if (t < 0 or t > code.size())
+      return 0;
+  }
+  int total = 0;
+  int changes = 1;
+  while (changes > 0)
+  {
+    changes = thread_jumps(code);
+    changes += fold_branches(code);
+    changes += thread_conditions(code);
+    changes += remove_dead(code);
+    total += changes;
+  }
+  return total;
+}
@@ -0,0 +1,24 @@
+//----------------------------------------------------------------------
+// FILE: peephole.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Peephole clean up of generated VM instructions
+//----------------------------------------------------------------------
+
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "vm_frame.h"
+
+
+// Removes the jump scaffolding the code generator leaves behind: jumps
+// are threaded through NOPs and other jumps (and a jump to a RET
+// becomes the RET), branches on constants become jumps (or nothing),
+// short circuit tests of and/or operands that feed a branch jump
+// directly, unreachable instructions, NOPs, and jumps to the
+// next instruction are removed, and the remaining instructions are
+// renumbered. Returns the number of instructions changed or removed
+// (frames with non-int jump operands are left unchanged).
+int peephole(VMFrameInfo& frame);
+
+#endif
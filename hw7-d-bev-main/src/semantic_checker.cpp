@@ -230,7 +230,7 @@ void SemanticChecker::visit(IfStmt &s)
 
   // elseif part
 
-  for (auto i : s.else_ifs)
+  for (auto& i : s.else_ifs)
   {
     
     i.condition.accept(*this);
@@ -280,7 +280,7 @@ void SemanticChecker::visit(AssignStmt &s)
   DataType lhs_type;
   StructDef sd;
 
-  for(auto l : s.lvalue){
+  for(auto& l : s.lvalue){
     if(is_struct)
     {
       if(get_field(sd, l.var_name.lexeme()).has_value())
@@ -364,7 +364,7 @@ void SemanticChecker::visit(CallExpr &e)
     if (e.args.size() != 1)
       error("CallExpr: to_string() takes 1 argument");
 
-    Expr ex = e.args[0];
+    Expr& ex = e.args[0];
     ex.accept(*this);
     if (curr_type.type_name != "int" && curr_type.type_name != "double" && curr_type.type_name != "char")
       error("CallExpr: to_string requires type int, double or char");
@@ -376,7 +376,7 @@ void SemanticChecker::visit(CallExpr &e)
     if (e.args.size() != 1)
       error("CallExpr: to_int() takes 1 argument");
       
-    Expr ex = e.args[0];
+    Expr& ex = e.args[0];
     ex.accept(*this);
     if (curr_type.type_name != "string" && curr_type.type_name != "double")
       error("CallExpr: to_int requires type string or double");
@@ -388,7 +388,7 @@ void SemanticChecker::visit(CallExpr &e)
     if (e.args.size() != 1)
       error("CallExpr: to_double() takes 1 argument");
 
-    Expr ex = e.args[0];
+    Expr& ex = e.args[0];
     ex.accept(*this);
     if (curr_type.type_name != "int" && curr_type.type_name != "string")
       error("CallExpr: to_double requires type int or string");
@@ -407,18 +407,22 @@ void SemanticChecker::visit(CallExpr &e)
 
     if( (!curr_type.is_array) && (curr_type.type_name != "string"))
       error("CallExpr: expecting string in non-array length", e.args[0].first_token());
-    else
-      curr_type = DataType{false, "int"};
+
+    // array lengths are a different instruction than string lengths
+    if (curr_type.is_array)
+      e.fun_name = Token(e.fun_name.type(), "length@array", e.fun_name.line(),
+                         e.fun_name.column());
+    curr_type = DataType{false, "int"};
   }
   else if (fun_name == "get")
   { // 2 params : int (index), string
     if (e.args.size() != 2)
       error("CallExpr: get expects two arguments", e.fun_name);
 
-    Expr e1 = e.args[0];
+    Expr& e1 = e.args[0];
     e1.accept(*this);
     DataType firstArgType = curr_type;
-    Expr e2 = e.args[1];
+    Expr& e2 = e.args[1];
     e2.accept(*this);
     DataType secondArgType = curr_type;
 
@@ -435,10 +439,10 @@ void SemanticChecker::visit(CallExpr &e)
     if (e.args.size() != 2)
       error("CallExpr: concat() takes 2 arguments");
       
-    Expr str1 = e.args[0];
+    Expr& str1 = e.args[0];
     str1.accept(*this);
     DataType firstArgType = curr_type;
-    Expr str2 = e.args[1];
+    Expr& str2 = e.args[1];
     str2.accept(*this);
     DataType secondArgType = curr_type;
 
@@ -594,6 +598,11 @@ void SemanticChecker::visit(Expr &e)
 
       curr_type = DataType{false, "bool"};
     }
+
+    // record the operand type (if known) for typed instructions
+    if (firstType.type_name == restType.type_name and
+        firstType.is_array == restType.is_array and firstType.type_name != "void")
+      e.op_type = firstType;
   }
 }
 
@@ -633,7 +642,7 @@ void SemanticChecker::visit(VarRValue &v)
     error("VarRValue: path does not exist?");
 
   
-  for(auto l : v.path){
+  for(auto& l : v.path){
     if(is_struct){
       if(get_field(sd, l.var_name.lexeme()).has_value())
       {
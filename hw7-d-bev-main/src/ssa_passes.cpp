@@ -0,0 +1,652 @@
+//----------------------------------------------------------------------
+// FILE: ssa_passes.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Optimization passes over the SSA form of generated VM code
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include "ssa_passes.h"
+
+using namespace std;
+
+
+namespace {
+
+  int int_operand(const VMInstr& instr)
+  {
+    return get<int>(instr.operand().value());
+  }
+
+  // instructions whose value only depends on the values they pop (they
+  // don't read the heap, the input, or have effects), although they may
+  // fail for some values
+  bool is_pure(OpCode op)
+  {
+    switch (op) {
+    case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+    case OpCode::AND: case OpCode::OR: case OpCode::NOT:
+    case OpCode::CMPLT: case OpCode::CMPLE: case OpCode::CMPGT: case OpCode::CMPGE:
+    case OpCode::CMPEQ: case OpCode::CMPNE:
+    case OpCode::ADDI: case OpCode::SUBI: case OpCode::MULI: case OpCode::DIVI:
+    case OpCode::ADDD: case OpCode::SUBD: case OpCode::MULD: case OpCode::DIVD:
+    case OpCode::CMPLTI: case OpCode::CMPLEI: case OpCode::CMPGTI: case OpCode::CMPGEI:
+    case OpCode::CMPLTD: case OpCode::CMPLED: case OpCode::CMPGTD: case OpCode::CMPGED:
+    case OpCode::CMPLTS: case OpCode::CMPLES: case OpCode::CMPGTS: case OpCode::CMPGES:
+    case OpCode::CMPEQI: case OpCode::CMPNEI: case OpCode::CMPEQS: case OpCode::CMPNES:
+    case OpCode::SLEN: case OpCode::ALEN: case OpCode::GETC: case OpCode::TOINT:
+    case OpCode::TODBL: case OpCode::TOSTR: case OpCode::CONCAT:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // instructions that only push values and can't fail (so removing them
+  // when their values aren't used changes nothing)
+  bool cannot_fail(OpCode op)
+  {
+    switch (op) {
+    case OpCode::PUSH: case OpCode::LOAD: case OpCode::DUP:
+    case OpCode::CMPEQ: case OpCode::CMPNE: case OpCode::CMPEQI: case OpCode::CMPNEI:
+    case OpCode::CMPEQS: case OpCode::CMPNES: case OpCode::ALLOCS: case OpCode::ALLOCR:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  bool commutes(OpCode op)
+  {
+    switch (op) {
+    case OpCode::ADDI: case OpCode::MULI: case OpCode::ADDD: case OpCode::MULD:
+    case OpCode::AND: case OpCode::OR: case OpCode::CMPEQ: case OpCode::CMPNE:
+    case OpCode::CMPEQI: case OpCode::CMPNEI: case OpCode::CMPEQS: case OpCode::CMPNES:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  //--------------------------------------------------------------------
+  // constant folding (as the VM computes the values)
+  //--------------------------------------------------------------------
+
+  template<typename T>
+  bool both(const vector<VMValue>& args)
+  {
+    return args.size() == 2 and holds_alternative<T>(args[0]) and
+      holds_alternative<T>(args[1]);
+  }
+
+  template<typename T>
+  optional<VMValue> compare(OpCode op, const T& y, const T& x)
+  {
+    switch (op) {
+    case OpCode::CMPLTI: case OpCode::CMPLTD: case OpCode::CMPLTS:
+      return y < x;
+    case OpCode::CMPLEI: case OpCode::CMPLED: case OpCode::CMPLES:
+      return y <= x;
+    case OpCode::CMPGTI: case OpCode::CMPGTD: case OpCode::CMPGTS:
+      return y > x;
+    case OpCode::CMPGEI: case OpCode::CMPGED: case OpCode::CMPGES:
+      return y >= x;
+    default:
+      return nullopt;
+    }
+  }
+
+  // the typed instruction an untyped one computes as for operands of
+  // the same type (or the instruction itself)
+  OpCode typed(OpCode op, const vector<VMValue>& args)
+  {
+    bool ints = both<int>(args);
+    bool doubles = both<double>(args);
+    bool strings = both<string>(args);
+    auto pick = [&](OpCode i, OpCode d, OpCode s) {
+      return ints ? i : doubles ? d : strings ? s : op;
+    };
+    switch (op) {
+    case OpCode::ADD: return pick(OpCode::ADDI, OpCode::ADDD, op);
+    case OpCode::SUB: return pick(OpCode::SUBI, OpCode::SUBD, op);
+    case OpCode::MUL: return pick(OpCode::MULI, OpCode::MULD, op);
+    case OpCode::DIV: return pick(OpCode::DIVI, OpCode::DIVD, op);
+    case OpCode::CMPLT: return pick(OpCode::CMPLTI, OpCode::CMPLTD, OpCode::CMPLTS);
+    case OpCode::CMPLE: return pick(OpCode::CMPLEI, OpCode::CMPLED, OpCode::CMPLES);
+    case OpCode::CMPGT: return pick(OpCode::CMPGTI, OpCode::CMPGTD, OpCode::CMPGTS);
+    case OpCode::CMPGE: return pick(OpCode::CMPGEI, OpCode::CMPGED, OpCode::CMPGES);
+    default: return op;
+    }
+  }
+
+  // the value the instruction computes from the (constant) values it
+  // pops, if it is known not to fail
+  optional<VMValue> fold(OpCode op, const vector<VMValue>& args)
+  {
+    op = typed(op, args);
+    switch (op) {
+    case OpCode::ADDI: case OpCode::SUBI: case OpCode::MULI: case OpCode::DIVI:
+    {
+      if (!both<int>(args))
+        return nullopt;
+      int y = get<int>(args[0]);
+      int x = get<int>(args[1]);
+      // (ints wrap around as in the VM)
+      int64_t r;
+      if (op == OpCode::ADDI)
+        r = int64_t(y) + x;
+      else if (op == OpCode::SUBI)
+        r = int64_t(y) - x;
+      else if (op == OpCode::MULI)
+        r = int64_t(y) * x;
+      else if (x == 0 or (y == INT_MIN and x == -1))
+        return nullopt;
+      else
+        r = y / x;
+      return int32_t(uint32_t(r));
+    }
+    case OpCode::ADDD: case OpCode::SUBD: case OpCode::MULD: case OpCode::DIVD:
+    {
+      if (!both<double>(args))
+        return nullopt;
+      double y = get<double>(args[0]);
+      double x = get<double>(args[1]);
+      if (op == OpCode::ADDD)
+        return y + x;
+      if (op == OpCode::SUBD)
+        return y - x;
+      if (op == OpCode::MULD)
+        return y * x;
+      return y / x;
+    }
+    case OpCode::CMPLTI: case OpCode::CMPLEI: case OpCode::CMPGTI: case OpCode::CMPGEI:
+      if (!both<int>(args))
+        return nullopt;
+      return compare(op, get<int>(args[0]), get<int>(args[1]));
+    case OpCode::CMPLTD: case OpCode::CMPLED: case OpCode::CMPGTD: case OpCode::CMPGED:
+      if (!both<double>(args))
+        return nullopt;
+      return compare(op, get<double>(args[0]), get<double>(args[1]));
+    case OpCode::CMPLTS: case OpCode::CMPLES: case OpCode::CMPGTS: case OpCode::CMPGES:
+      if (!both<string>(args))
+        return nullopt;
+      return compare(op, get<string>(args[0]), get<string>(args[1]));
+    case OpCode::CMPEQI: case OpCode::CMPNEI: case OpCode::CMPEQS: case OpCode::CMPNES:
+    {
+      // (only values of the same kind, as the VM compares their words)
+      if (args[0].index() != args[1].index() or holds_alternative<double>(args[0]))
+        return nullopt;
+      if (holds_alternative<string>(args[0]) and
+          (op == OpCode::CMPEQI or op == OpCode::CMPNEI))
+        return nullopt;
+      bool equal = args[0] == args[1];
+      return (op == OpCode::CMPEQI or op == OpCode::CMPEQS) ? equal : !equal;
+    }
+    case OpCode::CMPEQ: case OpCode::CMPNE:
+    {
+      // (a null is only equal to null, and other values of different
+      // types aren't compared)
+      bool nulls = holds_alternative<nullptr_t>(args[0]) or
+        holds_alternative<nullptr_t>(args[1]);
+      if (args[0].index() != args[1].index() and !nulls)
+        return nullopt;
+      bool equal = args[0] == args[1];
+      return op == OpCode::CMPEQ ? equal : !equal;
+    }
+    case OpCode::AND: case OpCode::OR:
+      if (!both<bool>(args))
+        return nullopt;
+      if (op == OpCode::AND)
+        return get<bool>(args[0]) and get<bool>(args[1]);
+      return get<bool>(args[0]) or get<bool>(args[1]);
+    case OpCode::NOT:
+      if (!holds_alternative<bool>(args[0]))
+        return nullopt;
+      return !get<bool>(args[0]);
+    case OpCode::CONCAT:
+      if (!both<string>(args))
+        return nullopt;
+      return get<string>(args[0]) + get<string>(args[1]);
+    case OpCode::SLEN:
+      if (!holds_alternative<string>(args[0]))
+        return nullopt;
+      return int(get<string>(args[0]).size());
+    default:
+      return nullopt;
+    }
+  }
+
+  // what is known about a value: nothing yet (until an instruction
+  // computing it is reachable), that it is a constant, or that it varies
+  class Lattice
+  {
+  public:
+    enum class Level {UNKNOWN, CONSTANT, VARYING};
+    Level level = Level::UNKNOWN;
+    VMValue value;
+  };
+
+  // lower the first to what is known of both, returning true if it
+  // changed
+  bool meet(Lattice& known, const Lattice& other)
+  {
+    if (other.level == Lattice::Level::UNKNOWN or
+        known.level == Lattice::Level::VARYING)
+      return false;
+    if (known.level == Lattice::Level::UNKNOWN)
+    {
+      known = other;
+      return true;
+    }
+    if (other.level == Lattice::Level::CONSTANT and other.value == known.value)
+      return false;
+    known.level = Lattice::Level::VARYING;
+    return true;
+  }
+
+  // a string identifying the constant (with its exact bits for doubles)
+  string constant_key(const VMValue& value)
+  {
+    string key = to_string(value.index()) + ":";
+    if (holds_alternative<double>(value))
+      return key + to_string(bit_cast<uint64_t>(get<double>(value)));
+    return key + to_string(value);
+  }
+
+}
+
+
+int propagate_constants(VMFrameInfo& frame, const ArgCounts& arg_counts)
+{
+  optional<IRFunction> built = IRFunction::build(frame, arg_counts);
+  if (!built.has_value())
+    return 0;
+  const IRFunction& ir = built.value();
+  const vector<VMInstr>& code = frame.instructions;
+
+  // what is known of each value, the blocks that may run, and the
+  // (predecessor, block) edges that may be taken
+  vector<Lattice> known(ir.values.size());
+  for (int v = 0; v < ir.values.size(); ++v)
+    if (ir.values[v].kind == IRValue::Kind::ENTRY)
+      known[v].level = Lattice::Level::VARYING;
+  vector<bool> executable(ir.blocks.size(), false);
+  executable[0] = true;
+  set<pair<int,int>> edges;
+
+  // the value an instruction computes from what is known of its operands
+  auto evaluate = [&](int i) {
+    Lattice result;
+    if (code[i].opcode() == OpCode::PUSH)
+    {
+      result.level = Lattice::Level::CONSTANT;
+      result.value = code[i].operand().value();
+      return result;
+    }
+    vector<VMValue> args;
+    bool unknown = false;
+    for (int operand : ir.operands[i])
+    {
+      if (known[operand].level == Lattice::Level::VARYING)
+      {
+        result.level = Lattice::Level::VARYING;
+        return result;
+      }
+      unknown = unknown or known[operand].level == Lattice::Level::UNKNOWN;
+      args.push_back(known[operand].value);
+    }
+    if (unknown)
+      return result;
+    optional<VMValue> value = fold(code[i].opcode(), args);
+    result.level = value.has_value() ? Lattice::Level::CONSTANT : Lattice::Level::VARYING;
+    if (value.has_value())
+      result.value = value.value();
+    return result;
+  };
+
+  // (each round only lowers what is known, so this ends)
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (int b : ir.order)
+    {
+      if (!executable[b])
+        continue;
+      const IRBlock& block = ir.blocks[b];
+      for (int phi : block.phis)
+      {
+        Lattice merged;
+        const vector<int>& args = ir.values[phi].args;
+        for (int k = 0; k < args.size(); ++k)
+          if (k >= block.preds.size() or edges.contains({block.preds[k], b}))
+            meet(merged, known[args[k]]);
+        changed = meet(known[phi], merged) or changed;
+      }
+      for (int i = block.start; i < block.end; ++i)
+      {
+        int v = ir.results[i];
+        if (v >= 0 and ir.values[v].kind == IRValue::Kind::INSTR and ir.values[v].def == i)
+          changed = meet(known[v], evaluate(i)) or changed;
+      }
+      // the successors the block may go to (a branch on a constant only
+      // goes one way, and one on an unknown value nowhere yet)
+      vector<int> succs = block.succs;
+      if (block.start < block.end and code[block.end - 1].opcode() == OpCode::JMPF)
+      {
+        const Lattice& test = known[ir.operands[block.end - 1][0]];
+        if (test.level == Lattice::Level::UNKNOWN)
+          succs.clear();
+        else if (test.level == Lattice::Level::CONSTANT and holds_alternative<bool>(test.value))
+          succs = {block.succs[get<bool>(test.value) ? 0 : 1]};
+      }
+      for (int s : succs)
+        if (edges.insert({b, s}).second)
+        {
+          executable[s] = true;
+          changed = true;
+        }
+    }
+  }
+
+  // replace constant expressions by their values and constant branches
+  // by jumps (from the end of each block, so the outermost expression
+  // is replaced as a whole)
+  int first = frame.arg_count;
+  vector<bool> replaced(code.size(), false);
+  auto constant = [&](int v) {
+    return v >= 0 and known[v].level == Lattice::Level::CONSTANT;
+  };
+  auto all_constant = [&](int start, int end) {
+    for (int j = start; j <= end; ++j)
+      if (replaced[j] or ir.push_counts[j] == 0 or !constant(ir.results[j]))
+        return false;
+    return true;
+  };
+  map<int,vector<VMInstr>> edits;
+  int changes = 0;
+  for (int b : ir.order)
+  {
+    if (!executable[b])
+      continue;
+    for (int i = ir.blocks[b].end - 1; i >= ir.blocks[b].start and i >= first; --i)
+    {
+      OpCode op = code[i].opcode();
+      if (op == OpCode::JMPF)
+      {
+        const Lattice& test = known[ir.operands[i][0]];
+        if (!constant(ir.operands[i][0]) or !holds_alternative<bool>(test.value))
+          continue;
+        vector<VMInstr> branch;
+        if (!get<bool>(test.value))
+          branch.push_back(VMInstr::JMP(int_operand(code[i])));
+        int start = ir.expression_start(i);
+        if (start >= first and start < i and all_constant(start, i - 1))
+          for (int j = start; j < i; ++j)
+          {
+            edits[j] = {};
+            replaced[j] = true;
+          }
+        else
+          branch.insert(branch.begin(), VMInstr::POP());
+        edits[i] = branch;
+        replaced[i] = true;
+        ++changes;
+      }
+      else if (op != OpCode::PUSH and ir.push_counts[i] == 1 and !replaced[i] and
+               constant(ir.results[i]))
+      {
+        int start = ir.expression_start(i);
+        if (start < first or !all_constant(start, i))
+          continue;
+        edits[start] = {VMInstr::PUSH(known[ir.results[i]].value)};
+        replaced[start] = true;
+        for (int j = start + 1; j <= i; ++j)
+        {
+          edits[j] = {};
+          replaced[j] = true;
+        }
+        ++changes;
+      }
+    }
+  }
+  rewrite(frame, edits);
+  return changes;
+}
+
+
+int number_values(VMFrameInfo& frame, const ArgCounts& arg_counts)
+{
+  optional<IRFunction> built = IRFunction::build(frame, arg_counts);
+  if (!built.has_value())
+    return 0;
+  const IRFunction& ir = built.value();
+  const vector<VMInstr>& code = frame.instructions;
+
+  // number the values down the dominator tree: a pure instruction of
+  // the same numbered values as one in a dominating block gets its
+  // number (and is redundant)
+  vector<int> number(ir.values.size());
+  for (int v = 0; v < number.size(); ++v)
+    number[v] = v;
+  unordered_map<string,int> available;     // key -> instruction
+  vector<pair<int,int>> redundant;         // (instruction, earlier one)
+  auto visit = [&](auto& self, int b) -> void {
+    vector<string> added;
+    for (int i = ir.blocks[b].start; i < ir.blocks[b].end; ++i)
+    {
+      int v = ir.results[i];
+      OpCode op = code[i].opcode();
+      if (v < 0 or ir.values[v].kind != IRValue::Kind::INSTR or ir.values[v].def != i)
+        continue;
+      if (op != OpCode::PUSH and !is_pure(op))
+        continue;
+      string key = to_string(int(op));
+      if (op == OpCode::PUSH)
+        key += ":" + constant_key(code[i].operand().value());
+      else
+      {
+        vector<int> numbers;
+        for (int operand : ir.operands[i])
+          numbers.push_back(number[operand]);
+        if (commutes(op))
+          sort(numbers.begin(), numbers.end());
+        for (int n : numbers)
+          key += ":" + to_string(n);
+      }
+      auto entry = available.find(key);
+      if (entry == available.end())
+      {
+        available[key] = i;
+        added.push_back(key);
+        continue;
+      }
+      number[v] = number[ir.results[entry->second]];
+      if (op != OpCode::PUSH)
+        redundant.push_back({i, entry->second});
+    }
+    for (int child : ir.blocks[b].children)
+      self(self, child);
+    for (const string& key : added)
+      available.erase(key);
+  };
+  visit(visit, 0);
+
+  // replace the redundant expressions (longest first, and not those
+  // overlapping another or the expression they reuse) by a load of
+  // the earlier value, which is saved in a new local
+  class Reuse
+  {
+  public:
+    int start;
+    int instr;
+    int earlier;
+  };
+  int first = frame.arg_count;
+  vector<Reuse> reuses;
+  for (auto [i, earlier] : redundant)
+  {
+    int start = ir.expression_start(i);
+    if (start < first or start == i)
+      continue;
+    bool pure = true;
+    for (int j = start; j <= i; ++j)
+    {
+      OpCode op = code[j].opcode();
+      if (!is_pure(op) and op != OpCode::PUSH and op != OpCode::LOAD and op != OpCode::DUP)
+        pure = false;
+    }
+    if (pure)
+      reuses.push_back({start, i, earlier});
+  }
+  stable_sort(reuses.begin(), reuses.end(), [](const Reuse& a, const Reuse& b) {
+    return a.instr - a.start > b.instr - b.start;
+  });
+  vector<bool> removed(code.size(), false);
+  unordered_map<int,int> temps;            // earlier instruction -> local
+  int next_local = ir.local_count;
+  map<int,vector<VMInstr>> edits;
+  int changes = 0;
+  for (const Reuse& reuse : reuses)
+  {
+    // (a two instruction expression is only worth a load when the
+    // earlier value is already saved)
+    if (removed[reuse.earlier] or
+        (reuse.instr - reuse.start < 2 and !temps.contains(reuse.earlier)))
+      continue;
+    bool overlaps = false;
+    for (int j = reuse.start; j <= reuse.instr; ++j)
+      if (removed[j] or temps.contains(j))
+        overlaps = true;
+    if (overlaps)
+      continue;
+    if (!temps.contains(reuse.earlier))
+    {
+      // (an earlier value that is popped is stored instead)
+      int temp = next_local++;
+      temps[reuse.earlier] = temp;
+      VMInstr store = VMInstr::STORE(temp);
+      store.set_comment("saved for reuse");
+      int next = reuse.earlier + 1;
+      if (next < code.size() and code[next].opcode() == OpCode::POP and
+          ir.block_of[next] == ir.block_of[reuse.earlier])
+        edits[next] = {store};
+      else
+        edits[reuse.earlier] = {code[reuse.earlier], VMInstr::DUP(), store};
+    }
+    edits[reuse.start] = {VMInstr::LOAD(temps[reuse.earlier])};
+    for (int j = reuse.start; j <= reuse.instr; ++j)
+    {
+      removed[j] = true;
+      if (j > reuse.start)
+        edits[j] = {};
+    }
+    ++changes;
+  }
+  rewrite(frame, edits);
+  return changes;
+}
+
+
+int eliminate_dead_stores(VMFrameInfo& frame, const ArgCounts& arg_counts)
+{
+  // (removing an expression can make the stores of the locals it loads
+  // dead, so repeat until nothing changes)
+  int changes = 0;
+  while (true)
+  {
+    optional<IRFunction> built = IRFunction::build(frame, arg_counts);
+    if (!built.has_value())
+      return changes;
+    const IRFunction& ir = built.value();
+    const vector<VMInstr>& code = frame.instructions;
+    int locals = ir.local_count;
+
+    // the locals live at the start of each block (loaded before they are
+    // stored), from the last block back
+    vector<vector<bool>> live_in(ir.blocks.size(), vector<bool>(locals, false));
+    auto live_out = [&](int b) {
+      vector<bool> live(locals, false);
+      for (int s : ir.blocks[b].succs)
+        for (int k = 0; k < locals; ++k)
+          live[k] = live[k] or live_in[s][k];
+      return live;
+    };
+    auto step = [&](vector<bool>& live, int i) {
+      OpCode op = code[i].opcode();
+      if (op == OpCode::STORE)
+        live[int_operand(code[i])] = false;
+      else if (op == OpCode::LOAD)
+        live[int_operand(code[i])] = true;
+    };
+    bool changed = true;
+    while (changed)
+    {
+      changed = false;
+      for (auto b = ir.order.rbegin(); b != ir.order.rend(); ++b)
+      {
+        vector<bool> live = live_out(*b);
+        for (int i = ir.blocks[*b].end - 1; i >= ir.blocks[*b].start; --i)
+          step(live, i);
+        if (live != live_in[*b])
+        {
+          live_in[*b] = live;
+          changed = true;
+        }
+      }
+    }
+
+    // remove the dead stores and popped expressions that can't fail
+    int first = frame.arg_count;
+    map<int,vector<VMInstr>> edits;
+    auto remove_expression = [&](int i) {
+      int start = ir.expression_start(i);
+      if (start < first or start == i)
+        return false;
+      for (int j = start; j < i; ++j)
+        if (!cannot_fail(code[j].opcode()))
+          return false;
+      for (int j = start; j <= i; ++j)
+        edits[j] = {};
+      return true;
+    };
+    for (int b : ir.order)
+    {
+      vector<bool> live = live_out(b);
+      for (int i = ir.blocks[b].end - 1; i >= ir.blocks[b].start and i >= first; --i)
+      {
+        OpCode op = code[i].opcode();
+        bool dead = false;
+        if (op == OpCode::STORE and !live[int_operand(code[i])])
+        {
+          dead = true;
+          if (!remove_expression(i))
+            edits[i] = {VMInstr::POP()};
+        }
+        else if (op == OpCode::POP)
+        {
+          dead = remove_expression(i);
+          // (a value saved in a local that is never loaded)
+          if (!dead and i - 1 >= max(first, ir.blocks[b].start) and
+              code[i - 1].opcode() == OpCode::DUP)
+          {
+            dead = true;
+            edits[i - 1] = {};
+            edits[i] = {};
+          }
+        }
+        if (dead)
+          ++changes;
+        step(live, i);
+      }
+    }
+    if (edits.empty())
+      return changes;
+    rewrite(frame, edits);
+  }
+}
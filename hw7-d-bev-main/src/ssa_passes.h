@@ -0,0 +1,42 @@
+//----------------------------------------------------------------------
+// FILE: ssa_passes.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Optimization passes over the SSA form of generated VM code
+//----------------------------------------------------------------------
+
+#ifndef SSA_PASSES_H
+#define SSA_PASSES_H
+
+#include "ir.h"
+
+
+// Each pass builds the frame's SSA form (see IRFunction), changes the
+// instructions, and returns the number of changes it made. Frames the
+// SSA form can't be built for, and a function's argument STOREs (that
+// calls may skip), are left unchanged.
+
+
+// Sparse conditional constant propagation: values are constant until
+// shown otherwise, and blocks unreachable until a branch that may go to
+// them is, so constants flow through locals, loops, and the branches
+// they decide. An expression with a constant value becomes a PUSH of
+// it, and a branch on a constant becomes a JMP (or nothing). Only
+// computations that can't fail are folded (not a division by zero).
+int propagate_constants(VMFrameInfo& frame, const ArgCounts& arg_counts);
+
+// Global value numbering: an expression computing the same value as an
+// expression in a dominating block (the same instructions of the same
+// values, for instructions that don't read the heap or have effects)
+// loads the value from a new local instead, that the earlier expression
+// stores its value in (with DUP, STORE).
+int number_values(VMFrameInfo& frame, const ArgCounts& arg_counts);
+
+// Dead store elimination: a STORE to a local that isn't loaded again
+// before its next STORE (or a RET) is removed along with the expression
+// computing its value, if that expression can't fail (otherwise the
+// value is popped instead), as are popped expressions that can't fail.
+int eliminate_dead_stores(VMFrameInfo& frame, const ArgCounts& arg_counts);
+
+
+#endif
@@ -12,6 +12,48 @@
 
 using namespace std;
 
+//----------------------------------------------------------------------
+// Instruction dispatch
+//
+// VM::run decodes each instruction exactly once per execution. The
+// default engine is a dense switch over OpCode (compiled to a jump
+// table). Building with MYPL_THREADED_DISPATCH instead uses a GCC/Clang
+// computed-goto table, where each handler ends in its own indirect
+// jump to the next handler.
+//----------------------------------------------------------------------
+
+// fetch the next instruction of the current frame (or stop the VM)
+#define VM_FETCH()                                                  \
+  do {                                                              \
+    if (call_depth == 0 or                                          \
+        frame->pc >= frame->info->code.size())                      \
+      return;                                                       \
+    instr = &frame->info->code[frame->pc];                          \
+    ++frame->pc;                                                    \
+    if (observe) {                                                  \
+      ++dispatches[static_cast<int>(instr->opcode)];                \
+      if (DEBUG)                                                    \
+        trace(*frame);                                              \
+    }                                                               \
+  } while (false)
+
+#ifdef MYPL_THREADED_DISPATCH
+#define VM_LABEL(op) dispatch_table[static_cast<int>(OpCode::op)] = &&L_##op
+#define VM_DISPATCH() goto *dispatch_table[static_cast<int>(instr->opcode)];
+#define VM_CASE(op) L_##op
+#define VM_DEFAULT L_UNKNOWN
+#define VM_NEXT                                                     \
+  do {                                                              \
+    VM_FETCH();                                                     \
+    goto *dispatch_table[static_cast<int>(instr->opcode)];          \
+  } while (false)
+#else
+#define VM_DISPATCH() switch (instr->opcode)
+#define VM_CASE(op) case OpCode::op
+#define VM_DEFAULT default
+#define VM_NEXT continue
+#endif
+
 void VM::error(string msg) const
 {
   throw MyPLException::VMError(msg);
@@ -20,10 +62,9 @@ void VM::error(string msg) const
 void VM::error(string msg, const VMFrame &frame) const
 {
   int pc = frame.pc - 1;
-  VMInstr instr = frame.info.instructions[pc];
-  string name = frame.info.function_name;
+  string name = frame.info->function_name;
   msg += " (in " + name + " at " + to_string(pc) + ": " +
-         to_string(instr) + ")";
+         listing(*frame.info, pc) + ")";
   throw MyPLException::VMError(msg);
 }
 
@@ -35,18 +76,617 @@ string to_string(const VM &vm)
     const string &name = entry.first;
     s += "\nFrame '" + name + "'\n";
     const VMFrameInfo &frame = entry.second;
-    for (int i = 0; i < frame.instructions.size(); ++i)
+    for (int i = 0; i < frame.code.size(); ++i)
+      s += "  " + to_string(i) + ": " + vm.listing(frame, i) + "\n";
+  }
+  return s;
+}
+
+void VM::add(const VMFrameInfo &frame)
+{
+  VMFrameInfo &info = frame_info[frame.function_name];
+  info = frame;
+  encode(info);
+  linked = false;
+}
+
+void VM::add_struct(const string &name, const vector<string> &fields)
+{
+  // the same layout as adding each field (in order) to a new object
+  VMStructLayout *layout = &struct_layouts.front();
+  for (const string &field : fields)
+    layout = next_layout(layout, field);
+  struct_ids[name] = struct_types.size();
+  struct_types.push_back(layout);
+}
+
+void VM::link()
+{
+  // number each function (the index is what encoded CALLs refer to)
+  functions.clear();
+  unordered_map<string, int> function_index;
+  for (auto &entry : frame_info)
+  {
+    function_index[entry.first] = functions.size();
+    functions.push_back(&entry.second);
+  }
+  // resolve each call by the name encode recorded for it
+  for (VMFrameInfo *info : functions)
+  {
+    for (const auto &[i, fun_name] : info->calls)
+    {
+      if (!function_index.contains(fun_name))
+        error("undefined function '" + fun_name + "' (in " +
+              info->function_name + " at " + to_string(i) + ": " +
+              listing(*info, i) + ")");
+      info->code[i].operand = function_index[fun_name];
+    }
+  }
+  linked = true;
+}
+
+int VM::add_constant(const VMValue &value)
+{
+  // intern strings: every use of a literal shares one pooled payload
+  if (holds_alternative<string>(value))
+  {
+    const string &str = get<string>(value);
+    if (!string_constants.contains(str))
+    {
+      string_constants[str] = constants.size();
+      constants.push_back(VMBox(value));
+    }
+    return string_constants[str];
+  }
+  constants.push_back(VMBox(value));
+  return constants.size() - 1;
+}
+
+void VM::encode(VMFrameInfo &frame)
+{
+  frame.code.clear();
+  frame.code.reserve(frame.instructions.size());
+  frame.comments.clear();
+  frame.calls.clear();
+  for (const VMInstr &instr : frame.instructions)
+  {
+    if (instr.comment() != "")
+      frame.comments[frame.code.size()] = instr.comment();
+    VMCode code{instr.opcode()};
+    optional<VMValue> operand = instr.operand();
+    switch (instr.opcode())
+    {
+    case OpCode::PUSH:
+      code.operand = add_constant(operand.value());
+      break;
+    case OpCode::LOAD:
+    case OpCode::STORE:
+    case OpCode::JMP:
+    case OpCode::JMPF:
+      if (!operand.has_value() or !holds_alternative<int>(operand.value()))
+        error(to_string(instr) + ": operand must be of type int");
+      code.operand = get<int>(operand.value());
+      break;
+    case OpCode::CALL:
+    case OpCode::TAILCALL:
+      // resolved to a function index by link()
+      if (!operand.has_value() or !holds_alternative<string>(operand.value()))
+        error(to_string(instr) + ": operand must be of type string");
+      frame.calls[frame.code.size()] = get<string>(operand.value());
+      break;
+    case OpCode::ALLOCS:
+    case OpCode::ALLOCR:
+      // the struct type (if given) is replaced by its type id
+      code.operand = -1;
+      if (operand.has_value())
+      {
+        const string *type = get_if<string>(&operand.value());
+        if (!type or !struct_ids.contains(*type))
+          error(to_string(instr) + ": undefined struct type");
+        code.operand = struct_ids[*type];
+      }
+      break;
+    case OpCode::ALLOCA:
+      // the element type (if given) picks an unboxed array kind
+      code.operand = static_cast<int>(VMObjectKind::ARRAY);
+      if (operand.has_value())
+      {
+        const string *type = get_if<string>(&operand.value());
+        if (type and *type == "int")
+          code.operand = static_cast<int>(VMObjectKind::INT_ARRAY);
+        else if (type and *type == "double")
+          code.operand = static_cast<int>(VMObjectKind::DOUBLE_ARRAY);
+        else if (type and *type == "bool")
+          code.operand = static_cast<int>(VMObjectKind::BOOL_ARRAY);
+        else
+          error(to_string(instr) + ": invalid array element type");
+      }
+      break;
+    case OpCode::SETF:
+    case OpCode::GETF:
+      // slot operands (from the code generator) index fields directly
+      if (operand.has_value() and holds_alternative<int>(operand.value()))
+      {
+        code.opcode = instr.opcode() == OpCode::SETF ? OpCode::SETF_SLOT
+                                                     : OpCode::GETF_SLOT;
+        code.operand = get<int>(operand.value());
+        break;
+      }
+      [[fallthrough]];
+    case OpCode::ADDF:
+      if (!operand.has_value() or !holds_alternative<string>(operand.value()))
+        error(to_string(instr) + ": operand must be of type string");
+      code.operand = add_constant(operand.value());
+      break;
+    default:
+      break;
+    }
+    frame.code.push_back(code);
+  }
+
+  // size the frame's locals window (arguments are the first locals)
+  frame.local_count = frame.arg_count;
+  for (const VMCode &code : frame.code)
+    if (code.opcode == OpCode::LOAD or code.opcode == OpCode::STORE)
+      frame.local_count = max(frame.local_count, code.operand + 1);
+
+  // CALL leaves arguments in their local slots, so a standard prologue
+  // (STORE 0, ..., STORE n-1) that nothing jumps back into is skipped
+  int n = 0;
+  while (n < frame.arg_count and n < frame.code.size() and
+         frame.code[n].opcode == OpCode::STORE and frame.code[n].operand == n)
+    ++n;
+  for (const VMCode &code : frame.code)
+    if ((code.opcode == OpCode::JMP or code.opcode == OpCode::JMPF) and
+        code.operand >= 0 and code.operand < n)
+      n = 0;
+  frame.args_in_place = n == frame.arg_count;
+  frame.entry_pc = frame.args_in_place ? n : 0;
+
+  fuse(frame);
+
+  // the code and side tables are all the listing needs (see listing)
+  frame.instructions.clear();
+  frame.instructions.shrink_to_fit();
+}
+
+//----------------------------------------------------------------------
+// Superinstructions
+//
+// The fused sequences were picked from dispatch profiles of the example
+// programs (see fusion_report): loop tests and branches, counter
+// increments, local and constant operand pairs, and printing literals.
+//----------------------------------------------------------------------
+
+namespace {
+
+  struct Fusion
+  {
+    OpCode fused;
+    string name;
+    vector<OpCode> sequence;
+  };
+
+  // longer sequences first, since fuse() takes the first match
+  const vector<Fusion> fusions = {
+    {OpCode::LOAD_PUSH_ADDI_STORE, "LOAD_PUSH_ADDI_STORE",
+     {OpCode::LOAD, OpCode::PUSH, OpCode::ADDI, OpCode::STORE}},
+    {OpCode::LOAD_LOAD, "LOAD_LOAD", {OpCode::LOAD, OpCode::LOAD}},
+    {OpCode::LOAD_PUSH, "LOAD_PUSH", {OpCode::LOAD, OpCode::PUSH}},
+    {OpCode::PUSH_WRITE, "PUSH_WRITE", {OpCode::PUSH, OpCode::WRITE}},
+    {OpCode::DUP_STORE, "DUP_STORE", {OpCode::DUP, OpCode::STORE}},
+    {OpCode::CMPLTI_JMPF, "CMPLTI_JMPF", {OpCode::CMPLTI, OpCode::JMPF}},
+    {OpCode::CMPLEI_JMPF, "CMPLEI_JMPF", {OpCode::CMPLEI, OpCode::JMPF}},
+    {OpCode::CMPGTI_JMPF, "CMPGTI_JMPF", {OpCode::CMPGTI, OpCode::JMPF}},
+    {OpCode::CMPGEI_JMPF, "CMPGEI_JMPF", {OpCode::CMPGEI, OpCode::JMPF}},
+    {OpCode::CMPEQI_JMPF, "CMPEQI_JMPF", {OpCode::CMPEQI, OpCode::JMPF}},
+    {OpCode::CMPNEI_JMPF, "CMPNEI_JMPF", {OpCode::CMPNEI, OpCode::JMPF}},
+  };
+
+}
+
+void VM::fuse(VMFrameInfo &frame)
+{
+  vector<VMCode> &code = frame.code;
+  int i = 0;
+  while (i < code.size())
+  {
+    int length = 1;
+    for (const Fusion &fusion : fusions)
     {
-      VMInstr instr = frame.instructions[i];
-      s += "  " + to_string(i) + ": " + to_string(instr) + "\n";
+      int n = fusion.sequence.size();
+      if (i + n > code.size())
+        continue;
+      int k = 0;
+      while (k < n and code[i + k].opcode == fusion.sequence[k])
+        ++k;
+      if (k == n)
+      {
+        code[i].opcode = fusion.fused;
+        length = n;
+        break;
+      }
     }
+    i += length;
   }
+}
+
+string VM::listing(const VMFrameInfo &frame, int pc) const
+{
+  // undo the encoding-only opcode changes
+  const VMCode &code = frame.code[pc];
+  OpCode opcode = code.opcode;
+  for (const Fusion &fusion : fusions)
+    if (fusion.fused == opcode)
+      opcode = fusion.sequence.front();
+  string operand = "";
+  switch (opcode)
+  {
+  case OpCode::PUSH:
+  case OpCode::ADDF:
+  case OpCode::SETF:
+  case OpCode::GETF:
+    operand = to_string(constants[code.operand]);
+    break;
+  case OpCode::LOAD:
+  case OpCode::STORE:
+  case OpCode::JMP:
+  case OpCode::JMPF:
+  case OpCode::SETF_SLOT:
+  case OpCode::GETF_SLOT:
+    operand = to_string(code.operand);
+    break;
+  case OpCode::CALL:
+  case OpCode::TAILCALL:
+    operand = frame.calls.at(pc);
+    break;
+  case OpCode::ALLOCS:
+  case OpCode::ALLOCR:
+    for (const auto &[name, id] : struct_ids)
+      if (id == code.operand)
+        operand = name;
+    break;
+  case OpCode::ALLOCA:
+    if (code.operand == static_cast<int>(VMObjectKind::INT_ARRAY))
+      operand = "int";
+    else if (code.operand == static_cast<int>(VMObjectKind::DOUBLE_ARRAY))
+      operand = "double";
+    else if (code.operand == static_cast<int>(VMObjectKind::BOOL_ARRAY))
+      operand = "bool";
+    break;
+  default:
+    break;
+  }
+  if (opcode == OpCode::SETF_SLOT)
+    opcode = OpCode::SETF;
+  else if (opcode == OpCode::GETF_SLOT)
+    opcode = OpCode::GETF;
+  string s = to_string(opcode) + "(" + operand + ")";
+  if (frame.comments.contains(pc))
+    s += "  // " + frame.comments.at(pc);
   return s;
 }
 
-void VM::add(const VMFrameInfo &frame)
+void VM::set_profiling(bool enabled)
+{
+  profiling = enabled;
+}
+
+size_t VM::dispatch_count(OpCode opcode) const
+{
+  return dispatches[static_cast<int>(opcode)];
+}
+
+string fusion_report(const VM &vm)
+{
+  size_t total = 0;
+  for (size_t count : vm.dispatches)
+    total += count;
+  size_t saved = 0;
+  string s = "superinstruction       sites   executed   dispatches saved\n";
+  for (const Fusion &fusion : fusions)
+  {
+    int sites = 0;
+    for (const auto &entry : vm.frame_info)
+      for (const VMCode &code : entry.second.code)
+        if (code.opcode == fusion.fused)
+          ++sites;
+    size_t executed = vm.dispatch_count(fusion.fused);
+    size_t fusion_saved = executed * (fusion.sequence.size() - 1);
+    saved += fusion_saved;
+    string name = fusion.name;
+    name.resize(20, ' ');
+    string counts = to_string(sites);
+    counts.insert(0, 7 - min<size_t>(7, counts.size()), ' ');
+    string runs = to_string(executed);
+    runs.insert(0, 11 - min<size_t>(11, runs.size()), ' ');
+    string saves = to_string(fusion_saved);
+    saves.insert(0, 19 - min<size_t>(19, saves.size()), ' ');
+    s += name + counts + runs + saves + "\n";
+  }
+  s += "dispatches: " + to_string(total) + " (" + to_string(saved) +
+    " saved of " + to_string(total + saved) + " unfused)\n";
+  return s;
+}
+
+void VM::trace(const VMFrame &frame) const
+{
+  cerr << endl
+       << endl;
+  cerr << "\t FRAME.........: " << frame.info->function_name << endl;
+  cerr << "\t PC............: " << (frame.pc - 1) << endl;
+  cerr << "\t INSTR.........: " << listing(*frame.info, frame.pc - 1) << endl;
+  cerr << "\t NEXT OPERAND..: ";
+  if (value_stack.size() > frame.fp + frame.info->local_count)
+    cerr << to_string(value_stack.back()) << endl;
+  else
+    cerr << "empty" << endl;
+  cerr << "\t NEXT FUNCTION.: ";
+  if (call_depth > 0)
+    cerr << call_stack[call_depth - 1].info->function_name << endl;
+  else
+    cerr << "empty" << endl;
+}
+
+int VM::add_field(VMObject &obj, const string &field)
+{
+  obj.layout = next_layout(obj.layout, field);
+  obj.values.push_back(nullptr);
+  return obj.values.size() - 1;
+}
+
+VMStructLayout *VM::next_layout(VMStructLayout *layout, const string &field)
+{
+  // share the successor layout with every object given the same fields
+  VMStructLayout *&next = layout->next[field];
+  if (next == nullptr)
+  {
+    struct_layouts.push_back({layout->fields, {}});
+    next = &struct_layouts.back();
+    next->fields.push_back(field);
+  }
+  return next;
+}
+
+int VM::allocate_struct(int type_id)
+{
+  int handle = allocate(VMObjectKind::STRUCT);
+  VMObject &obj = heap[handle];
+  if (type_id == -1)
+    obj.layout = &struct_layouts.front();
+  else
+  {
+    obj.layout = struct_types[type_id];
+    obj.values.assign(obj.layout->fields.size(), nullptr);
+  }
+  return handle;
+}
+
+int VM::allocate(VMObjectKind kind)
+{
+  int handle = free_handle;
+  if (handle == -1)
+  {
+    handle = heap.size();
+    heap.emplace_back(&pool);
+  }
+  else
+    free_handle = heap[handle].next_free;
+  heap[handle].kind = kind;
+  // new objects are never collected by the collection in progress (they
+  // only hold references that were reachable or went through a barrier)
+  heap[handle].marked = gc_phase == GCPhase::MARK or
+    (gc_phase == GCPhase::SWEEP and handle >= sweep_handle);
+  return handle;
+}
+
+VMObject &VM::deref(const VMFrame &f, const VMBox &x, VMObjectKind kind)
+{
+  if (x.is_null())
+    error("null reference", f);
+  // one load checks the handle is live and refers to the right kind
+  if (!x.is_ref() or x.as_ref() >= heap.size() or heap[x.as_ref()].kind != kind)
+    error("invalid object reference", f);
+  return heap[x.as_ref()];
+}
+
+VMObject &VM::deref_array(const VMFrame &f, const VMBox &x)
+{
+  if (x.is_null())
+    error("null reference", f);
+  if (!x.is_ref() or x.as_ref() >= heap.size() or !heap[x.as_ref()].is_array())
+    error("invalid object reference", f);
+  return heap[x.as_ref()];
+}
+
+void VM::collect_garbage()
+{
+  auto start = chrono::steady_clock::now();
+  Deadline deadline = Deadline::max();
+  if (gc_slice_budget.count() > 0)
+    deadline = start + gc_slice_budget;
+
+  if (gc_phase == GCPhase::IDLE)
+    start_marking();
+  if (gc_phase == GCPhase::MARK and mark_step(deadline))
+  {
+    gc_phase = GCPhase::SWEEP;
+    sweep_handle = 0;
+    live_bytes = 0;
+  }
+  if (gc_phase == GCPhase::SWEEP and sweep_step(deadline))
+  {
+    // let the heap grow to twice its live size before collecting again
+    gc_phase = GCPhase::IDLE;
+    allocated_bytes = 0;
+    gc_threshold = max(min_gc_threshold, live_bytes);
+  }
+
+  gc_pause_histogram.add(chrono::steady_clock::now() - start);
+}
+
+void VM::start_marking()
+{
+  gray.clear();
+  stack_scan = 0;
+  region_scan = 0;
+  gc_phase = GCPhase::MARK;
+}
+
+bool VM::mark_step(Deadline deadline)
+{
+  // (the clock is only checked after every 256 values scanned or traced)
+  size_t work = 0;
+  auto out_of_time = [&] {
+    if (work < 256)
+      return false;
+    work = 0;
+    return chrono::steady_clock::now() >= deadline;
+  };
+  while (true)
+  {
+    // the callers' windows, which stay as scanned until a return
+    size_t window = call_depth > 0 ? call_stack[call_depth - 1].fp : 0;
+    for (; stack_scan < window; ++stack_scan, ++work)
+    {
+      if (out_of_time())
+        return false;
+      mark(value_stack[stack_scan]);
+    }
+    // (region objects are only freed when their frame returns, and new
+    // ones are allocated marked)
+    region_scan = min(region_scan, region_stack.size());
+    for (; region_scan < region_stack.size(); ++region_scan, ++work)
+    {
+      if (out_of_time())
+        return false;
+      mark(VMBox::ref(region_stack[region_scan]));
+    }
+    while (!gray.empty())
+    {
+      if (out_of_time())
+        return false;
+      VMObject &obj = heap[gray.back()];
+      gray.pop_back();
+      // (typed arrays can't hold references)
+      for (const VMBox &x : obj.values)
+        mark(x);
+      work += 1 + obj.values.size();
+    }
+    // the running frame's window has no write barrier, so marking is
+    // done once it holds nothing unmarked (each pass marks more
+    // objects, and new objects are allocated marked, so this ends)
+    for (size_t i = window; i < value_stack.size(); ++i, ++work)
+      mark(value_stack[i]);
+    if (gray.empty())
+      return true;
+  }
+}
+
+bool VM::sweep_step(Deadline deadline)
+{
+  // free unmarked objects onto the free list
+  for (size_t work = 0; sweep_handle < heap.size(); ++sweep_handle, ++work)
+  {
+    if (work >= 256)
+    {
+      if (chrono::steady_clock::now() >= deadline)
+        return false;
+      work = 0;
+    }
+    VMObject &obj = heap[sweep_handle];
+    if (obj.kind == VMObjectKind::FREE)
+      continue;
+    if (obj.marked)
+    {
+      obj.marked = false;
+      live_bytes += obj.bytes();
+      continue;
+    }
+    free_object(sweep_handle);
+  }
+  return true;
+}
+
+void VM::free_object(int handle)
+{
+  heap[handle] = VMObject(&pool);
+  heap[handle].next_free = free_handle;
+  free_handle = handle;
+}
+
+void VM::mark(const VMBox &x)
+{
+  if (!x.is_ref() or heap[x.as_ref()].marked)
+    return;
+  heap[x.as_ref()].marked = true;
+  gray.push_back(x.as_ref());
+}
+
+void VM::write_barrier(const VMBox &x)
+{
+  // (a reference stored into an already traced object is marked here)
+  if (gc_phase == GCPhase::MARK)
+    mark(x);
+}
+
+void VM::set_gc_slice_budget(chrono::microseconds budget)
+{
+  gc_slice_budget = budget;
+}
+
+const VMPauseHistogram &VM::gc_pauses() const
+{
+  return gc_pause_histogram;
+}
+
+const VMPool &VM::heap_pool() const
+{
+  return pool;
+}
+
+void VM::set_gc_threshold(size_t bytes)
+{
+  min_gc_threshold = gc_threshold = bytes;
+}
+
+size_t VM::live_object_count() const
+{
+  size_t count = 0;
+  for (const VMObject &obj : heap)
+    if (obj.kind != VMObjectKind::FREE)
+      ++count;
+  return count;
+}
+
+void VM::set_max_call_depth(int depth)
+{
+  max_call_depth = max(1, depth);
+}
+
+VMFrame *VM::push_frame(const VMFrameInfo *info, int fp)
+{
+  if (call_depth == max_call_depth)
+    error("stack overflow", call_stack[call_depth - 1]);
+  // grow the frame buffer geometrically (up to the max depth)
+  if (call_depth == call_stack.size())
+  {
+    int size = max(16, 2 * (int)call_stack.size());
+    call_stack.resize(min(size, max_call_depth));
+  }
+  VMFrame &frame = call_stack[call_depth++];
+  frame.info = info;
+  frame.pc = info->entry_pc;
+  frame.fp = fp;
+  frame.region = region_stack.size();
+  return &frame;
+}
+
+VMBox VM::pop()
 {
-  frame_info[frame.function_name] = frame;
+  VMBox x = std::move(value_stack.back());
+  value_stack.pop_back();
+  return x;
 }
 
 void VM::run(bool DEBUG)
@@ -54,694 +694,881 @@ void VM::run(bool DEBUG)
   // grab the "main" frame if it exists
   if (!frame_info.contains("main"))
     error("No 'main' function");
-  shared_ptr<VMFrame> frame = make_shared<VMFrame>();
-  frame->info = frame_info["main"];
-  call_stack.push(frame);
+  if (!linked)
+    link();
+  call_depth = 0;
+  value_stack.clear();
+  region_stack.clear();
+  stack_scan = 0;
+  region_scan = 0;
+  VMFrame *frame = push_frame(&frame_info["main"], 0);
+  value_stack.resize(frame->info->local_count);
+  // checked once per dispatch, for tracing or profiling
+  const bool observe = DEBUG or profiling;
+
+#ifdef MYPL_THREADED_DISPATCH
+  // one handler address per opcode, unknown opcodes fall to the error
+  static void* dispatch_table[256];
+  for (auto& label : dispatch_table)
+    label = &&L_UNKNOWN;
+  VM_LABEL(PUSH); VM_LABEL(POP); VM_LABEL(LOAD); VM_LABEL(STORE);
+  VM_LABEL(ADD); VM_LABEL(SUB); VM_LABEL(MUL); VM_LABEL(DIV);
+  VM_LABEL(AND); VM_LABEL(OR); VM_LABEL(NOT);
+  VM_LABEL(CMPLT); VM_LABEL(CMPLE); VM_LABEL(CMPGT); VM_LABEL(CMPGE);
+  VM_LABEL(CMPEQ); VM_LABEL(CMPNE);
+  VM_LABEL(ADDI); VM_LABEL(SUBI); VM_LABEL(MULI); VM_LABEL(DIVI);
+  VM_LABEL(ADDD); VM_LABEL(SUBD); VM_LABEL(MULD); VM_LABEL(DIVD);
+  VM_LABEL(CMPLTI); VM_LABEL(CMPLEI); VM_LABEL(CMPGTI); VM_LABEL(CMPGEI);
+  VM_LABEL(CMPLTD); VM_LABEL(CMPLED); VM_LABEL(CMPGTD); VM_LABEL(CMPGED);
+  VM_LABEL(CMPLTS); VM_LABEL(CMPLES); VM_LABEL(CMPGTS); VM_LABEL(CMPGES);
+  VM_LABEL(CMPEQI); VM_LABEL(CMPNEI); VM_LABEL(CMPEQS); VM_LABEL(CMPNES);
+  VM_LABEL(JMP); VM_LABEL(JMPF); VM_LABEL(CALL); VM_LABEL(RET);
+  VM_LABEL(TAILCALL);
+  VM_LABEL(WRITE); VM_LABEL(READ); VM_LABEL(SLEN); VM_LABEL(ALEN);
+  VM_LABEL(GETC); VM_LABEL(TOINT); VM_LABEL(TODBL); VM_LABEL(TOSTR);
+  VM_LABEL(CONCAT);
+  VM_LABEL(ALLOCS); VM_LABEL(ALLOCR); VM_LABEL(ALLOCA);
+  VM_LABEL(ADDF); VM_LABEL(SETF);
+  VM_LABEL(GETF); VM_LABEL(SETI); VM_LABEL(GETI);
+  VM_LABEL(DUP); VM_LABEL(NOP);
+  VM_LABEL(SETF_SLOT); VM_LABEL(GETF_SLOT);
+  VM_LABEL(LOAD_LOAD); VM_LABEL(LOAD_PUSH); VM_LABEL(PUSH_WRITE);
+  VM_LABEL(DUP_STORE);
+  VM_LABEL(LOAD_PUSH_ADDI_STORE);
+  VM_LABEL(CMPLTI_JMPF); VM_LABEL(CMPLEI_JMPF); VM_LABEL(CMPGTI_JMPF);
+  VM_LABEL(CMPGEI_JMPF); VM_LABEL(CMPEQI_JMPF); VM_LABEL(CMPNEI_JMPF);
+#endif
 
   // run loop (keep going until we run out of instructions)
-  while (!call_stack.empty() and frame->pc < frame->info.instructions.size())
+  const VMCode* instr = nullptr;
+  for (;;)
   {
+    VM_FETCH();
 
-    // get the next instruction
-    VMInstr &instr = frame->info.instructions[frame->pc];
-
-    // increment the program counter
-    ++frame->pc;
-
-    // for debugging
-    if (DEBUG)
+    VM_DISPATCH()
     {
-      cerr << endl
-           << endl;
-      cerr << "\t FRAME.........: " << frame->info.function_name << endl;
-      cerr << "\t PC............: " << (frame->pc - 1) << endl;
-      cerr << "\t INSTR.........: " << to_string(instr) << endl;
-      cerr << "\t NEXT OPERAND..: ";
-      if (!frame->operand_stack.empty())
-        cerr << to_string(frame->operand_stack.top()) << endl;
-      else
-        cerr << "empty" << endl;
-      cerr << "\t NEXT FUNCTION.: ";
-      if (!call_stack.empty())
-        cerr << call_stack.top()->info.function_name << endl;
-      else
-        cerr << "empty" << endl;
-    }
 
     //----------------------------------------------------------------------
     // Literals and Variables
     //----------------------------------------------------------------------
 
-    if (instr.opcode() == OpCode::PUSH)
+    VM_CASE(PUSH):
     {
-      frame->operand_stack.push(instr.operand().value());
+      value_stack.push_back(constants[instr->operand]);
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::POP)
+    VM_CASE(POP):
     {
-      frame->operand_stack.pop();
+      value_stack.pop_back();
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::LOAD)
+    VM_CASE(LOAD):
     {
-      frame->operand_stack.push(frame->variables[get<int>(instr.operand().value())]);
+      value_stack.push_back(value_stack[frame->fp + instr->operand]);
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::STORE)
+    VM_CASE(STORE):
     {
-      if (frame->variables.size() > get<int>(instr.operand().value()))
-      {
-        frame->variables[get<int>(instr.operand().value())] = frame->operand_stack.top();
-      }
-      else
-      {
-        frame->variables.push_back(frame->operand_stack.top());
-      }
-      frame->operand_stack.pop();
+      value_stack[frame->fp + instr->operand] = pop();
+      VM_NEXT;
     }
 
     //----------------------------------------------------------------------
     // Operations
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::ADD)
+    VM_CASE(ADD):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(add(y, x));
+      value_stack.push_back(add(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::SUB)
+    VM_CASE(SUB):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(sub(y, x));
+      value_stack.push_back(sub(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::MUL)
+    VM_CASE(MUL):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(mul(y, x));
+      value_stack.push_back(mul(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::DIV)
+    VM_CASE(DIV):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(div(y, x));
+      value_stack.push_back(div(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::AND)
+    VM_CASE(AND):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      bool b = get<bool>(x) && get<bool>(y);
-      frame->operand_stack.push(b);
+      value_stack.push_back(x.as_bool() && y.as_bool());
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::OR)
+    VM_CASE(OR):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      bool b = get<bool>(x) || get<bool>(y);
-      frame->operand_stack.push(b);
+      value_stack.push_back(x.as_bool() || y.as_bool());
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::NOT)
+    VM_CASE(NOT):
     {
-      VMValue operand = frame->operand_stack.top();
-      ensure_not_null(*frame, operand);
-      frame->operand_stack.pop();
-
-      if (holds_alternative<bool>(operand))
-      {
-        if (get<bool>(operand) == true)
-          frame->operand_stack.push(false);
-        else
-          frame->operand_stack.push(true);
-      }
-      else
-      {
+      VMBox x = pop();
+      ensure_not_null(*frame, x);
+      if (!x.is_bool())
         error("VM: 'NOT' is only usable on operands of type bool");
-      }
+      value_stack.push_back(!x.as_bool());
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPLT)
+    VM_CASE(CMPLT):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(lt(y, x));
+      value_stack.push_back(lt(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPLE)
+    VM_CASE(CMPLE):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(le(y, x));
+      value_stack.push_back(le(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPGT)
+    VM_CASE(CMPGT):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(gt(y, x));
+      value_stack.push_back(gt(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPGE)
+    VM_CASE(CMPGE):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(ge(y, x));
+      value_stack.push_back(ge(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPEQ)
+    VM_CASE(CMPEQ):
     {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      frame->operand_stack.push(eq(y, x));
+      VMBox x = pop();
+      VMBox y = pop();
+      value_stack.push_back(eq(y, x));
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPNE)
+    VM_CASE(CMPNE):
     {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      frame->operand_stack.push(eq(y, x));
-      // we didn't implement an ne operation, so we just do it manually
-      VMValue equal = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      if (get<bool>(equal) == false)
-        frame->operand_stack.push(true);
-      else
-        frame->operand_stack.push(false);
+      VMBox x = pop();
+      VMBox y = pop();
+      value_stack.push_back(!eq(y, x).as_bool());
+      VM_NEXT;
     }
 
     //----------------------------------------------------------------------
-    // Branching
+    // Typed arithmetic and comparison
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::JMP)
+    // the semantic checker guarantees both operands have the type, so
+    // the only check left is a single test that fails for null operands
+#define VM_TYPED_OP(op, is_type, result)          \
+    VM_CASE(op):                                  \
+    {                                             \
+      VMBox &x = value_stack.back();              \
+      VMBox &y = value_stack.end()[-2];           \
+      if (!(x.is_type() & y.is_type()))           \
+        error("null reference", *frame);          \
+      y = VMBox(result);                          \
+      value_stack.pop_back();                     \
+      VM_NEXT;                                    \
+    }
+
+    // (ints wrap around, computed unsigned to avoid signed overflow, and
+    // a division by -1 is a negation so that INT_MIN / -1 wraps too)
+    VM_TYPED_OP(ADDI, is_int, int32_t(uint32_t(y.as_int()) + uint32_t(x.as_int())))
+    VM_TYPED_OP(SUBI, is_int, int32_t(uint32_t(y.as_int()) - uint32_t(x.as_int())))
+    VM_TYPED_OP(MULI, is_int, int32_t(uint32_t(y.as_int()) * uint32_t(x.as_int())))
+    VM_TYPED_OP(DIVI, is_int, x.as_int() == -1 ?
+                int32_t(0u - uint32_t(y.as_int())) : y.as_int() / x.as_int())
+    VM_TYPED_OP(ADDD, is_double, y.as_double() + x.as_double())
+    VM_TYPED_OP(SUBD, is_double, y.as_double() - x.as_double())
+    VM_TYPED_OP(MULD, is_double, y.as_double() * x.as_double())
+    VM_TYPED_OP(DIVD, is_double, y.as_double() / x.as_double())
+    VM_TYPED_OP(CMPLTI, is_int, y.as_int() < x.as_int())
+    VM_TYPED_OP(CMPLEI, is_int, y.as_int() <= x.as_int())
+    VM_TYPED_OP(CMPGTI, is_int, y.as_int() > x.as_int())
+    VM_TYPED_OP(CMPGEI, is_int, y.as_int() >= x.as_int())
+    VM_TYPED_OP(CMPLTD, is_double, y.as_double() < x.as_double())
+    VM_TYPED_OP(CMPLED, is_double, y.as_double() <= x.as_double())
+    VM_TYPED_OP(CMPGTD, is_double, y.as_double() > x.as_double())
+    VM_TYPED_OP(CMPGED, is_double, y.as_double() >= x.as_double())
+    VM_TYPED_OP(CMPLTS, is_string, y.as_string() < x.as_string())
+    VM_TYPED_OP(CMPLES, is_string, y.as_string() <= x.as_string())
+    VM_TYPED_OP(CMPGTS, is_string, y.as_string() > x.as_string())
+    VM_TYPED_OP(CMPGES, is_string, y.as_string() >= x.as_string())
+#undef VM_TYPED_OP
+
+    VM_CASE(CMPEQI):
+    { // (one-word values, including null, are equal if their words are)
+      VMBox &x = value_stack.back();
+      VMBox &y = value_stack.end()[-2];
+      y = VMBox(y.same(x));
+      value_stack.pop_back();
+      VM_NEXT;
+    }
+
+    VM_CASE(CMPNEI):
     {
-      ensure_not_null(*frame, instr.operand().value());
-      if (holds_alternative<int>(instr.operand().value()))
-      {
-        frame->pc = get<int>(instr.operand().value());
-      }
-      else
-      {
-        error("JMP: Jump param must be of type int");
-      }
+      VMBox &x = value_stack.back();
+      VMBox &y = value_stack.end()[-2];
+      y = VMBox(!y.same(x));
+      value_stack.pop_back();
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::JMPF)
+    VM_CASE(CMPEQS):
     {
-      ensure_not_null(*frame, instr.operand().value());
+      VMBox &x = value_stack.back();
+      VMBox &y = value_stack.end()[-2];
+      bool equal = y.same(x) or (x.is_string() and y.is_string() and
+                                 y.as_string() == x.as_string());
+      y = VMBox(equal);
+      value_stack.pop_back();
+      VM_NEXT;
+    }
 
-      VMValue op = frame->operand_stack.top();
+    VM_CASE(CMPNES):
+    {
+      VMBox &x = value_stack.back();
+      VMBox &y = value_stack.end()[-2];
+      bool equal = y.same(x) or (x.is_string() and y.is_string() and
+                                 y.as_string() == x.as_string());
+      y = VMBox(!equal);
+      value_stack.pop_back();
+      VM_NEXT;
+    }
 
-      if (get<bool>(op) == false)
-      {
-        if (holds_alternative<int>(instr.operand().value()))
-        {
-          frame->pc = get<int>(instr.operand().value());
-        }
-        else
-        {
-          error("JMPF: Jump param must be of type int");
-        }
-      }
-      frame->operand_stack.pop();
+    //----------------------------------------------------------------------
+    // Branching
+    //----------------------------------------------------------------------
+
+    VM_CASE(JMP):
+    {
+      frame->pc = instr->operand;
+      VM_NEXT;
+    }
+
+    VM_CASE(JMPF):
+    {
+      VMBox x = pop();
+      ensure_not_null(*frame, x);
+      if (x.as_bool() == false)
+        frame->pc = instr->operand;
+      VM_NEXT;
     }
 
     //----------------------------------------------------------------------
     // Functions
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::CALL)
+    VM_CASE(CALL):
     {
-      if (instr.operand().has_value())
+      // the arguments on top of the stack become the callee's first
+      // locals, in place
+      const VMFrameInfo *info = functions[instr->operand];
+      int fp = value_stack.size() - info->arg_count;
+      frame = push_frame(info, fp);
+      if (info->args_in_place)
+        value_stack.resize(fp + info->local_count);
+      else
       {
-        string fun_name = get<string>(instr.operand().value());
-
-        shared_ptr<VMFrame> new_frame = make_shared<VMFrame>();
-        new_frame->info = frame_info[fun_name];
-
-        call_stack.push(new_frame);
+        // no standard prologue, so hand over the arguments as operands
+        // (first argument on top) for the callee to store itself
+        vector<VMBox> args(make_move_iterator(value_stack.begin() + fp),
+                             make_move_iterator(value_stack.end()));
+        value_stack.resize(fp + info->local_count);
+        for (int i = args.size() - 1; i >= 0; --i)
+          value_stack.push_back(std::move(args[i]));
+      }
+      VM_NEXT;
+    }
 
-        for (int i = 0; i < new_frame->info.arg_count; i++)
-        {
-          VMValue x = frame->operand_stack.top();
-          new_frame->operand_stack.push(x);
-          frame->operand_stack.pop();
-        }
-        frame = new_frame;
+    VM_CASE(RET):
+    {
+      // drop the frame's window (locals and operands) from the stack
+      VMBox ret = pop();
+      value_stack.resize(frame->fp);
+      // free the objects in the frame's region
+      while (region_stack.size() > frame->region)
+      {
+        free_object(region_stack.back());
+        region_stack.pop_back();
       }
+      --call_depth;
+      if (call_depth > 0)
+      {
+        frame = &call_stack[call_depth - 1];
+        value_stack.push_back(std::move(ret));
+        // (the caller's window can change again, see mark_step)
+        stack_scan = min<size_t>(stack_scan, frame->fp);
+      }
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::RET)
+    VM_CASE(TAILCALL):
     {
-      VMValue ret = frame->operand_stack.top();
-      call_stack.pop();
-      if (!call_stack.empty())
+      // the arguments overwrite the frame's locals, and the frame runs
+      // the callee (the frame has no region objects, see CodeGenerator)
+      const VMFrameInfo *info = functions[instr->operand];
+      int fp = frame->fp;
+      int first_arg = value_stack.size() - info->arg_count;
+      if (first_arg != fp)
+        for (int i = 0; i < info->arg_count; ++i)
+          value_stack[fp + i] = std::move(value_stack[first_arg + i]);
+      value_stack.resize(fp + info->arg_count);
+      frame->info = info;
+      frame->pc = info->entry_pc;
+      if (info->args_in_place)
+        value_stack.resize(fp + info->local_count);
+      else
       {
-        frame = call_stack.top();
-        frame->operand_stack.push(ret);
+        // (as CALL does, first argument on top)
+        vector<VMBox> args(make_move_iterator(value_stack.begin() + fp),
+                           make_move_iterator(value_stack.end()));
+        value_stack.resize(fp + info->local_count);
+        for (int i = args.size() - 1; i >= 0; --i)
+          value_stack.push_back(std::move(args[i]));
       }
+      VM_NEXT;
     }
 
     //----------------------------------------------------------------------
     // Built in functions
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::WRITE)
+    VM_CASE(WRITE):
     {
-      VMValue x = frame->operand_stack.top();
-      // ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      cout << to_string(x);
+      VMBox x = pop();
+      if (x.is_string())
+        cout << x.as_string();
+      else
+        cout << to_string(x);
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::READ)
+    VM_CASE(READ):
     {
       string val = "";
       getline(cin, val);
-      frame->operand_stack.push(val);
+      value_stack.push_back(std::move(val));
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::SLEN)
+    VM_CASE(SLEN):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      int len = get<string>(x).size();
-      frame->operand_stack.push(len);
+      int len = x.as_string().size();
+      value_stack.push_back(len);
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::ALEN)
+    VM_CASE(ALEN):
     {
-      VMValue oid = frame->operand_stack.top();
-      ensure_not_null(*frame, oid);
-      frame->operand_stack.pop();
-      int size = array_heap[get<int>(oid)].size();
-      frame->operand_stack.push(size);
+      VMBox oid = pop();
+      int size = deref_array(*frame, oid).length();
+      value_stack.push_back(size);
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::GETC)
+    VM_CASE(GETC):
     {
-      VMValue val = frame->operand_stack.top();
+      VMBox val = pop();
       ensure_not_null(*frame, val);
-      frame->operand_stack.pop();
-      VMValue index = frame->operand_stack.top();
+      VMBox index = pop();
       ensure_not_null(*frame, index);
-      frame->operand_stack.pop();
-      char ch = get<string>(val)[get<int>(index)];
-
-      if (ch == '\0')
-        error("out-of-bounds string index", *frame.get());
-
-      string str2;
-      str2.append(1, ch);
-      frame->operand_stack.push(str2);
+      const string &str = val.as_string();
+      int i = index.as_int();
+      if (i < 0 or i >= str.size())
+        error("out-of-bounds string index", *frame);
+      value_stack.push_back(string(1, str[i]));
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::TOINT)
+    VM_CASE(TOINT):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      if (holds_alternative<string>(x))
+      if (x.is_string())
       {
-        string str = get<string>(x);
         try
         {
-          int i = stoi(str);
-          frame->operand_stack.push(i);
+          value_stack.push_back(stoi(x.as_string()));
         }
         catch (...)
         {
-          error("cannot convert string to int", *frame.get());
+          error("cannot convert string to int", *frame);
         }
       }
-      else if (holds_alternative<double>(x))
-      {
-        int d = get<double>(x);
-        frame->operand_stack.push((int)d);
-      }
-      else if (holds_alternative<int>(x))
-      {
-        frame->operand_stack.push(x);
-      }
+      else if (x.is_double())
+        value_stack.push_back((int)x.as_double());
+      else if (x.is_int())
+        value_stack.push_back(std::move(x));
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::TODBL)
+    VM_CASE(TODBL):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      if (holds_alternative<string>(x))
+      if (x.is_string())
       {
-        string str = get<string>(x);
         try
         {
-          double d = stod(str);
-          frame->operand_stack.push(d);
+          value_stack.push_back(stod(x.as_string()));
         }
         catch (...)
         {
-          error("cannot convert string to double", *frame.get());
+          error("cannot convert string to double", *frame);
         }
       }
-      else if (holds_alternative<int>(x))
-      {
-        int i = get<int>(x);
-        frame->operand_stack.push((double)i);
-      }
+      else if (x.is_int())
+        value_stack.push_back((double)x.as_int());
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::TOSTR)
+    VM_CASE(TOSTR):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      if (holds_alternative<int>(x))
-      {
-        try
-        {
-          int i = get<int>(x);
-          string str = to_string(i);
-          frame->operand_stack.push(str);
-        }
-        catch (...)
-        {
-          error("cannot convert int to string", *frame.get());
-        }
-      }
-      else if (holds_alternative<double>(x))
-      {
-        try
-        {
-          double d = get<double>(x);
-          string str = to_string(d);
-          frame->operand_stack.push(str);
-        }
-        catch (...)
-        {
-          error("cannot convert double to string", *frame.get());
-        }
-      }
+      if (x.is_int())
+        value_stack.push_back(to_string(x.as_int()));
+      else if (x.is_double())
+        value_stack.push_back(to_string(x.as_double()));
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::CONCAT)
+    VM_CASE(CONCAT):
     {
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-
-      string new_string = get<string>(y) + get<string>(x);
-      frame->operand_stack.push(new_string);
+      // append in place when nothing else shares the left operand
+      if (string *buffer = y.unique_string())
+      {
+        *buffer += x.as_string();
+        value_stack.push_back(std::move(y));
+      }
+      else
+        value_stack.push_back(y.as_string() + x.as_string());
+      VM_NEXT;
     }
 
     //----------------------------------------------------------------------
     // heap
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::ALLOCS)
+    VM_CASE(ALLOCS):
     {
-      struct_heap[next_obj_id] = {};
-      frame->operand_stack.push(next_obj_id);
-      ++next_obj_id;
+      // (collect before popping operands, so they stay reachable)
+      if (gc_phase != GCPhase::IDLE or allocated_bytes >= gc_threshold)
+        collect_garbage();
+      int handle = allocate_struct(instr->operand);
+      allocated_bytes += heap[handle].bytes();
+      value_stack.push_back(VMBox::ref(handle));
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::ALLOCA)
+    VM_CASE(ALLOCR):
     {
-      VMValue val = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      int size = get<int>(frame->operand_stack.top());
-      frame->operand_stack.pop();
-      array_heap[next_obj_id] = vector<VMValue>(size, val);
-      frame->operand_stack.push(next_obj_id);
-      ++next_obj_id;
+      // (freed on return, so these don't count towards a collection)
+      int handle = allocate_struct(instr->operand);
+      region_stack.push_back(handle);
+      value_stack.push_back(VMBox::ref(handle));
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::ADDF)
+    VM_CASE(ALLOCA):
+    {
+      if (gc_phase != GCPhase::IDLE or allocated_bytes >= gc_threshold)
+        collect_garbage();
+      VMBox val = pop();
+      int size = pop().as_int();
+      VMObjectKind kind = static_cast<VMObjectKind>(instr->operand);
+      int handle = allocate(kind);
+      VMObject &array = heap[handle];
+      if (kind != VMObjectKind::ARRAY)
+        array.present.assign(size, !val.is_null());
+      if (kind == VMObjectKind::INT_ARRAY)
+        array.ints.assign(size, val.is_null() ? 0 : val.as_int());
+      else if (kind == VMObjectKind::DOUBLE_ARRAY)
+        array.doubles.assign(size, val.is_null() ? 0.0 : val.as_double());
+      else if (kind == VMObjectKind::BOOL_ARRAY)
+        array.bools.assign(size, val.is_null() ? false : val.as_bool());
+      else
+      {
+        write_barrier(val);
+        array.values.assign(size, val);
+      }
+      allocated_bytes += array.bytes();
+      value_stack.push_back(VMBox::ref(handle));
+      VM_NEXT;
+    }
+    VM_CASE(ADDF):
     { // pop oid x, add field f to obj(x)
-      VMValue oid = frame->operand_stack.top();
-      ensure_not_null(*frame, oid);
-      frame->operand_stack.pop();
-      int id = get<int>(oid);
-      string f = get<string>(instr.operand().value());
-      struct_heap[id].insert({f, nullptr});
-    }
-    else if (instr.opcode() == OpCode::SETF)
+      VMBox oid = pop();
+      const string &f = constants[instr->operand].as_string();
+      VMObject &obj = deref(*frame, oid, VMObjectKind::STRUCT);
+      if (obj.layout->slot(f) == -1)
+        add_field(obj, f);
+      VM_NEXT;
+    }
+    VM_CASE(SETF):
     { // pop x and y, in heap set obj(y).f = x
-      VMValue val = frame->operand_stack.top();
-      //ensure_not_null(*frame, val); // can be null?
-      frame->operand_stack.pop();
-      VMValue oid = frame->operand_stack.top();
-      ensure_not_null(*frame, oid);
-      frame->operand_stack.pop();
-      int id = get<int>(oid);
-      string str = get<string>(instr.operand().value());
-      struct_heap[id][str] = val;
-    }
-    else if (instr.opcode() == OpCode::GETF)
+      VMBox val = pop();
+      VMBox oid = pop();
+      const string &f = constants[instr->operand].as_string();
+      VMObject &obj = deref(*frame, oid, VMObjectKind::STRUCT);
+      int slot = obj.layout->slot(f);
+      if (slot == -1)
+        slot = add_field(obj, f);
+      write_barrier(val);
+      obj.values[slot] = std::move(val);
+      VM_NEXT;
+    }
+    VM_CASE(SETF_SLOT):
+    { // pop x and y, in heap set obj(y).fields[slot] = x
+      VMBox val = pop();
+      VMBox oid = pop();
+      VMObject &obj = deref(*frame, oid, VMObjectKind::STRUCT);
+      if (instr->operand >= obj.values.size())
+        error("invalid field slot", *frame);
+      write_barrier(val);
+      obj.values[instr->operand] = std::move(val);
+      VM_NEXT;
+    }
+    VM_CASE(GETF):
     { // pop x, push obj(x).f on to operand stack
-      VMValue oid = frame->operand_stack.top();
-      ensure_not_null(*frame, oid);
-      frame->operand_stack.pop();
-      int id = get<int>(oid);
-      string str = get<string>(instr.operand().value());
-      frame->operand_stack.push(struct_heap[id][str]);
-    }
-    else if (instr.opcode() == OpCode::SETI)
+      VMBox oid = pop();
+      const string &f = constants[instr->operand].as_string();
+      const VMObject &obj = deref(*frame, oid, VMObjectKind::STRUCT);
+      int slot = obj.layout->slot(f);
+      if (slot == -1)
+        value_stack.push_back(nullptr);
+      else
+        value_stack.push_back(obj.values[slot]);
+      VM_NEXT;
+    }
+    VM_CASE(GETF_SLOT):
+    { // pop x, push obj(x).fields[slot] on to operand stack
+      VMBox oid = pop();
+      const VMObject &obj = deref(*frame, oid, VMObjectKind::STRUCT);
+      if (instr->operand >= obj.values.size())
+        error("invalid field slot", *frame);
+      value_stack.push_back(obj.values[instr->operand]);
+      VM_NEXT;
+    }
+    VM_CASE(SETI):
     { // pop x, y, and z, set array obj(z)[y] = x
-
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       // x is allowed to be nullptr
-      frame->operand_stack.pop();
-
-      VMValue y = frame->operand_stack.top();
+      VMBox y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-
-      VMValue z = frame->operand_stack.top();
-      ensure_not_null(*frame, z);
-      frame->operand_stack.pop();
+      VMBox z = pop();
 
-      int id = get<int>(z);
-      int size = array_heap[id].size();
-      int index = get<int>(y);
-
-      if ((index < 0) || (index >= size))
+      VMObject &array = deref_array(*frame, z);
+      int index = y.as_int();
+      if ((index < 0) || (index >= array.length()))
         error("out-of-bounds array index", *frame);
 
-      if (holds_alternative<int>(x))
-      {
-        array_heap[id][index] = get<int>(x);
-      }
-      else if (holds_alternative<double>(x))
-      {
-        array_heap[id][index] = get<double>(x);
-      }
-      else if (holds_alternative<string>(x))
-      {
-        array_heap[id][index] = get<string>(x);
-      }
-      else if (holds_alternative<bool>(x))
-      {
-        array_heap[id][index] = get<bool>(x);
+      // (storing null leaves the element unchanged)
+      if (x.is_null())
+        VM_NEXT;
+      switch (array.kind) {
+      case VMObjectKind::INT_ARRAY:
+        array.ints[index] = x.as_int();
+        array.present[index] = true;
+        break;
+      case VMObjectKind::DOUBLE_ARRAY:
+        array.doubles[index] = x.as_double();
+        array.present[index] = true;
+        break;
+      case VMObjectKind::BOOL_ARRAY:
+        array.bools[index] = x.as_bool();
+        array.present[index] = true;
+        break;
+      default:
+        write_barrier(x);
+        array.values[index] = std::move(x);
       }
+      VM_NEXT;
     }
-    else if (instr.opcode() == OpCode::GETI)
+    VM_CASE(GETI):
     { // pop x and y, push array obj(y)[x] value on to operand stack
-      VMValue x = frame->operand_stack.top();
+      VMBox x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
-      ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-
-      int id = get<int>(y);
-      int size = array_heap[id].size();
-      int index = get<int>(x);
+      VMBox y = pop();
 
-      if ((index < 0) || (index >= size))
+      const VMObject &array = deref_array(*frame, y);
+      int index = x.as_int();
+      if ((index < 0) || (index >= array.length()))
         error("out-of-bounds array index", *frame);
 
-      VMValue i = array_heap[id][index];
-      frame->operand_stack.push(i);
+      if (array.kind == VMObjectKind::ARRAY)
+        value_stack.push_back(array.values[index]);
+      else if (!array.present[index])
+        value_stack.push_back(nullptr);
+      else if (array.kind == VMObjectKind::INT_ARRAY)
+        value_stack.push_back(array.ints[index]);
+      else if (array.kind == VMObjectKind::DOUBLE_ARRAY)
+        value_stack.push_back(array.doubles[index]);
+      else
+        value_stack.push_back(static_cast<bool>(array.bools[index]));
+      VM_NEXT;
     }
 
     //----------------------------------------------------------------------
     // special
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::DUP)
+    VM_CASE(DUP):
     {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      frame->operand_stack.push(x);
-      frame->operand_stack.push(x);
+      value_stack.push_back(value_stack.back());
+      VM_NEXT;
     }
 
-    else if (instr.opcode() == OpCode::NOP)
+    VM_CASE(NOP):
     {
       // do nothing
+      VM_NEXT;
+    }
+
+    //----------------------------------------------------------------------
+    // Superinstructions (see fuse)
+    //----------------------------------------------------------------------
+
+    VM_CASE(LOAD_LOAD):
+    {
+      value_stack.push_back(value_stack[frame->fp + instr[0].operand]);
+      value_stack.push_back(value_stack[frame->fp + instr[1].operand]);
+      frame->pc += 1;
+      VM_NEXT;
     }
 
-    else
+    VM_CASE(LOAD_PUSH):
     {
-      error("unsupported operation " + to_string(instr));
+      value_stack.push_back(value_stack[frame->fp + instr[0].operand]);
+      value_stack.push_back(constants[instr[1].operand]);
+      frame->pc += 1;
+      VM_NEXT;
+    }
+
+    VM_CASE(PUSH_WRITE):
+    {
+      const VMBox &x = constants[instr[0].operand];
+      if (x.is_string())
+        cout << x.as_string();
+      else
+        cout << to_string(x);
+      frame->pc += 1;
+      VM_NEXT;
+    }
+
+    VM_CASE(DUP_STORE):
+    {
+      value_stack[frame->fp + instr[1].operand] = value_stack.back();
+      frame->pc += 1;
+      VM_NEXT;
+    }
+
+    VM_CASE(LOAD_PUSH_ADDI_STORE):
+    {
+      const VMBox &x = value_stack[frame->fp + instr[0].operand];
+      const VMBox &y = constants[instr[1].operand];
+      if (!(x.is_int() & y.is_int()))
+      {
+        frame->pc += 2;   // (report the ADDI)
+        error("null reference", *frame);
+      }
+      value_stack[frame->fp + instr[3].operand] =
+        VMBox(int32_t(uint32_t(x.as_int()) + uint32_t(y.as_int())));
+      frame->pc += 3;
+      VM_NEXT;
+    }
+
+#define VM_CMPI_JMPF(op, valid, result)           \
+    VM_CASE(op):                                  \
+    {                                             \
+      const VMBox &x = value_stack.back();        \
+      const VMBox &y = value_stack.end()[-2];     \
+      if (!(valid))                               \
+        error("null reference", *frame);          \
+      bool jump = !(result);                      \
+      value_stack.pop_back();                     \
+      value_stack.pop_back();                     \
+      frame->pc = jump ? instr[1].operand : frame->pc + 1; \
+      VM_NEXT;                                    \
+    }
+
+    VM_CMPI_JMPF(CMPLTI_JMPF, x.is_int() & y.is_int(), y.as_int() < x.as_int())
+    VM_CMPI_JMPF(CMPLEI_JMPF, x.is_int() & y.is_int(), y.as_int() <= x.as_int())
+    VM_CMPI_JMPF(CMPGTI_JMPF, x.is_int() & y.is_int(), y.as_int() > x.as_int())
+    VM_CMPI_JMPF(CMPGEI_JMPF, x.is_int() & y.is_int(), y.as_int() >= x.as_int())
+    VM_CMPI_JMPF(CMPEQI_JMPF, true, y.same(x))
+    VM_CMPI_JMPF(CMPNEI_JMPF, true, !y.same(x))
+#undef VM_CMPI_JMPF
+
+    VM_DEFAULT:
+    {
+      error("unsupported operation", *frame);
+    }
     }
   }
 }
 
-void VM::ensure_not_null(const VMFrame &f, const VMValue &x) const
+void VM::ensure_not_null(const VMFrame &f, const VMBox &x) const
 {
-  if (holds_alternative<nullptr_t>(x))
+  if (x.is_null())
     error("null reference", f);
 }
 
-VMValue VM::add(const VMValue &x, const VMValue &y) const
+VMBox VM::add(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<int>(x))
-    return get<int>(x) + get<int>(y);
+  if (x.is_int())
+    return int32_t(uint32_t(x.as_int()) + uint32_t(y.as_int()));
   else
-    return get<double>(x) + get<double>(y);
+    return x.as_double() + y.as_double();
 }
 
-VMValue VM::sub(const VMValue &x, const VMValue &y) const
+VMBox VM::sub(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<int>(x))
-    return get<int>(x) - get<int>(y);
+  if (x.is_int())
+    return int32_t(uint32_t(x.as_int()) - uint32_t(y.as_int()));
   else
-    return get<double>(x) - get<double>(y);
+    return x.as_double() - y.as_double();
 }
 
-VMValue VM::mul(const VMValue &x, const VMValue &y) const
+VMBox VM::mul(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<int>(x))
-    return get<int>(x) * get<int>(y);
+  if (x.is_int())
+    return int32_t(uint32_t(x.as_int()) * uint32_t(y.as_int()));
   else
-    return get<double>(x) * get<double>(y);
+    return x.as_double() * y.as_double();
 }
 
-VMValue VM::div(const VMValue &x, const VMValue &y) const
+VMBox VM::div(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<int>(x))
-    return get<int>(x) / get<int>(y);
+  if (x.is_int())
+    return y.as_int() == -1 ?
+      int32_t(0u - uint32_t(x.as_int())) : x.as_int() / y.as_int();
   else
-    return get<double>(x) / get<double>(y);
+    return x.as_double() / y.as_double();
 }
 
-VMValue VM::eq(const VMValue &x, const VMValue &y) const
+VMBox VM::eq(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<nullptr_t>(x) and not holds_alternative<nullptr_t>(y))
+  if (x.is_null() and not y.is_null())
     return false;
-  else if (not holds_alternative<nullptr_t>(x) and holds_alternative<nullptr_t>(y))
+  else if (not x.is_null() and y.is_null())
     return false;
-  else if (holds_alternative<nullptr_t>(x) and holds_alternative<nullptr_t>(y))
+  else if (x.is_null() and y.is_null())
     return true;
-  else if (holds_alternative<int>(x))
-    return get<int>(x) == get<int>(y);
-  else if (holds_alternative<double>(x))
-    return get<double>(x) == get<double>(y);
-  else if (holds_alternative<string>(x))
-    return get<string>(x) == get<string>(y);
+  else if (x.is_int())
+    return x.as_int() == y.as_int();
+  else if (x.is_double())
+    return x.as_double() == y.as_double();
+  else if (x.is_string())
+    return x.as_string() == y.as_string();
+  else if (x.is_ref())
+    return x.as_ref() == y.as_ref();
   else
-    return get<bool>(x) == get<bool>(y);
+    return x.as_bool() == y.as_bool();
 }
 
-VMValue VM::lt(const VMValue &x, const VMValue &y) const
+VMBox VM::lt(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<nullptr_t>(x) or holds_alternative<nullptr_t>(y))
+  if (x.is_null() or y.is_null())
     return false;
-  else if (holds_alternative<int>(x))
-    return get<int>(x) < get<int>(y);
-  else if (holds_alternative<double>(x))
-    return get<double>(x) < get<double>(y);
-  else if (holds_alternative<string>(x))
-    return get<string>(x) < get<string>(y);
+  else if (x.is_int())
+    return x.as_int() < y.as_int();
+  else if (x.is_double())
+    return x.as_double() < y.as_double();
+  else if (x.is_string())
+    return x.as_string() < y.as_string();
   else
     return nullptr;
 }
 
-VMValue VM::le(const VMValue &x, const VMValue &y) const
+VMBox VM::le(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<nullptr_t>(x) or holds_alternative<nullptr_t>(y))
+  if (x.is_null() or y.is_null())
     return false;
-  else if (holds_alternative<int>(x))
-    return get<int>(x) <= get<int>(y);
-  else if (holds_alternative<double>(x))
-    return get<double>(x) <= get<double>(y);
-  else if (holds_alternative<string>(x))
-    return get<string>(x) <= get<string>(y);
+  else if (x.is_int())
+    return x.as_int() <= y.as_int();
+  else if (x.is_double())
+    return x.as_double() <= y.as_double();
+  else if (x.is_string())
+    return x.as_string() <= y.as_string();
   else
     return nullptr;
 }
 
-VMValue VM::gt(const VMValue &x, const VMValue &y) const
+VMBox VM::gt(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<nullptr_t>(x) or holds_alternative<nullptr_t>(y))
+  if (x.is_null() or y.is_null())
     return false;
-  else if (holds_alternative<int>(x))
-    return get<int>(x) > get<int>(y);
-  else if (holds_alternative<double>(x))
-    return get<double>(x) > get<double>(y);
-  else if (holds_alternative<string>(x))
-    return get<string>(x) > get<string>(y);
+  else if (x.is_int())
+    return x.as_int() > y.as_int();
+  else if (x.is_double())
+    return x.as_double() > y.as_double();
+  else if (x.is_string())
+    return x.as_string() > y.as_string();
   else
     return nullptr;
 }
 
-VMValue VM::ge(const VMValue &x, const VMValue &y) const
+VMBox VM::ge(const VMBox &x, const VMBox &y) const
 {
-  if (holds_alternative<nullptr_t>(x) or holds_alternative<nullptr_t>(y))
+  if (x.is_null() or y.is_null())
     return false;
-  else if (holds_alternative<int>(x))
-    return get<int>(x) >= get<int>(y);
-  else if (holds_alternative<double>(x))
-    return get<double>(x) >= get<double>(y);
-  else if (holds_alternative<string>(x))
-    return get<string>(x) >= get<string>(y);
+  else if (x.is_int())
+    return x.as_int() >= y.as_int();
+  else if (x.is_double())
+    return x.as_double() >= y.as_double();
+  else if (x.is_string())
+    return x.as_string() >= y.as_string();
   else
     return nullptr;
 }
@@ -8,13 +8,16 @@
 #ifndef VM_H
 #define VM_H
 
-#include <memory>
+#include <chrono>
+#include <deque>
 #include <stack>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include "vm_instr.h"
+#include "vm_box.h"
 #include "vm_frame.h"
+#include "vm_heap.h"
 
 
 class VM
@@ -24,47 +27,217 @@ public:
   // add a new frame type to the vm
   void add(const VMFrameInfo& frame);
 
+  // add a struct type (for ALLOCS and ALLOCR), must be added before
+  // the frames that allocate it
+  void add_struct(const std::string& name, const std::vector<std::string>& fields);
+
+  // resolve calls to function indices (done by run() if needed)
+  void link();
+
   // run the virtual machine
   void run(bool DEBUG = false);
 
+  // set the maximum call depth (deeper calls are a stack overflow)
+  void set_max_call_depth(int depth);
+
+  // set the minimum number of bytes allocated between collections
+  void set_gc_threshold(std::size_t bytes);
+
+  // collect incrementally, interleaving collection slices of at most
+  // the given time with execution (0 for stop-the-world collections). A
+  // slice can overrun the budget by the time to trace 256 values and to
+  // scan the running frame's locals and operands.
+  void set_gc_slice_budget(std::chrono::microseconds budget);
+
+  // the number of live (allocated and not yet collected) heap objects
+  std::size_t live_object_count() const;
+
+  // the time of each garbage collection pause (whole collections, or
+  // slices of incremental collections)
+  const VMPauseHistogram& gc_pauses() const;
+
+  // the allocator of heap object fields and elements (for statistics)
+  const VMPool& heap_pool() const;
+
+  // count the instructions dispatched by run (for fusion reports)
+  void set_profiling(bool enabled);
+
+  // the number of dispatches of the (possibly fused) opcode in runs
+  // with profiling enabled
+  std::size_t dispatch_count(OpCode opcode) const;
+
   // to print the instructions for each VM frame
   friend std::string to_string(const VM& vm);
 
+  // to print which superinstructions were fused, how many times they
+  // ran, and how many dispatches they saved (in profiled runs)
+  friend std::string fusion_report(const VM& vm);
+
   
 private:
 
-  // heap for struct objects mapping oid's to field values
-  std::unordered_map<int, std::unordered_map<std::string, VMValue>> struct_heap;
+  // allocates the heap objects' fields and elements (declared before
+  // the heap, so it is destroyed after every object has been)
+  VMPool pool;
 
-  // heap for array objects
-  std::unordered_map<int, std::vector<VMValue>> array_heap;
+  // the object handle table (references are indexes into the table)
+  std::vector<VMObject> heap;
 
-  // next available object id 
-  int next_obj_id = 2023;
+  // first entry of the free list of unused handles (-1 if empty)
+  int free_handle = -1;
+
+  // bytes allocated since the last collection, and how many trigger
+  // the next one
+  std::size_t allocated_bytes = 0;
+  std::size_t gc_threshold = 1 << 20;
+  std::size_t min_gc_threshold = 1 << 20;
+
+  // the current garbage collection phase
+  enum class GCPhase {IDLE, MARK, SWEEP};
+  GCPhase gc_phase = GCPhase::IDLE;
+
+  // handles of marked objects whose references are not yet traced
+  std::vector<int> gray;
+
+  // how much of the value stack and the region stack marking has
+  // scanned (the value stack below the running frame's window only
+  // changes when a frame returns, which moves stack_scan back)
+  std::size_t stack_scan = 0;
+  std::size_t region_scan = 0;
+
+  // the next handle to sweep, and the bytes found live so far
+  int sweep_handle = 0;
+  std::size_t live_bytes = 0;
+
+  // maximum time of an incremental collection slice (0 if collections
+  // aren't incremental)
+  std::chrono::microseconds gc_slice_budget {0};
+
+  VMPauseHistogram gc_pause_histogram;
+
+  // every struct layout, starting with the empty layout of new objects
+  std::deque<VMStructLayout> struct_layouts {VMStructLayout()};
+
+  // the layout of each struct type (by type id), and the type ids
+  std::vector<VMStructLayout*> struct_types;
+  std::unordered_map<std::string, int> struct_ids;
 
   // collection of frame "templates" identified by function name
   std::unordered_map<std::string, VMFrameInfo> frame_info;
 
-  // VM function call stack
-  std::stack<std::shared_ptr<VMFrame>> call_stack;
+  // frame templates by function index (filled in by link)
+  std::vector<VMFrameInfo*> functions;
+
+  // true if every added frame has had its calls resolved
+  bool linked = false;
+
+  // constant pool referenced by encoded PUSH and field operands
+  std::vector<VMBox> constants;
+
+  // index of each (interned) string in the constant pool
+  std::unordered_map<std::string, int> string_constants;
+
+  // VM function call stack: a contiguous buffer of reusable frames, of
+  // which the first call_depth are active
+  std::vector<VMFrame> call_stack;
+  int call_depth = 0;
+
+  // VM value stack shared by all frames, each frame's window holds its
+  // locals followed by its operands
+  std::vector<VMBox> value_stack;
+
+  // handles of the objects allocated by ALLOCR in the active frames,
+  // freed when their frame returns
+  std::vector<int> region_stack;
+
+  // maximum number of active frames before a stack overflow error
+  int max_call_depth = 100000;
+
+  // dispatches of each opcode (counted only when profiling)
+  bool profiling = false;
+  std::vector<std::size_t> dispatches = std::vector<std::size_t>(256, 0);
+
+  // activate the next frame in the call stack for the given function,
+  // with its window starting at value stack index fp
+  VMFrame* push_frame(const VMFrameInfo* info, int fp);
+
+  // remove and return (by move) the top of the value stack
+  VMBox pop();
+
+  // add a new (null) field to the object, returning its slot
+  int add_field(VMObject& obj, const std::string& field);
+
+  // the layout with the given layout's fields followed by the field
+  VMStructLayout* next_layout(VMStructLayout* layout, const std::string& field);
+
+  // allocate a struct object, with the fields of the struct type if
+  // the type id isn't -1, returning its handle
+  int allocate_struct(int type_id);
+
+  // create a new heap object, returning its handle
+  int allocate(VMObjectKind kind);
+
+  // put the heap object on the free list
+  void free_object(int handle);
+
+  // the object x refers to, if x is a reference to an object of the
+  // given kind (otherwise an error)
+  VMObject& deref(const VMFrame& f, const VMBox& x, VMObjectKind kind);
+
+  // the array x refers to (of any array kind), otherwise an error
+  VMObject& deref_array(const VMFrame& f, const VMBox& x);
+
+  // called before allocating: runs a (whole or incremental) garbage
+  // collection once enough has been allocated, and continues an
+  // incremental collection in progress
+  void collect_garbage();
+
+  // the steps of a collection, which free every heap object not
+  // reachable from the value stack (which holds every frame's locals
+  // and operands). Marking scans the roots as it goes, and sweeping
+  // frees as it goes, both stopping at the deadline and returning true
+  // if they finished.
+  using Deadline = std::chrono::steady_clock::time_point;
+  void start_marking();
+  bool mark_step(Deadline deadline);
+  bool sweep_step(Deadline deadline);
+
+  // mark the object x refers to (if any) as reachable
+  void mark(const VMBox& x);
+
+  // called for each value x stored into a heap object, so an
+  // incremental collection's marking doesn't miss x
+  void write_barrier(const VMBox& x);
 
   // helper functions to report VM errors
   void error(std::string msg) const;
   void error(std::string msg, const VMFrame& f) const;
 
+  // helper function to print the VM state for DEBUG runs
+  void trace(const VMFrame& f) const;
+
+  // the frame's instruction at the index, printed as the VMInstr it was
+  // encoded from
+  std::string listing(const VMFrameInfo& frame, int pc) const;
+
+  // helper functions to translate instructions into the VMCode format
+  void encode(VMFrameInfo& frame);
+  void fuse(VMFrameInfo& frame);
+  int add_constant(const VMValue& value);
+
   // helper function to check for null values (throws mypl exception)
-  void ensure_not_null(const VMFrame& f, const VMValue& x) const;
+  void ensure_not_null(const VMFrame& f, const VMBox& x) const;
 
   // operation support helper functions
-  VMValue add(const VMValue& x, const VMValue& y) const;
-  VMValue sub(const VMValue& x, const VMValue& y) const;  
-  VMValue mul(const VMValue& x, const VMValue& y) const;  
-  VMValue div(const VMValue& x, const VMValue& y) const;    
-  VMValue lt(const VMValue& x, const VMValue& y) const;  
-  VMValue le(const VMValue& x, const VMValue& y) const;  
-  VMValue gt(const VMValue& x, const VMValue& y) const;  
-  VMValue ge(const VMValue& x, const VMValue& y) const;  
-  VMValue eq(const VMValue& x, const VMValue& y) const;  
+  VMBox add(const VMBox& x, const VMBox& y) const;
+  VMBox sub(const VMBox& x, const VMBox& y) const;  
+  VMBox mul(const VMBox& x, const VMBox& y) const;  
+  VMBox div(const VMBox& x, const VMBox& y) const;    
+  VMBox lt(const VMBox& x, const VMBox& y) const;  
+  VMBox le(const VMBox& x, const VMBox& y) const;  
+  VMBox gt(const VMBox& x, const VMBox& y) const;  
+  VMBox ge(const VMBox& x, const VMBox& y) const;  
+  VMBox eq(const VMBox& x, const VMBox& y) const;  
 
 };
 
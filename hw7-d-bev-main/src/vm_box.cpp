@@ -0,0 +1,76 @@
+//----------------------------------------------------------------------
+// FILE: vm_box.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: NaN-boxed VM value conversions
+//----------------------------------------------------------------------
+
+#include <mutex>
+#include "vm_box.h"
+
+using namespace std;
+
+
+namespace {
+
+  // guards the (single-threaded) payload pool, never destroyed either
+  mutex& pool_lock()
+  {
+    static mutex* lock = new mutex();
+    return *lock;
+  }
+
+}
+
+
+VMPool& VMString::pool()
+{
+  static VMPool* pool = new VMPool();
+  return *pool;
+}
+
+
+void* VMString::operator new(size_t size)
+{
+  lock_guard<mutex> guard(pool_lock());
+  return pool().allocate(size);
+}
+
+
+void VMString::operator delete(void* ptr, size_t size)
+{
+  lock_guard<mutex> guard(pool_lock());
+  pool().deallocate(ptr, size);
+}
+
+
+VMBox::VMBox(const VMValue& val)
+{
+  if (holds_alternative<int>(val))
+    *this = VMBox(get<int>(val));
+  else if (holds_alternative<double>(val))
+    *this = VMBox(get<double>(val));
+  else if (holds_alternative<bool>(val))
+    *this = VMBox(get<bool>(val));
+  else if (holds_alternative<string>(val))
+    *this = VMBox(get<string>(val));
+}
+
+
+string to_string(const VMBox& val)
+{
+  if (val.is_int())
+    return to_string(val.as_int());
+  else if (val.is_double())
+    return to_string(val.as_double());
+  else if (val.is_bool() and val.as_bool())
+    return "true";
+  else if (val.is_bool() and !val.as_bool())
+    return "false";
+  else if (val.is_string())
+    return val.as_string();
+  else if (val.is_ref())
+    return to_string(VMBox::FIRST_OID + val.as_ref());
+  else
+    return "null";
+}
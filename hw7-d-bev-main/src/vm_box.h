@@ -0,0 +1,172 @@
+//----------------------------------------------------------------------
+// FILE: vm_box.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: NaN-boxed (8-byte) runtime representation of VM values
+//----------------------------------------------------------------------
+
+#ifndef VM_BOX_H
+#define VM_BOX_H
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include "vm_instr.h"
+#include "vm_pool.h"
+
+
+// Out-of-line string payload of a boxed value. Strings are immutable
+// once boxed, so copies of a box share one payload (reference counted).
+class VMString
+{
+public:
+
+  std::string value;
+
+  std::size_t refs = 1;
+
+  // payloads are allocated from one process-wide pool (so a box can be
+  // freed on any thread, by any VM, at any time)
+  static void* operator new(std::size_t size);
+  static void operator delete(void* ptr, std::size_t size);
+
+  // the payload pool, shared by every thread (and never destroyed, so
+  // it outlives static and global boxes)
+  static VMPool& pool();
+
+};
+
+
+// A VMBox holds any VM value in a single 64-bit word. Doubles are
+// stored as their IEEE bit pattern. Every other type is stored in the
+// (otherwise unused) negative quiet NaN space: the top 14 bits are all
+// set, the next 3 bits are a type tag, and the low 47 bits hold the
+// payload (an int, a bool, a heap object handle, or a pointer to an
+// out-of-line string).
+// NaN doubles are canonicalized so they never collide with a tag.
+class VMBox
+{
+public:
+
+  // construct a null value
+  VMBox() = default;
+  VMBox(std::nullptr_t) {}
+
+  VMBox(int val) : bits(INT_TAG | static_cast<std::uint32_t>(val)) {}
+  VMBox(bool val) : bits(BOOL_TAG | static_cast<std::uint64_t>(val)) {}
+  VMBox(double val)
+    : bits(std::isnan(val) ? CANONICAL_NAN : std::bit_cast<std::uint64_t>(val))
+  {}
+
+  // strings are boxed as a pointer to a new shared payload
+  VMBox(std::string val)
+    : bits(STRING_TAG | to_payload(new VMString{std::move(val)}))
+  {}
+
+  // a reference to the heap object with the given handle
+  static VMBox ref(int handle)
+  {
+    VMBox box;
+    box.bits = REF_TAG | static_cast<std::uint32_t>(handle);
+    return box;
+  }
+
+  // convert from the instruction operand representation
+  explicit VMBox(const VMValue& val);
+
+  // copies share the string payload (no allocation)
+  VMBox(const VMBox& other) : bits(other.bits)
+  {
+    if (is_string())
+      ++payload()->refs;
+  }
+
+  VMBox(VMBox&& other) noexcept : bits(other.bits)
+  {
+    other.bits = NULL_TAG;
+  }
+
+  VMBox& operator=(const VMBox& other)
+  {
+    if (this != &other)
+      *this = VMBox(other);
+    return *this;
+  }
+
+  VMBox& operator=(VMBox&& other) noexcept
+  {
+    std::swap(bits, other.bits);
+    return *this;
+  }
+
+  ~VMBox()
+  {
+    if (is_string() and --payload()->refs == 0)
+      delete payload();
+  }
+
+  // type tests
+  bool is_null() const {return bits == NULL_TAG;}
+  bool is_int() const {return (bits & TAG_MASK) == INT_TAG;}
+  bool is_bool() const {return (bits & TAG_MASK) == BOOL_TAG;}
+  bool is_string() const {return (bits & TAG_MASK) == STRING_TAG;}
+  bool is_double() const {return (bits & BOXED) != BOXED;}
+  bool is_ref() const {return (bits & TAG_MASK) == REF_TAG;}
+
+  // true if both hold the same word (equal ints, bools, or references,
+  // or both null)
+  bool same(const VMBox& other) const {return bits == other.bits;}
+
+  // unchecked accessors (the caller must know the type)
+  int as_int() const {return static_cast<std::int32_t>(bits);}
+  bool as_bool() const {return bits & 1;}
+  double as_double() const {return std::bit_cast<double>(bits);}
+  const std::string& as_string() const {return payload()->value;}
+  int as_ref() const {return static_cast<std::int32_t>(bits);}
+
+  // references are written as object ids counting up from this one
+  static constexpr int FIRST_OID = 2023;
+
+  // the string's buffer if this box is its only reference (so it can
+  // be changed in place without anyone observing it), otherwise null
+  std::string* unique_string()
+  {
+    return payload()->refs == 1 ? &payload()->value : nullptr;
+  }
+
+private:
+
+  // all tagged (non-double) values have these bits set
+  static constexpr std::uint64_t BOXED = 0xFFFC000000000000;
+  static constexpr std::uint64_t TAG_MASK = 0xFFFF800000000000;
+  static constexpr std::uint64_t PAYLOAD_MASK = 0x00007FFFFFFFFFFF;
+  static constexpr std::uint64_t CANONICAL_NAN = 0x7FF8000000000000;
+
+  // the type tags
+  static constexpr std::uint64_t NULL_TAG = BOXED | (0ull << 47);
+  static constexpr std::uint64_t BOOL_TAG = BOXED | (1ull << 47);
+  static constexpr std::uint64_t INT_TAG = BOXED | (2ull << 47);
+  static constexpr std::uint64_t STRING_TAG = BOXED | (3ull << 47);
+  static constexpr std::uint64_t REF_TAG = BOXED | (4ull << 47);
+
+  static std::uint64_t to_payload(const void* ptr)
+  {
+    return reinterpret_cast<std::uintptr_t>(ptr) & PAYLOAD_MASK;
+  }
+
+  VMString* payload() const
+  {
+    return reinterpret_cast<VMString*>(bits & PAYLOAD_MASK);
+  }
+
+  std::uint64_t bits = NULL_TAG;
+
+};
+
+
+// function to get a string representation of a boxed value
+std::string to_string(const VMBox& val);
+
+
+#endif
@@ -9,7 +9,7 @@
 #ifndef VM_FRAME_H
 #define VM_FRAME_H
 
-#include <stack>
+#include <map>
 #include <string>
 #include <vector>
 #include "vm_instr.h"
@@ -28,9 +28,26 @@ public:
   // the number of parameters of the assocated function
   int arg_count; 
 
-  // the program instructions
+  // the program instructions (encoded, and then cleared, by the VM)
   std::vector<VMInstr> instructions;  
 
+  // the encoded instructions actually executed (set by the VM)
+  std::vector<VMCode> code;
+
+  // what the encoding leaves out, by instruction index (set by the VM):
+  // the instruction comments, and the names of called functions
+  std::map<int, std::string> comments;
+  std::map<int, std::string> calls;
+
+  // the number of local variable slots, including the parameters
+  int local_count = 0;
+
+  // where execution starts (after any prologue that CALL makes redundant)
+  int entry_pc = 0;
+
+  // true if CALL can leave the arguments in place as the first locals
+  bool args_in_place = true;
+
 };
 
 
@@ -38,17 +55,18 @@ class VMFrame
 {
 public:
 
-  // the type of the current frame
-  VMFrameInfo info;
+  // the type of the current frame (shared, owned by the VM)
+  const VMFrameInfo* info = nullptr;
   
   // the program counter
   int pc = 0;
 
-  // the internal memory of the function
-  std::vector<VMValue> variables;
+  // start of the frame's window in the VM value stack: its locals
+  // are at fp, fp+1, ..., and its operands follow the locals
+  int fp = 0;
 
-  // the operand stack
-  std::stack<VMValue> operand_stack;
+  // start of the frame's objects in the VM region stack
+  int region = 0;
 
 };
 
@@ -0,0 +1,64 @@
+//----------------------------------------------------------------------
+// FILE: vm_heap.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: VM heap object implementation
+//----------------------------------------------------------------------
+
+#include <bit>
+#include "vm_heap.h"
+
+using namespace std;
+
+
+int VMStructLayout::slot(const string& field) const
+{
+  // structs are small, so a linear scan beats hashing the name
+  for (int i = 0; i < fields.size(); ++i)
+    if (fields[i] == field)
+      return i;
+  return -1;
+}
+
+
+size_t VMObject::length() const
+{
+  switch (kind) {
+  case VMObjectKind::INT_ARRAY: return ints.size();
+  case VMObjectKind::DOUBLE_ARRAY: return doubles.size();
+  case VMObjectKind::BOOL_ARRAY: return bools.size();
+  default: return values.size();
+  }
+}
+
+
+size_t VMObject::bytes() const
+{
+  return sizeof(VMObject) + values.capacity() * sizeof(VMBox) +
+    ints.capacity() * sizeof(int32_t) + doubles.capacity() * sizeof(double) +
+    (bools.capacity() + present.capacity()) / 8;
+}
+
+
+void VMPauseHistogram::add(chrono::nanoseconds pause)
+{
+  auto us = chrono::duration_cast<chrono::microseconds>(pause).count();
+  size_t i = min<size_t>(bit_width(static_cast<uint64_t>(us)), buckets.size() - 1);
+  ++buckets[i];
+  ++pauses;
+  longest = std::max(longest, pause);
+}
+
+
+chrono::nanoseconds VMPauseHistogram::percentile(double p) const
+{
+  // the upper bound of the bucket holding the p-th percentile pause
+  size_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); ++i)
+  {
+    seen += buckets[i];
+    if (seen > 0 and seen >= p / 100 * pauses)
+      return std::min<chrono::nanoseconds>(chrono::microseconds(1ll << i), longest);
+  }
+  return longest;
+}
@@ -0,0 +1,124 @@
+//----------------------------------------------------------------------
+// FILE: vm_heap.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Representation of VM heap objects
+//----------------------------------------------------------------------
+
+#ifndef VM_HEAP_H
+#define VM_HEAP_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "vm_box.h"
+#include "vm_pool.h"
+
+
+// The field layout shared by all struct objects that were given the
+// same fields in the same order. Adding a field to an object moves it
+// to the successor layout for that field name, so every object built by
+// the same ALLOCS/ADDF sequence shares one layout and a field's slot
+// index is the position it was added in.
+class VMStructLayout
+{
+public:
+
+  // field names by slot index
+  std::vector<std::string> fields;
+
+  // successor layouts by added field name
+  std::unordered_map<std::string, VMStructLayout*> next;
+
+  // returns the slot of the field (or -1 if the field doesn't exist)
+  int slot(const std::string& field) const;
+
+};
+
+
+// The kinds of entries in the VM's object handle table
+// (all of the array kinds come last)
+enum class VMObjectKind : std::uint8_t {
+  FREE, STRUCT, ARRAY, INT_ARRAY, DOUBLE_ARRAY, BOOL_ARRAY
+};
+
+
+// A heap object (a struct or an array), identified by its index (its
+// handle) in the VM's object handle table
+class VMObject
+{
+public:
+
+  // the object's elements are allocated from the pool
+  explicit VMObject(VMPool* pool = nullptr)
+    : values(pool), ints(pool), doubles(pool), bools(pool), present(pool)
+  {}
+
+  VMObjectKind kind = VMObjectKind::FREE;
+
+  // field layout (structs only)
+  VMStructLayout* layout = nullptr;
+
+  // field values by slot (structs) or elements (untyped arrays)
+  VMPoolVector<VMBox> values;
+
+  // unboxed elements of typed (int, double, and bool) arrays, along with
+  // which elements are non-null (elements start null, and storing null
+  // leaves an element unchanged, so an element never goes back to null)
+  VMPoolVector<std::int32_t> ints;
+  VMPoolVector<double> doubles;
+  VMPoolVector<bool> bools;
+  VMPoolVector<bool> present;
+
+  // the next entry in the free list (free entries only)
+  int next_free = -1;
+
+  // reachable in the current garbage collection
+  bool marked = false;
+
+  bool is_array() const {return kind >= VMObjectKind::ARRAY;}
+
+  // the number of array elements
+  std::size_t length() const;
+
+  // (approximate) number of bytes the object uses
+  std::size_t bytes() const;
+
+};
+
+
+// Garbage collection pause times, counted in power-of-two microsecond
+// buckets
+class VMPauseHistogram
+{
+public:
+
+  // record a pause
+  void add(std::chrono::nanoseconds pause);
+
+  // the number of pauses recorded
+  std::size_t count() const {return pauses;}
+
+  // the longest pause recorded
+  std::chrono::nanoseconds max() const {return longest;}
+
+  // an upper bound on the given percentile (0-100) of pause times
+  std::chrono::nanoseconds percentile(double p) const;
+
+  // bucket 0 counts pauses under 1us, and bucket i > 0 counts pauses of
+  // at least 2^(i-1)us and under 2^i us
+  std::array<std::size_t, 32> buckets {};
+
+private:
+
+  std::size_t pauses = 0;
+
+  std::chrono::nanoseconds longest {0};
+
+};
+
+
+#endif
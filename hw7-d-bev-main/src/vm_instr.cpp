@@ -154,6 +154,150 @@ VMInstr VMInstr::CMPNE()
 }
 
 
+VMInstr VMInstr::ADDI()
+{
+  return VMInstr(OpCode::ADDI);
+}
+
+
+VMInstr VMInstr::SUBI()
+{
+  return VMInstr(OpCode::SUBI);
+}
+
+
+VMInstr VMInstr::MULI()
+{
+  return VMInstr(OpCode::MULI);
+}
+
+
+VMInstr VMInstr::DIVI()
+{
+  return VMInstr(OpCode::DIVI);
+}
+
+
+VMInstr VMInstr::ADDD()
+{
+  return VMInstr(OpCode::ADDD);
+}
+
+
+VMInstr VMInstr::SUBD()
+{
+  return VMInstr(OpCode::SUBD);
+}
+
+
+VMInstr VMInstr::MULD()
+{
+  return VMInstr(OpCode::MULD);
+}
+
+
+VMInstr VMInstr::DIVD()
+{
+  return VMInstr(OpCode::DIVD);
+}
+
+
+VMInstr VMInstr::CMPLTI()
+{
+  return VMInstr(OpCode::CMPLTI);
+}
+
+
+VMInstr VMInstr::CMPLEI()
+{
+  return VMInstr(OpCode::CMPLEI);
+}
+
+
+VMInstr VMInstr::CMPGTI()
+{
+  return VMInstr(OpCode::CMPGTI);
+}
+
+
+VMInstr VMInstr::CMPGEI()
+{
+  return VMInstr(OpCode::CMPGEI);
+}
+
+
+VMInstr VMInstr::CMPLTD()
+{
+  return VMInstr(OpCode::CMPLTD);
+}
+
+
+VMInstr VMInstr::CMPLED()
+{
+  return VMInstr(OpCode::CMPLED);
+}
+
+
+VMInstr VMInstr::CMPGTD()
+{
+  return VMInstr(OpCode::CMPGTD);
+}
+
+
+VMInstr VMInstr::CMPGED()
+{
+  return VMInstr(OpCode::CMPGED);
+}
+
+
+VMInstr VMInstr::CMPLTS()
+{
+  return VMInstr(OpCode::CMPLTS);
+}
+
+
+VMInstr VMInstr::CMPLES()
+{
+  return VMInstr(OpCode::CMPLES);
+}
+
+
+VMInstr VMInstr::CMPGTS()
+{
+  return VMInstr(OpCode::CMPGTS);
+}
+
+
+VMInstr VMInstr::CMPGES()
+{
+  return VMInstr(OpCode::CMPGES);
+}
+
+
+VMInstr VMInstr::CMPEQI()
+{
+  return VMInstr(OpCode::CMPEQI);
+}
+
+
+VMInstr VMInstr::CMPNEI()
+{
+  return VMInstr(OpCode::CMPNEI);
+}
+
+
+VMInstr VMInstr::CMPEQS()
+{
+  return VMInstr(OpCode::CMPEQS);
+}
+
+
+VMInstr VMInstr::CMPNES()
+{
+  return VMInstr(OpCode::CMPNES);
+}
+
+
 VMInstr VMInstr::JMP(int instruction_index)
 {
   return VMInstr(OpCode::JMP, instruction_index);
@@ -178,6 +322,12 @@ VMInstr VMInstr::RET()
 }
 
 
+VMInstr VMInstr::TAILCALL(const std::string& function)
+{
+  return VMInstr(OpCode::TAILCALL, function);
+}
+
+
 VMInstr VMInstr::WRITE()
 {
   return VMInstr(OpCode::WRITE);
@@ -238,12 +388,36 @@ VMInstr VMInstr::ALLOCS()
 }
 
 
+VMInstr VMInstr::ALLOCS(const string& struct_name)
+{
+  return VMInstr(OpCode::ALLOCS, struct_name);
+}
+
+
+VMInstr VMInstr::ALLOCR()
+{
+  return VMInstr(OpCode::ALLOCR);
+}
+
+
+VMInstr VMInstr::ALLOCR(const string& struct_name)
+{
+  return VMInstr(OpCode::ALLOCR, struct_name);
+}
+
+
 VMInstr VMInstr::ALLOCA()
 {
   return VMInstr(OpCode::ALLOCA);    
 }
 
 
+VMInstr VMInstr::ALLOCA(const string& element_type)
+{
+  return VMInstr(OpCode::ALLOCA, element_type);
+}
+
+
 VMInstr VMInstr::ADDF(const string& field)
 {
   return VMInstr(OpCode::ADDF, field);
@@ -262,6 +436,18 @@ VMInstr VMInstr::GETF(const string& field)
 }
 
 
+VMInstr VMInstr::SETF(int slot)
+{
+  return VMInstr(OpCode::SETF, slot);
+}
+
+
+VMInstr VMInstr::GETF(int slot)
+{
+  return VMInstr(OpCode::GETF, slot);
+}
+
+
 VMInstr VMInstr::SETI()
 {
   return VMInstr(OpCode::SETI);      
@@ -302,9 +488,9 @@ string to_string(const VMValue& val) {
 }
 
 
-std::string to_string(const VMInstr& instr)
+string to_string(OpCode opcode)
 {
-  std::unordered_map<OpCode, string> os = {
+  static const std::unordered_map<OpCode, string> os = {
     {OpCode::PUSH, "PUSH"}, {OpCode::POP, "POP"},
     {OpCode::LOAD, "LOAD"}, {OpCode::STORE, "STORE"},
     {OpCode::ADD, "ADD"}, {OpCode::SUB, "SUB"},
@@ -315,22 +501,43 @@ std::string to_string(const VMInstr& instr)
     {OpCode::CMPGE, "CMPGE"}, {OpCode::CMPEQ, "CMPEQ"}, 
     {OpCode::CMPNE, "CMPNE"}, {OpCode::JMP, "JMP"},
     {OpCode::JMPF, "JMPF"}, {OpCode::CALL, "CALL"},
-    {OpCode::RET, "RET"}, {OpCode::WRITE, "WRITE"},
+    {OpCode::RET, "RET"}, {OpCode::TAILCALL, "TAILCALL"},
+    {OpCode::WRITE, "WRITE"},
     {OpCode::READ, "READ"}, {OpCode::SLEN, "SLEN"},
     {OpCode::ALEN, "ALEN"}, {OpCode::GETC, "GETC"},
     {OpCode::TOINT, "TOINT"}, {OpCode::TODBL, "TODBL"},
     {OpCode::TOSTR, "TOSTR"}, {OpCode::CONCAT, "CONCAT"},
-    {OpCode::ALLOCS, "ALLOCS"}, {OpCode::ALLOCA, "ALLOCA"},
+    {OpCode::ADDI, "ADDI"}, {OpCode::SUBI, "SUBI"},
+    {OpCode::MULI, "MULI"}, {OpCode::DIVI, "DIVI"},
+    {OpCode::ADDD, "ADDD"}, {OpCode::SUBD, "SUBD"},
+    {OpCode::MULD, "MULD"}, {OpCode::DIVD, "DIVD"},
+    {OpCode::CMPLTI, "CMPLTI"}, {OpCode::CMPLEI, "CMPLEI"},
+    {OpCode::CMPGTI, "CMPGTI"}, {OpCode::CMPGEI, "CMPGEI"},
+    {OpCode::CMPLTD, "CMPLTD"}, {OpCode::CMPLED, "CMPLED"},
+    {OpCode::CMPGTD, "CMPGTD"}, {OpCode::CMPGED, "CMPGED"},
+    {OpCode::CMPLTS, "CMPLTS"}, {OpCode::CMPLES, "CMPLES"},
+    {OpCode::CMPGTS, "CMPGTS"}, {OpCode::CMPGES, "CMPGES"},
+    {OpCode::CMPEQI, "CMPEQI"}, {OpCode::CMPNEI, "CMPNEI"},
+    {OpCode::CMPEQS, "CMPEQS"}, {OpCode::CMPNES, "CMPNES"},
+    {OpCode::ALLOCS, "ALLOCS"}, {OpCode::ALLOCR, "ALLOCR"},
+    {OpCode::ALLOCA, "ALLOCA"},
     {OpCode::ADDF, "ADDF"}, {OpCode::GETF, "GETF"},
     {OpCode::SETF, "SETF"}, {OpCode::GETI, "GETI"},
     {OpCode::SETI, "SETI"}, {OpCode::DUP, "DUP"},
     {OpCode::NOP, "NOP"}
   };
+  auto name = os.find(opcode);
+  return name == os.end() ? "" : name->second;
+}
+
+
+std::string to_string(const VMInstr& instr)
+{
   string vstr = "";
   if (instr.operand().has_value()) {
     vstr = to_string(instr.operand().value());
   }
-  string s = os[instr.opcode()] + "(" + vstr + ")";
+  string s = to_string(instr.opcode()) + "(" + vstr + ")";
   if (instr.instr_comment != "")
     s += "  // " + instr.instr_comment;
   return s;
@@ -9,6 +9,7 @@
 #ifndef VM_INSTR_H
 #define VM_INSTR_H
 
+#include <cstdint>
 #include <variant>
 #include <optional>
 #include <string>
@@ -21,6 +22,9 @@ typedef std::variant<int, double, bool, std::string, std::nullptr_t> VMValue;
 // function to get a string representation of a vm_value
 std::string to_string(const VMValue& val);
 
+// function to get the name of an opcode (as instructions print it)
+std::string to_string(OpCode opcode);
+
 
 class VMInstr
 {
@@ -44,10 +48,35 @@ public:
   static VMInstr CMPGE();
   static VMInstr CMPEQ();
   static VMInstr CMPNE();
+  static VMInstr ADDI();
+  static VMInstr SUBI();
+  static VMInstr MULI();
+  static VMInstr DIVI();
+  static VMInstr ADDD();
+  static VMInstr SUBD();
+  static VMInstr MULD();
+  static VMInstr DIVD();
+  static VMInstr CMPLTI();
+  static VMInstr CMPLEI();
+  static VMInstr CMPGTI();
+  static VMInstr CMPGEI();
+  static VMInstr CMPLTD();
+  static VMInstr CMPLED();
+  static VMInstr CMPGTD();
+  static VMInstr CMPGED();
+  static VMInstr CMPLTS();
+  static VMInstr CMPLES();
+  static VMInstr CMPGTS();
+  static VMInstr CMPGES();
+  static VMInstr CMPEQI();
+  static VMInstr CMPNEI();
+  static VMInstr CMPEQS();
+  static VMInstr CMPNES();
   static VMInstr JMP(int instruction_index);
   static VMInstr JMPF(int instruction_index);
   static VMInstr CALL(const std::string& function);
   static VMInstr RET();
+  static VMInstr TAILCALL(const std::string& function);
   static VMInstr WRITE();
   static VMInstr READ();
   static VMInstr SLEN();
@@ -58,10 +87,16 @@ public:
   static VMInstr TOSTR();
   static VMInstr CONCAT();
   static VMInstr ALLOCS();
+  static VMInstr ALLOCS(const std::string& struct_name);
+  static VMInstr ALLOCR();
+  static VMInstr ALLOCR(const std::string& struct_name);
   static VMInstr ALLOCA();
+  static VMInstr ALLOCA(const std::string& element_type);
   static VMInstr ADDF(const std::string& field);
   static VMInstr SETF(const std::string& field);
   static VMInstr GETF(const std::string& field);
+  static VMInstr SETF(int slot);
+  static VMInstr GETF(int slot);
   static VMInstr SETI();
   static VMInstr GETI();  
   static VMInstr DUP();
@@ -105,4 +140,18 @@ private:
 };
 
 
+// The compact, pre-decoded form of an instruction that the VM executes
+// (see VM::add). Operands are inline 32-bit immediates: a variable
+// index, a jump target, or an index into the VM's constant pool.
+class VMCode
+{
+public:
+
+  OpCode opcode;
+
+  std::int32_t operand = 0;
+
+};
+
+
 #endif
@@ -0,0 +1,90 @@
+//----------------------------------------------------------------------
+// FILE: vm_pool.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Size-class pool allocator implementation
+//----------------------------------------------------------------------
+
+#include <bit>
+#include "vm_pool.h"
+
+using namespace std;
+
+
+VMPool::VMPool()
+{
+  for (size_t i = 0; i < classes.size(); ++i)
+    classes[i].block_size = size_t(16) << i;
+}
+
+
+VMPool::~VMPool()
+{
+  for (void* chunk : chunks)
+    ::operator delete(chunk);
+}
+
+
+void* VMPool::allocate(size_t bytes)
+{
+  // class i holds blocks of 16 * 2^i bytes
+  size_t i = bytes <= 16 ? 0 : bit_width(bytes - 1) - 4;
+  if (i >= classes.size())
+  {
+    ++large_count;
+    ++large_live_count;
+    return ::operator new(bytes);
+  }
+  SizeClass& size_class = classes[i];
+  if (size_class.free == nullptr)
+    refill(size_class);
+  void* block = size_class.free;
+  size_class.free = *static_cast<void**>(block);
+  ++size_class.allocations;
+  ++size_class.live;
+  return block;
+}
+
+
+void VMPool::deallocate(void* ptr, size_t bytes)
+{
+  size_t i = bytes <= 16 ? 0 : bit_width(bytes - 1) - 4;
+  if (i >= classes.size())
+  {
+    --large_live_count;
+    ::operator delete(ptr);
+    return;
+  }
+  SizeClass& size_class = classes[i];
+  *static_cast<void**>(ptr) = size_class.free;
+  size_class.free = ptr;
+  --size_class.live;
+}
+
+
+void VMPool::refill(SizeClass& size_class)
+{
+  char* chunk = static_cast<char*>(::operator new(CHUNK_SIZE));
+  chunks.push_back(chunk);
+  ++size_class.chunks;
+  // thread the chunk's blocks onto the free list
+  for (size_t offset = 0; offset < CHUNK_SIZE; offset += size_class.block_size)
+  {
+    void* block = chunk + offset;
+    *static_cast<void**>(block) = size_class.free;
+    size_class.free = block;
+  }
+}
+
+
+string to_string(const VMPool& pool)
+{
+  string str = "";
+  for (const VMPool::SizeClass& c : pool.classes)
+    str += "size " + to_string(c.block_size) + ": " +
+      to_string(c.allocations) + " allocations, " + to_string(c.live) +
+      " live, " + to_string(c.chunks) + " chunks\n";
+  str += "large: " + to_string(pool.large_count) + " allocations, " +
+    to_string(pool.large_live_count) + " live\n";
+  return str;
+}
@@ -0,0 +1,118 @@
+//----------------------------------------------------------------------
+// FILE: vm_pool.h
+// DATE: CPSC 326, Spring 2023
+// AUTH: Dominic Bevilacqua
+// DESC: Size-class pool allocator for VM heap memory
+//----------------------------------------------------------------------
+
+#ifndef VM_POOL_H
+#define VM_POOL_H
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <vector>
+
+
+// A single-threaded allocator that hands out blocks from power-of-two
+// size classes (16 to 4096 bytes). Each class keeps a free list of
+// blocks carved from 64KB chunks. Larger requests go to operator new.
+// Every chunk is released at once when the pool is destroyed.
+class VMPool
+{
+public:
+
+  // per size class statistics
+  class SizeClass
+  {
+  public:
+    std::size_t block_size = 0;
+    std::size_t allocations = 0;  // total blocks handed out
+    std::size_t live = 0;         // blocks currently in use
+    std::size_t chunks = 0;       // chunks carved into blocks
+    void* free = nullptr;         // free list of unused blocks
+  };
+
+  VMPool();
+  VMPool(const VMPool&) = delete;
+  VMPool& operator=(const VMPool&) = delete;
+  ~VMPool();
+
+  // allocate (and free) a block of at least the given size
+  void* allocate(std::size_t bytes);
+  void deallocate(void* ptr, std::size_t bytes);
+
+  // statistics for each size class, smallest first
+  const std::array<SizeClass, 9>& size_classes() const {return classes;}
+
+  // requests too large for any size class
+  std::size_t large_allocations() const {return large_count;}
+  std::size_t large_live() const {return large_live_count;}
+
+  // pretty print the statistics
+  friend std::string to_string(const VMPool& pool);
+
+private:
+
+  static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+  std::array<SizeClass, 9> classes;
+
+  std::vector<void*> chunks;
+
+  std::size_t large_count = 0;
+  std::size_t large_live_count = 0;
+
+  // add a new chunk of blocks to the size class's free list
+  void refill(SizeClass& size_class);
+
+};
+
+
+// An STL allocator drawing from a VMPool (or from operator new if the
+// pool is null)
+template<typename T>
+class VMPoolAllocator
+{
+public:
+
+  using value_type = T;
+
+  VMPoolAllocator(VMPool* pool = nullptr) : pool(pool) {}
+
+  template<typename U>
+  VMPoolAllocator(const VMPoolAllocator<U>& other) : pool(other.pool) {}
+
+  T* allocate(std::size_t n)
+  {
+    if (pool == nullptr)
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    return static_cast<T*>(pool->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, std::size_t n)
+  {
+    if (pool == nullptr)
+      ::operator delete(ptr);
+    else
+      pool->deallocate(ptr, n * sizeof(T));
+  }
+
+  template<typename U>
+  bool operator==(const VMPoolAllocator<U>& other) const
+  {
+    return pool == other.pool;
+  }
+
+  VMPool* pool;
+
+};
+
+
+// a vector whose elements are allocated from a VMPool
+template<typename T>
+using VMPoolVector = std::vector<T, VMPoolAllocator<T>>;
+
+
+#endif
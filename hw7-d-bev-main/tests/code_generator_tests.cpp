@@ -16,6 +16,8 @@
 #include "ast_parser.h"
 #include "vm.h"
 #include "code_generator.h"
+#include "semantic_checker.h"
+#include "constant_folder.h"
 
 using namespace std;
 
@@ -742,6 +744,395 @@ TEST(BasicCodeGenTest, BasicElseIf) {
   restore_cout();
 }
 
+TEST(BasicCodeGenTest, NestedIfsWithoutJumpScaffolding) {
+  stringstream in(build_string({
+        "int sign(int x) {",
+        "  if (x < 0) {",
+        "    return 0 - 1",
+        "  }",
+        "  else {",
+        "    if (x == 0) {",
+        "      return 0",
+        "    }",
+        "  }",
+        "  return 1",
+        "}",
+        "void main() {",
+        "  int i = 0 - 2",
+        "  while (i < 3) {",
+        "    if (sign(i) < 0) {",
+        "      print('-')",
+        "    }",
+        "    elseif (sign(i) > 0) {",
+        "      print('+')",
+        "    }",
+        "    i = i + 1",
+        "  }",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("--++", out.str());
+  restore_cout();
+  EXPECT_EQ(string::npos, to_string(vm).find("NOP"));
+}
+
+TEST(BasicCodeGenTest, ShortCircuitAndOr) {
+  stringstream in(build_string({
+        "bool f(int x) {",
+        "  print(x)",
+        "  return true",
+        "}",
+        "void main() {",
+        "  bool b = false and f(1)",
+        "  print(b)",
+        "  b = true or f(2)",
+        "  print(b)",
+        "  b = true and f(3)",
+        "  print(b)",
+        "  b = not true or f(4)",
+        "  print(b)",
+        "  if (false or (false and f(5))) {",
+        "    print('x')",
+        "  }",
+        "  elseif (true and (not false and f(6))) {",
+        "    print('y')",
+        "  }",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("falsetrue3true4true6y", out.str());
+  restore_cout();
+}
+
+TEST(BasicCodeGenTest, InlineSmallFunctions) {
+  string program = build_string({
+        "struct Pair {int x, int y}",
+        "int first(Pair p) {return p.x}",
+        "bool less(int a, int b) {return a < b}",
+        "int fac(int n) {",
+        "  if (n <= 1) {return 1}",
+        "  return n * fac(n - 1)",
+        "}",
+        "void show(int n) {",
+        "  print(n)",
+        "  print(' ')",
+        "}",
+        "void main() {",
+        "  Pair p = new Pair",
+        "  p.x = 3",
+        "  for (int i = 0; less(i, first(p)); i = i + 1) {",
+        "    show(fac(i + 1))",
+        "  }",
+        "}"
+      });
+  for (int threshold : {0, 16}) {
+    stringstream in(program);
+    VM vm;
+    CodeGenerator generator(vm);
+    generator.set_inline_threshold(threshold);
+    ASTParser(Lexer(in)).parse().accept(generator);
+    stringstream out;
+    change_cout(out);
+    vm.run();
+    restore_cout();
+    EXPECT_EQ("1 2 6 ", out.str());
+    string main_code = to_string(vm);
+    main_code = main_code.substr(main_code.find("Frame 'main'"));
+    main_code = main_code.substr(0, main_code.find("Frame", 1));
+    EXPECT_NE(string::npos, main_code.find("CALL(fac)"));
+    EXPECT_EQ(threshold == 0, main_code.find("CALL(less)") != string::npos);
+    EXPECT_EQ(threshold == 0, main_code.find("CALL(first)") != string::npos);
+    EXPECT_EQ(threshold == 0, main_code.find("CALL(show)") != string::npos);
+  }
+}
+
+TEST(BasicCodeGenTest, TailRecursiveListWalk) {
+  stringstream in(build_string({
+        "struct Node {int val, Node next}",
+        "int total(Node n, int acc) {",
+        "  if (n == null) {return acc}",
+        "  return total(n.next, acc + n.val)",
+        "}",
+        "void main() {",
+        "  Node head = null",
+        "  for (int i = 1; i <= 10000; i = i + 1) {",
+        "    Node n = new Node",
+        "    n.val = i",
+        "    n.next = head",
+        "    head = n",
+        "  }",
+        "  print(total(head, 0))",
+        "}"
+      }));
+  VM vm;
+  vm.set_max_call_depth(10);
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("50005000", out.str());
+  restore_cout();
+  EXPECT_NE(string::npos, to_string(vm).find("TAILCALL(total)"));
+}
+
+TEST(BasicCodeGenTest, ConstantFoldingKeepsResults) {
+  string program = build_string({
+        "void main() {",
+        "  int day = 60 * 60 * 24",
+        "  print(day)",
+        "  print(' ')",
+        "  print(10 - 3 - 2)",
+        "  print(' ')",
+        "  print((0 - 7) / 2)",
+        "  print(' ')",
+        "  print(1.5 * 2.25 / 0.5)",
+        "  print(' ')",
+        "  print(\"abc\" == \"abc\")",
+        "  print(' ')",
+        "  print('a' < 'b' and not (2.5 >= 3.0))",
+        "  print(' ')",
+        "  print(null == null)",
+        "  int n = 3",
+        "  string s = \"\\n\"",
+        "  for (int i = 0; i < n; i = i + 1) {",
+        "    print(i * n)",
+        "  }",
+        "  if (n > 5) {",
+        "    print('x')",
+        "  }",
+        "  elseif (n == 3) {",
+        "    print(s)",
+        "  }",
+        "  while (n < 0) {",
+        "    print('z')",
+        "  }",
+        "}"
+      });
+  for (bool fold : {false, true}) {
+    stringstream in(program);
+    Program p = ASTParser(Lexer(in)).parse();
+    if (fold) {
+      ConstantFolder folder;
+      p.accept(folder);
+    }
+    VM vm;
+    CodeGenerator generator(vm);
+    p.accept(generator);
+    stringstream out;
+    change_cout(out);
+    vm.run();
+    restore_cout();
+    EXPECT_EQ("86400 9 -3 6.750000 true true true036\n", out.str());
+    if (fold) {
+      string code = to_string(vm);
+      EXPECT_EQ(string::npos, code.find("PUSH(60)"));
+      EXPECT_EQ(string::npos, code.find("CMPEQ"));
+      EXPECT_EQ(string::npos, code.find("PUSH(z)"));
+      EXPECT_NE(string::npos, code.find("PUSH(86400)"));
+    }
+  }
+}
+
+TEST(BasicCodeGenTest, LoopInvariantsHoisted) {
+  stringstream in(build_string({
+        "struct Box {int n, array int xs, Box next, int val}",
+        "int sum(Box b, Box c) {",
+        "  int total = 0",
+        "  for (int i = 0; i < b.n; i = i + 1) {",
+        "    total = total + b.next.val * b.xs[i]",
+        "    if (c != null) {",
+        "      total = total + c.val",
+        "    }",
+        "  }",
+        "  while (total < 0) {",
+        "    total = total + c.next.val",
+        "  }",
+        "  int k = 0",
+        "  while (k < 3) {",
+        "    b.next.val = b.next.val + 1",
+        "    total = total + b.next.val",
+        "    k = k + 1",
+        "  }",
+        "  return total",
+        "}",
+        "void main() {",
+        "  Box b = new Box",
+        "  b.n = 4",
+        "  b.xs = new int[4]",
+        "  for (int i = 0; i < 4; i = i + 1) {",
+        "    b.xs[i] = i + 1",
+        "  }",
+        "  b.next = new Box",
+        "  b.next.val = 2",
+        "  print(sum(b, null))",
+        "}"
+      }));
+  VM vm;
+  vm.set_profiling(true);
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  // the first loop's b.n, b.xs, and b.next.val are loaded once (c.val
+  // and c.next.val, that may not be evaluated, and b.next.val, that the
+  // last loop writes, aren't), and the repeated loads of b.n and
+  // b.next reuse the first
+  EXPECT_EQ("32", out.str());
+  EXPECT_EQ(18, vm.dispatch_count(OpCode::GETF_SLOT));
+}
+
+TEST(BasicCodeGenTest, RepeatedPathLoadsReused) {
+  stringstream in(build_string({
+        "struct Node {int value, Node left, Node right}",
+        "void bump(Node n) {",
+        "  n.value = n.value + 1",
+        "}",
+        "int sum(Node root) {",
+        "  int x = root.left.value + root.left.right.value",
+        "  root.left.value = 10",
+        "  int y = root.left.value",
+        "  if (root.left.left == null) {",
+        "    y = y + root.left.right.value",
+        "  }",
+        "  bump(root.left)",
+        "  return x + y + root.left.value",
+        "}",
+        "void main() {",
+        "  Node root = new Node",
+        "  root.left = new Node",
+        "  root.left.value = 1",
+        "  root.left.right = new Node",
+        "  root.left.right.value = 2",
+        "  print(sum(root))",
+        "}"
+      }));
+  VM vm;
+  vm.set_profiling(true);
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("26", out.str());
+  // root.left and root.left.right are each loaded once per function
+  // (the SETFs of value don't change them), where without reuse there
+  // are 21 loads
+  EXPECT_EQ(11, vm.dispatch_count(OpCode::GETF_SLOT));
+}
+
+TEST(BasicCodeGenTest, CheckedProgramsUseTypedOps) {
+  stringstream in(build_string({
+        "void main() {",
+        "  int t = 0",
+        "  double d = 0.0",
+        "  for (int i = 0; i < 10; i = i + 1) {",
+        "    t = t + (i * 2)",
+        "    d = d + 0.5",
+        "  }",
+        "  print(t)",
+        "  print(' ')",
+        "  print(d)",
+        "}"
+      }));
+  Program p = ASTParser(Lexer(in)).parse();
+  SemanticChecker checker;
+  p.accept(checker);
+  ConstantFolder folder;
+  p.accept(folder);
+  VM vm;
+  vm.set_profiling(true);
+  CodeGenerator generator(vm);
+  p.accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("90 5.000000", out.str());
+  // the checker's types select the typed ops (the loop test is fused
+  // with its jump)
+  EXPECT_EQ(0, vm.dispatch_count(OpCode::ADD));
+  EXPECT_EQ(0, vm.dispatch_count(OpCode::MUL));
+  EXPECT_EQ(0, vm.dispatch_count(OpCode::CMPLT));
+  EXPECT_EQ(10, vm.dispatch_count(OpCode::MULI));
+  EXPECT_EQ(10, vm.dispatch_count(OpCode::ADDI));
+  EXPECT_EQ(10, vm.dispatch_count(OpCode::ADDD));
+  EXPECT_EQ(11, vm.dispatch_count(OpCode::CMPLTI_JMPF));
+}
+
+TEST(BasicCodeGenTest, ConstantsPropagatedThroughLoops) {
+  stringstream in(build_string({
+        "void main() {",
+        "  int k = 3",
+        "  int s = 0",
+        "  int i = 0",
+        "  while (i < 4) {",
+        "    if (k > 2) {",
+        "      s = s + i",
+        "    }",
+        "    else {",
+        "      s = s - 100",
+        "    }",
+        "    k = 3",
+        "    i = i + 1",
+        "  }",
+        "  print(s)",
+        "}"
+      }));
+  VM vm;
+  vm.set_profiling(true);
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("6", out.str());
+  // k is 3 on every path into the loop, so its test is removed
+  EXPECT_EQ(0, vm.dispatch_count(OpCode::CMPGT));
+  EXPECT_NE(string::npos, pass_report(generator.pass_manager()).find("sccp"));
+}
+
+TEST(BasicCodeGenTest, RepeatedValuesNumbered) {
+  stringstream in(build_string({
+        "int f(int a, int b) {",
+        "  int s = 0",
+        "  for (int i = 0; i < 3; i = i + 1) {",
+        "    s = s + ((a * b) + (a * b))",
+        "  }",
+        "  return s",
+        "}",
+        "void main() {",
+        "  print(f(3, 4))",
+        "}"
+      }));
+  VM vm;
+  vm.set_profiling(true);
+  CodeGenerator generator(vm);
+  generator.set_inline_threshold(0);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("72", out.str());
+  // the second a * b of each iteration reuses the first
+  EXPECT_EQ(3, vm.dispatch_count(OpCode::MUL));
+}
+
 //----------------------------------------------------------------------
 // Function calls
 //----------------------------------------------------------------------
@@ -1051,6 +1442,115 @@ TEST(BasicCodeGenTest, StructsAsParams) {
   restore_cout();
 }
 
+TEST(BasicCodeGenTest, NonEscapingStructFieldsAreLocals) {
+  stringstream in(build_string({
+        "struct Pair {int x, int y}",
+        "int sum(int a, int b) {",
+        "  Pair p = new Pair",
+        "  p.x = a",
+        "  p.y = b",
+        "  return p.x + p.y",
+        "}",
+        "void main() {",
+        "  print(sum(3, 4))",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("7", out.str());
+  restore_cout();
+  EXPECT_EQ(0, vm.live_object_count());
+}
+
+TEST(BasicCodeGenTest, StructsPassedToCalleesFreedOnReturn) {
+  stringstream in(build_string({
+        "struct Node {int val, Node next}",
+        "int val(Node n) {return n.val}",
+        "int twice(int x) {",
+        "  Node r = new Node",
+        "  r.val = x",
+        "  return val(r) + val(r)",
+        "}",
+        "void main() {",
+        "  print(twice(21))",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("42", out.str());
+  restore_cout();
+  EXPECT_EQ(0, vm.live_object_count());
+}
+
+TEST(BasicCodeGenTest, NonEscapingStructFieldsInLoopsAreLocals) {
+  stringstream in(build_string({
+        "struct Pair {int x, int y}",
+        "void main() {",
+        "  int t = 0",
+        "  for (int i = 0; i < 1000; i = i + 1) {",
+        "    Pair p = new Pair",
+        "    p.x = i",
+        "    p.y = 1",
+        "    t = t + p.y",
+        "  }",
+        "  print(t)",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("1000", out.str());
+  restore_cout();
+  EXPECT_EQ(0, vm.live_object_count());
+}
+
+TEST(BasicCodeGenTest, StructsPassedToCalleesInLoopsCollected) {
+  stringstream in(build_string({
+        "struct Pair {int x, int y}",
+        "int sum(Pair p) {",
+        "  if (p.x < 0) {",
+        "    return 0",
+        "  }",
+        "  return p.y",
+        "}",
+        "void main() {",
+        "  int t = 0",
+        "  for (int i = 0; i < 1000; i = i + 1) {",
+        "    Pair q = new Pair",
+        "    q.x = i",
+        "    q.y = 1",
+        "    t = t + sum(q)",
+        "  }",
+        "  print(t)",
+        "  array int xs = new int[1]",
+        "  print(xs[t])",
+        "}"
+      }));
+  VM vm;
+  vm.set_gc_threshold(1024);
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  // (the out of bounds error stops main before it returns, so only
+  // what the collector freed in the loop is gone)
+  EXPECT_THROW(vm.run(), MyPLException);
+  restore_cout();
+  EXPECT_EQ("1000", out.str());
+  EXPECT_LT(vm.live_object_count(), 100);
+}
+
 
 //----------------------------------------------------------------------
 // Arrays
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <gtest/gtest.h>
 #include "mypl_exception.h"
 #include "vm_frame.h"
@@ -790,6 +791,129 @@ TEST(BasicVMTest, NullLessEqualSecondOperand) {
   restore_cout();
 }
 
+TEST(BasicVMTest, TypedIntArithmeticAndCompare) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(7));
+  main.instructions.push_back(VMInstr::PUSH(3));
+  main.instructions.push_back(VMInstr::SUBI());
+  main.instructions.push_back(VMInstr::PUSH(2));
+  main.instructions.push_back(VMInstr::MULI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::PUSH(2));
+  main.instructions.push_back(VMInstr::CMPLTI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(2.5));
+  main.instructions.push_back(VMInstr::PUSH(1.25));
+  main.instructions.push_back(VMInstr::CMPGED());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH("ab"));
+  main.instructions.push_back(VMInstr::PUSH("ab"));
+  main.instructions.push_back(VMInstr::CMPEQS());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::PUSH(3));
+  main.instructions.push_back(VMInstr::CMPNEI());
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("8truetruetruetrue", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, NullTypedAddOperand) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::ADDI());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: null reference ";
+    msg += "(in main at 2: ADDI())";
+    EXPECT_EQ(msg, err);
+  }
+  restore_cout();
+}
+
+TEST(BasicVMTest, TypedIntArithmeticWraps) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(2147483647));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADDI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(" "));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(-2147483647));
+  main.instructions.push_back(VMInstr::PUSH(2));
+  main.instructions.push_back(VMInstr::SUBI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(" "));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(65536));
+  main.instructions.push_back(VMInstr::PUSH(65536));
+  main.instructions.push_back(VMInstr::MULI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(" "));
+  main.instructions.push_back(VMInstr::WRITE());
+  // fused into LOAD_PUSH_ADDI_STORE
+  main.instructions.push_back(VMInstr::PUSH(2147483647));
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADDI());
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("-2147483648 2147483647 0 -2147483648", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, IntDivisionByMinusOneWraps) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(-2147483647));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::SUBI());
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(-1));
+  main.instructions.push_back(VMInstr::DIVI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(" "));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(-1));
+  main.instructions.push_back(VMInstr::DIV());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(" "));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(7));
+  main.instructions.push_back(VMInstr::PUSH(-1));
+  main.instructions.push_back(VMInstr::DIVI());
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("-2147483648 -2147483648 -7", out.str());
+  restore_cout();
+}
+
 TEST(BasicVMTest, IntGreaterThan) {
   VMFrameInfo main {"main", 0};
   main.instructions.push_back(VMInstr::PUSH(2));
@@ -1268,6 +1392,56 @@ TEST(BasicVMTest, JumpFalseNoJump) {
   restore_cout();
 }
 
+TEST(BasicVMTest, NullJumpFalse) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::JMPF(4));
+  main.instructions.push_back(VMInstr::PUSH("blue"));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH("green"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: null reference ";
+    msg += "(in main at 1: JMPF(4))";
+    EXPECT_EQ(msg, err);
+  }
+  EXPECT_EQ("", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, NullFusedCompareJumpFalse) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::PUSH(3));
+  main.instructions.push_back(VMInstr::CMPLTI());
+  main.instructions.push_back(VMInstr::JMPF(5));
+  main.instructions.push_back(VMInstr::PUSH("blue"));
+  main.instructions.push_back(VMInstr::PUSH("green"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: null reference ";
+    msg += "(in main at 2: CMPLTI())";
+    EXPECT_EQ(msg, err);
+  }
+  restore_cout();
+}
+
 TEST(BasicVMTest, JumpBackwards) {
   VMFrameInfo main {"main", 0};
   main.instructions.push_back(VMInstr::PUSH(0));       // 0
@@ -1296,6 +1470,140 @@ TEST(BasicVMTest, JumpBackwards) {
   restore_cout();
 }
 
+TEST(BasicVMTest, FusedTypedLoop) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(0));       // 0
+  main.instructions.push_back(VMInstr::STORE(0));      // 1
+  main.instructions.push_back(VMInstr::LOAD(0));       // 2
+  main.instructions.push_back(VMInstr::PUSH(3));       // 3
+  main.instructions.push_back(VMInstr::CMPLTI());      // 4
+  main.instructions.push_back(VMInstr::JMPF(13));      // 5
+  main.instructions.push_back(VMInstr::PUSH("blue"));  // 6
+  main.instructions.push_back(VMInstr::WRITE());       // 7
+  main.instructions.push_back(VMInstr::LOAD(0));       // 8
+  main.instructions.push_back(VMInstr::PUSH(1));       // 9
+  main.instructions.push_back(VMInstr::ADDI());        // 10
+  main.instructions.push_back(VMInstr::STORE(0));      // 11
+  main.instructions.push_back(VMInstr::JMP(2));        // 12
+  main.instructions.push_back(VMInstr::LOAD(0));       // 13
+  main.instructions.push_back(VMInstr::WRITE());       // 14
+  VM vm;
+  vm.set_profiling(true);
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("blueblueblue3", out.str());
+  restore_cout();
+  EXPECT_EQ(4, vm.dispatch_count(OpCode::LOAD_PUSH));
+  EXPECT_EQ(4, vm.dispatch_count(OpCode::CMPLTI_JMPF));
+  EXPECT_EQ(3, vm.dispatch_count(OpCode::PUSH_WRITE));
+  EXPECT_EQ(3, vm.dispatch_count(OpCode::LOAD_PUSH_ADDI_STORE));
+  EXPECT_EQ(0, vm.dispatch_count(OpCode::ADDI));
+  EXPECT_NE(string::npos, fusion_report(vm).find("LOAD_PUSH_ADDI_STORE"));
+}
+
+TEST(BasicVMTest, FusedIncrementNullError) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADDI());
+  main.instructions.push_back(VMInstr::STORE(0));
+  VM vm;
+  vm.add(main);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    EXPECT_EQ("VM Error: null reference (in main at 4: ADDI())", err);
+  }
+}
+
+TEST(BasicVMTest, DispatchRunsEachExecutedInstruction) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(0));       // 0
+  main.instructions.push_back(VMInstr::STORE(0));      // 1
+  main.instructions.push_back(VMInstr::LOAD(0));       // 2
+  main.instructions.push_back(VMInstr::PUSH(3));       // 3
+  main.instructions.push_back(VMInstr::CMPLT());       // 4
+  main.instructions.push_back(VMInstr::JMPF(12));      // 5
+  main.instructions.push_back(VMInstr::LOAD(0));       // 6
+  main.instructions.push_back(VMInstr::PUSH(1));       // 7
+  main.instructions.push_back(VMInstr::ADD());         // 8
+  main.instructions.push_back(VMInstr::STORE(0));      // 9
+  main.instructions.push_back(VMInstr::NOP());         // 10
+  main.instructions.push_back(VMInstr::JMP(2));        // 11
+  main.instructions.push_back(VMInstr::LOAD(0));       // 12
+  main.instructions.push_back(VMInstr::WRITE());       // 13
+  main.instructions.push_back(VMInstr::PUSH(0));       // 14
+  main.instructions.push_back(VMInstr::RET());         // 15
+  main.instructions.push_back(VMInstr::PUSH("blue"));  // 16
+  main.instructions.push_back(VMInstr::WRITE());       // 17
+  VM vm;
+  vm.set_profiling(true);
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("3", out.str());
+  restore_cout();
+  EXPECT_EQ(4, vm.dispatch_count(OpCode::CMPLT));
+  EXPECT_EQ(4, vm.dispatch_count(OpCode::JMPF));
+  EXPECT_EQ(3, vm.dispatch_count(OpCode::ADD));
+  EXPECT_EQ(3, vm.dispatch_count(OpCode::NOP));
+  EXPECT_EQ(3, vm.dispatch_count(OpCode::JMP));
+  // main's RET stops the VM
+  EXPECT_EQ(1, vm.dispatch_count(OpCode::RET));
+  EXPECT_EQ(1, vm.dispatch_count(OpCode::WRITE));
+}
+
+TEST(BasicVMTest, ListingShowsInstructionsAsAdded) {
+  VMFrameInfo f {"f", 1};
+  f.instructions.push_back(VMInstr::STORE(0));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::ADDI());
+  f.instructions.push_back(VMInstr::STORE(0));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(2.5));
+  main.instructions.push_back(VMInstr::POP());
+  main.instructions.push_back(VMInstr::ALLOCS("P"));
+  VMInstr getf = VMInstr::GETF(0);
+  getf.set_comment("x");
+  main.instructions.push_back(getf);
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::PUSH(3));
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::ALLOCA("int"));
+  VM vm;
+  vm.add_struct("P", {"x"});
+  vm.add(f);
+  vm.add(main);
+  string code = to_string(vm);
+  // encoded (and fused) instructions are listed as they were added
+  EXPECT_NE(string::npos, code.find("  1: LOAD(0)\n  2: PUSH(1)\n"));
+  EXPECT_NE(string::npos, code.find("  3: ADDI()\n  4: STORE(0)\n"));
+  EXPECT_NE(string::npos, code.find("  0: PUSH(2.500000)\n  1: POP()\n"));
+  EXPECT_NE(string::npos, code.find("  2: ALLOCS(P)\n  3: GETF(0)  // x\n"));
+  EXPECT_NE(string::npos, code.find("  4: CALL(f)\n  5: PUSH(3)\n"));
+  EXPECT_NE(string::npos, code.find("  6: PUSH(null)\n  7: ALLOCA(int)\n"));
+  // as are the instructions in errors
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: null reference ";
+    msg += "(in f at 3: ADDI())";
+    EXPECT_EQ(msg, err);
+  }
+}
+
 //----------------------------------------------------------------------
 // Functions
 //----------------------------------------------------------------------
@@ -1419,6 +1727,179 @@ TEST(BasicVMTest, RecursiveSumFunction) {
   restore_cout();
 }
 
+TEST(BasicVMTest, FunctionWithoutStoreProlog) {
+  // int f(int x, int y) {return y - x}, using the args as operands
+  VMFrameInfo f {"f", 2};
+  f.instructions.push_back(VMInstr::SUB());      // x on top, y below
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(3));
+  main.instructions.push_back(VMInstr::PUSH(10));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(f);
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("7", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, InfiniteRecursionStackOverflow) {
+  VMFrameInfo f {"f", 0};
+  f.instructions.push_back(VMInstr::CALL("f"));    // f()
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::CALL("f"));
+  VM vm;
+  vm.add(f);
+  vm.add(main);
+  vm.set_max_call_depth(100);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: stack overflow ";
+    msg += "(in f at 0: CALL(f))";
+    EXPECT_EQ(msg, err);
+  }
+}
+
+TEST(BasicVMTest, TailCallReusesFrame) {
+  // int sum(int x, int acc) {if (x <= 0) {return acc} return sum(x-1, acc+x)}
+  VMFrameInfo f {"sum", 2};
+  f.instructions.push_back(VMInstr::STORE(0));        // x -> var[0]
+  f.instructions.push_back(VMInstr::STORE(1));        // acc -> var[1]
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(0));
+  f.instructions.push_back(VMInstr::CMPLE());         // x <= 0
+  f.instructions.push_back(VMInstr::JMPF(8));
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::RET());           // return acc
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::SUB());           // x - 1
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::ADD());           // acc + x
+  f.instructions.push_back(VMInstr::TAILCALL("sum")); // return sum(...)
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(10000));
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::CALL("sum"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(f);
+  vm.add(main);
+  vm.set_max_call_depth(2);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("50005000", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, DeepRecursionReusesFrames) {
+  // int sum(int x) {if (x <= 0) {return 0} return x + sum(x-1)}
+  VMFrameInfo f {"sum", 1};
+  f.instructions.push_back(VMInstr::STORE(0));     // x -> var[0]
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(0));
+  f.instructions.push_back(VMInstr::CMPLE());      // x <= 0
+  f.instructions.push_back(VMInstr::JMPF(7));
+  f.instructions.push_back(VMInstr::PUSH(0));
+  f.instructions.push_back(VMInstr::RET());        // return 0
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::SUB());        // x - 1
+  f.instructions.push_back(VMInstr::CALL("sum"));
+  f.instructions.push_back(VMInstr::ADD());        // x + sum(x-1)
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1000));
+  main.instructions.push_back(VMInstr::CALL("sum"));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(" "));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(1000));
+  main.instructions.push_back(VMInstr::CALL("sum"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(f);
+  vm.add(main);
+  // main and sum(1000) down to sum(0) just fit, each time
+  vm.set_max_call_depth(1002);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  vm.run();
+  EXPECT_EQ("500500 500500500500 500500", out.str());
+  restore_cout();
+  // one frame fewer overflows at the last call
+  vm.set_max_call_depth(1001);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: stack overflow ";
+    msg += "(in sum at 11: CALL(sum))";
+    EXPECT_EQ(msg, err);
+  }
+}
+
+TEST(BasicVMTest, CallToUndefinedFunction) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: undefined function 'f' ";
+    msg += "(in main at 1: CALL(f))";
+    EXPECT_EQ(msg, err);
+  }
+  // (reported when linking, before anything runs)
+  EXPECT_EQ("", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, CallToFunctionAddedAfterCaller) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(4));
+  main.instructions.push_back(VMInstr::CALL("g"));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VMFrameInfo f {"f", 1};
+  f.instructions.push_back(VMInstr::PUSH(2));
+  f.instructions.push_back(VMInstr::MUL());
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo g {"g", 1};
+  g.instructions.push_back(VMInstr::PUSH(1));
+  g.instructions.push_back(VMInstr::ADD());
+  g.instructions.push_back(VMInstr::RET());
+  VM vm;
+  vm.add(main);
+  vm.add(f);
+  vm.add(g);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("10", out.str());
+  restore_cout();
+}
+
 //----------------------------------------------------------------------
 // Heap-Related
 //----------------------------------------------------------------------
@@ -1457,6 +1938,87 @@ TEST(BasicVMTest, OneFieldStructAlloc) {
   restore_cout();
 }
 
+TEST(BasicVMTest, TwoFieldStructSlotAccess) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::ALLOCS());
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::ADDF("field_1"));  // slot 0
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::ADDF("field_2"));  // slot 1
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::PUSH("blue"));
+  main.instructions.push_back(VMInstr::SETF(1));
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::GETF("field_2"));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::PUSH("green"));
+  main.instructions.push_back(VMInstr::SETF("field_1"));
+  main.instructions.push_back(VMInstr::GETF(0));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("bluegreen", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, StructTypeAlloc) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::ALLOCS("Pair"));  // x, y are null
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::PUSH(7));
+  main.instructions.push_back(VMInstr::SETF("y"));
+  main.instructions.push_back(VMInstr::GETF(0));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::GETF(1));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add_struct("Pair", {"x", "y"});
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("null7", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, UndefinedStructTypeAlloc) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::ALLOCS("Pair"));
+  VM vm;
+  try {
+    vm.add(main);
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    EXPECT_EQ("VM Error: ALLOCS(Pair): undefined struct type", err);
+  }
+}
+
+TEST(BasicVMTest, ArrayLengthOfStructIsInvalidReference) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::ALLOCS());
+  main.instructions.push_back(VMInstr::ALEN());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: invalid object reference ";
+    msg += "(in main at 1: ALEN())";
+    EXPECT_EQ(msg, err);
+  }
+  restore_cout();
+}
+
 TEST(BasicVMTest, OneFieldTwoStructAlloc) {
   VMFrameInfo main {"main", 0};                      
   main.instructions.push_back(VMInstr::ALLOCS());
@@ -1578,6 +2140,173 @@ TEST(BasicVMTest, NullObjectFieldSet) {
   restore_cout();
 }
 
+TEST(BasicVMTest, GarbageCollectionKeepsReachableObjects) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::STORE(0));       // i = 0
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::STORE(1));       // head = null
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1000));
+  main.instructions.push_back(VMInstr::CMPLT());
+  main.instructions.push_back(VMInstr::JMPF(24));       // while i < 1000
+  main.instructions.push_back(VMInstr::ALLOCS());
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::ADDF("next"));
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::LOAD(1));
+  main.instructions.push_back(VMInstr::SETF("next"));
+  main.instructions.push_back(VMInstr::STORE(1));       // head = new node
+  main.instructions.push_back(VMInstr::PUSH(10));
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::ALLOCA());
+  main.instructions.push_back(VMInstr::POP());          // garbage array
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(0));       // i = i + 1
+  main.instructions.push_back(VMInstr::JMP(4));
+  main.instructions.push_back(VMInstr::NOP());
+  VM vm;
+  vm.set_gc_threshold(4096);
+  vm.add(main);
+  vm.run();
+  // all 1000 nodes are reachable, but the 1000 arrays are garbage
+  EXPECT_LE(1000, vm.live_object_count());
+  EXPECT_GT(2000, vm.live_object_count());
+}
+
+TEST(BasicVMTest, IncrementalGarbageCollection) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::STORE(0));       // i = 0
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::STORE(1));       // head = null
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1000));
+  main.instructions.push_back(VMInstr::CMPLT());
+  main.instructions.push_back(VMInstr::JMPF(24));       // while i < 1000
+  main.instructions.push_back(VMInstr::ALLOCS());
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::ADDF("next"));
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::LOAD(1));
+  main.instructions.push_back(VMInstr::SETF("next"));
+  main.instructions.push_back(VMInstr::STORE(1));       // head = new node
+  main.instructions.push_back(VMInstr::PUSH(10));
+  main.instructions.push_back(VMInstr::LOAD(1));
+  main.instructions.push_back(VMInstr::ALLOCA());
+  main.instructions.push_back(VMInstr::POP());          // garbage array
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(0));       // i = i + 1
+  main.instructions.push_back(VMInstr::JMP(4));
+  main.instructions.push_back(VMInstr::NOP());
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::STORE(0));       // n = 0
+  main.instructions.push_back(VMInstr::LOAD(1));
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::CMPNE());
+  main.instructions.push_back(VMInstr::JMPF(39));       // while head != null
+  main.instructions.push_back(VMInstr::LOAD(1));
+  main.instructions.push_back(VMInstr::GETF("next"));
+  main.instructions.push_back(VMInstr::STORE(1));       // head = head.next
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(0));       // n = n + 1
+  main.instructions.push_back(VMInstr::JMP(27));
+  main.instructions.push_back(VMInstr::NOP());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.set_gc_threshold(4096);
+  vm.set_gc_slice_budget(chrono::microseconds(1));
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("1000", out.str());
+  restore_cout();
+  EXPECT_LT(0, vm.gc_pauses().count());
+  EXPECT_GT(2000, vm.live_object_count());
+}
+
+TEST(BasicVMTest, IncrementalCollectionPausesStayNearBudget) {
+  // void f(int n) {Node x = new Node; new int[10]; if (n > 0) {f(n - 1)}}
+  // 50000 calls deep, so the value stack holds 50000 live objects
+  VMFrameInfo f {"f", 1};
+  f.instructions.push_back(VMInstr::STORE(0));        // n
+  f.instructions.push_back(VMInstr::ALLOCS());
+  f.instructions.push_back(VMInstr::STORE(1));        // x = new node
+  f.instructions.push_back(VMInstr::PUSH(10));
+  f.instructions.push_back(VMInstr::PUSH(0));
+  f.instructions.push_back(VMInstr::ALLOCA());
+  f.instructions.push_back(VMInstr::POP());           // garbage array
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(0));
+  f.instructions.push_back(VMInstr::CMPGT());
+  f.instructions.push_back(VMInstr::JMPF(16));        // n > 0
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::SUB());
+  f.instructions.push_back(VMInstr::CALL("f"));       // f(n - 1)
+  f.instructions.push_back(VMInstr::POP());
+  f.instructions.push_back(VMInstr::PUSH(nullptr));
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(50000));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::POP());
+  VM vm;
+  vm.set_gc_threshold(64 * 1024);
+  vm.set_gc_slice_budget(chrono::microseconds(100));
+  vm.add(f);
+  vm.add(main);
+  vm.run();
+  // a slice only overruns its budget by the time to trace 256 values
+  // and to scan the running frame's window (the odd slice can still be
+  // descheduled, so the bound is on the 99th percentile)
+  const VMPauseHistogram& pauses = vm.gc_pauses();
+  EXPECT_LT(100, pauses.count());
+  EXPECT_GE(chrono::microseconds(512), pauses.percentile(99));
+}
+
+TEST(BasicVMTest, HeapPoolStatistics) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(100));
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::ALLOCA("int"));  // 400 bytes of ints
+  main.instructions.push_back(VMInstr::STORE(0));
+  VM vm;
+  vm.add(main);
+  vm.run();
+  // the ints come from the 512 byte size class
+  const VMPool& pool = vm.heap_pool();
+  EXPECT_EQ(512, pool.size_classes()[5].block_size);
+  EXPECT_EQ(1, pool.size_classes()[5].live);
+  EXPECT_EQ(1, pool.size_classes()[5].chunks);
+  EXPECT_EQ(0, pool.large_allocations());
+}
+
+TEST(BasicVMTest, StringPayloadsOutliveAllocatingThread) {
+  // a string boxed on a thread that then exits, freed on this thread
+  auto live = [] {
+    size_t count = 0;
+    for (const VMPool::SizeClass& size_class : VMString::pool().size_classes())
+      count += size_class.live;
+    return count;
+  };
+  size_t before = live();
+  VMBox box;
+  thread([&box] {box = VMBox(string("blue"));}).join();
+  EXPECT_EQ(before + 1, live());
+  EXPECT_EQ("blue", box.as_string());
+  box = VMBox();
+  EXPECT_EQ(before, live());
+}
+
 TEST(BasicVMTest, BasicArrayAlloc) {
   VMFrameInfo main {"main", 0};                      
   main.instructions.push_back(VMInstr::PUSH(10));    // length
@@ -1639,6 +2368,67 @@ TEST(BasicVMTest, BasicArrayIndexUpdate) {
   restore_cout();
 }
 
+TEST(BasicVMTest, TypedArrayNullElements) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(3));        // length
+  main.instructions.push_back(VMInstr::PUSH(nullptr));  // fill with nulls
+  main.instructions.push_back(VMInstr::ALLOCA("int"));
+  main.instructions.push_back(VMInstr::STORE(0));       // x = oid
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));        // push index 1
+  main.instructions.push_back(VMInstr::PUSH(10));       // push value 10
+  main.instructions.push_back(VMInstr::SETI());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));        // push index 1
+  main.instructions.push_back(VMInstr::PUSH(nullptr));  // leaves it as 10
+  main.instructions.push_back(VMInstr::SETI());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::GETI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::GETI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::ALEN());
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("null103", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, TypedDoubleAndBoolArrays) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(2));
+  main.instructions.push_back(VMInstr::PUSH(1.5));
+  main.instructions.push_back(VMInstr::ALLOCA("double"));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::GETI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(2));
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::ALLOCA("bool"));
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::PUSH(true));
+  main.instructions.push_back(VMInstr::SETI());
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::GETI());
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("1.500000true", out.str());
+  restore_cout();
+}
+
 TEST(BasicVMTest, LoopWithDifferentIndexUpdates) {
   VMFrameInfo main {"main", 0};
   main.instructions.push_back(VMInstr::PUSH(3));     // push 3
@@ -2189,6 +2979,27 @@ TEST(BasicVMTest, ConcatStrings) {
   restore_cout();
 }
 
+TEST(BasicVMTest, ConcatLeavesSharedStringsUnchanged) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH("blue"));
+  main.instructions.push_back(VMInstr::STORE(0));      // x = "blue"
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH("green"));
+  main.instructions.push_back(VMInstr::CONCAT());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH("blue"));  // same literal
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("bluegreenblueblue", out.str());
+  restore_cout();
+}
+
 TEST(BasicVMTest, NullConcatFirstOperand) {
   VMFrameInfo main {"main", 0};                      
   main.instructions.push_back(VMInstr::PUSH(nullptr));  